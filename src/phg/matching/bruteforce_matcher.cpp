@@ -1,9 +1,67 @@
 #include "bruteforce_matcher.h"
+#include "distances.h"
 
 #include <iostream>
+#include <algorithm>
 #include <libutils/rasserts.h>
 
 
+namespace {
+
+    // сумма квадратов с ранним выходом: как только частичная сумма превысила bound, она и возвращается (это уже не точное расстояние)
+    // проверка раз в PARTIAL_DISTANCE_STEP измерений - чтобы внутренний цикл оставался векторизуемым
+    const int PARTIAL_DISTANCE_STEP = 8;
+
+    inline float l2sqrPartial(const float *a, const float *b, int n, float bound)
+    {
+        float sum = 0.f;
+        int i = 0;
+        for (; i + PARTIAL_DISTANCE_STEP <= n; i += PARTIAL_DISTANCE_STEP) {
+            for (int j = i; j < i + PARTIAL_DISTANCE_STEP; ++j) {
+                float d = a[j] - b[j];
+                sum += d * d;
+            }
+            if (sum > bound) {
+                return sum;
+            }
+        }
+        for (; i < n; ++i) {
+            float d = a[i] - b[i];
+            sum += d * d;
+        }
+        return sum;
+    }
+
+    // два ближайших train дескриптора (квадраты расстояний), second_idx == -1 если train дескриптор всего один
+    // partial_distance - кандидаты дальше текущего второго отбрасываются не досчитывая расстояние
+    inline void findTwoNearest(const float *q, const cv::Mat &train_desc, bool partial_distance,
+                               int &best_idx, float &best_dist2, int &second_idx, float &second_dist2)
+    {
+        best_dist2 = std::numeric_limits<float>::max();
+        second_dist2 = std::numeric_limits<float>::max();
+        best_idx = -1;
+        second_idx = -1;
+        for (int ti = 0; ti < train_desc.rows; ++ti) {
+            const float *t = train_desc.ptr<float>(ti);
+            float dist2 = partial_distance ? l2sqrPartial(q, t, train_desc.cols, second_dist2) : phg::l2sqr(q, t, train_desc.cols);
+            if (dist2 < best_dist2) {
+                second_dist2 = best_dist2;
+                second_idx = best_idx;
+                best_dist2 = dist2;
+                best_idx = ti;
+            } else if (dist2 < second_dist2) {
+                second_dist2 = dist2;
+                second_idx = ti;
+            }
+        }
+    }
+
+}
+
+phg::BruteforceMatcher::BruteforceMatcher(bool partial_distance)
+    : partial_distance(partial_distance)
+{}
+
 void phg::BruteforceMatcher::train(const cv::Mat &train_desc)
 {
     if (train_desc.rows < 2) {
@@ -11,6 +69,53 @@ void phg::BruteforceMatcher::train(const cv::Mat &train_desc)
     }
 
     train_desc_ptr = &train_desc;
+
+    dims_order.clear();
+    train_desc_reordered = cv::Mat();
+    if (!partial_distance) {
+        return;
+    }
+
+    if (train_desc.type() != CV_32FC1) {
+        throw std::runtime_error("BruteforceMatcher:: train : partial distance needs CV_32FC1 descriptors");
+    }
+
+    const int n_train_desc = train_desc.rows;
+    const int ndim = train_desc.cols;
+
+    // измерения с большой дисперсией дают больший вклад в расстояние до случайного кандидата - их складываем первыми
+    std::vector<double> sum(ndim, 0.0), sum2(ndim, 0.0);
+    for (int ti = 0; ti < n_train_desc; ++ti) {
+        const float *t = train_desc.ptr<float>(ti);
+        for (int d = 0; d < ndim; ++d) {
+            sum[d] += t[d];
+            sum2[d] += (double) t[d] * t[d];
+        }
+    }
+    std::vector<double> variance(ndim);
+    for (int d = 0; d < ndim; ++d) {
+        double mean = sum[d] / n_train_desc;
+        variance[d] = sum2[d] / n_train_desc - mean * mean;
+    }
+
+    dims_order.resize(ndim);
+    for (int d = 0; d < ndim; ++d) {
+        dims_order[d] = d;
+    }
+    std::stable_sort(dims_order.begin(), dims_order.end(), [&variance](int a, int b) { return variance[a] > variance[b]; });
+
+    train_desc_reordered.create(n_train_desc, ndim, CV_32FC1);
+    #pragma omp parallel for
+    for (int ti = 0; ti < n_train_desc; ++ti) {
+        reorderQuery(train_desc.ptr<float>(ti), train_desc_reordered.ptr<float>(ti));
+    }
+}
+
+void phg::BruteforceMatcher::reorderQuery(const float *q, float *reordered) const
+{
+    for (size_t d = 0; d < dims_order.size(); ++d) {
+        reordered[d] = q[dims_order[d]];
+    }
 }
 
 void phg::BruteforceMatcher::knnMatch(const cv::Mat &query_desc,
@@ -21,8 +126,8 @@ void phg::BruteforceMatcher::knnMatch(const cv::Mat &query_desc,
         throw std::runtime_error("BruteforceMatcher:: knnMatch : matcher is not trained");
     }
 
-    if (k != 2) {
-        throw std::runtime_error("BruteforceMatcher:: knnMatch : only k = 2 supported");
+    if (k < 1 || k > train_desc_ptr->rows) {
+        throw std::runtime_error("BruteforceMatcher:: knnMatch : invalid k");
     }
 
     std::cout << "BruteforceMatcher::knnMatch : n query desc : " << query_desc.rows << ", n train desc : " << train_desc_ptr->rows << std::endl;
@@ -33,45 +138,237 @@ void phg::BruteforceMatcher::knnMatch(const cv::Mat &query_desc,
 
     const cv::Mat &train_desc = *train_desc_ptr;
     const int n_train_desc = train_desc.rows;
+    const int ndim = train_desc.cols;
 
-    #pragma omp parallel for
-    for (int qi = 0; qi < ndesc; ++qi) {
-        std::vector<cv::DMatch> &dst = matches[qi];
-        dst.clear();
-        dst.reserve(2);
-
-        for (int ti = 0; ti < n_train_desc; ++ti) {
-            cv::DMatch match;
-            match.distance = cv::norm(train_desc.row(ti) - query_desc.row(qi), cv::NORM_L2);
-            match.imgIdx = 0;
-            match.queryIdx = qi;
-            match.trainIdx = ti;
-            if (dst.empty()) {
-                dst.push_back(match);
+    if (partial_distance) {
+        rassert(query_desc.type() == CV_32FC1, 8923591235021);
+        rassert(query_desc.cols == ndim, 8923591235022);
+    }
+
+    #pragma omp parallel
+    {
+        std::vector<float> reordered(partial_distance ? ndim : 0);
+
+        #pragma omp for
+        for (int qi = 0; qi < ndesc; ++qi) {
+            std::vector<cv::DMatch> &dst = matches[qi];
+            dst.clear();
+            dst.reserve(k);
+
+            if (partial_distance) {
+                reorderQuery(query_desc.ptr<float>(qi), reordered.data());
             }
-            else
-            if (dst.size() == 1) {
-                dst.push_back(match);
-                if (dst[0].distance > dst[1].distance) {
-                    std::swap(dst[0], dst[1]);
+
+            for (int ti = 0; ti < n_train_desc; ++ti) {
+                cv::DMatch match;
+                if (partial_distance) {
+                    // пока k кандидатов не набралось - считаем полностью
+                    const float bound = (int) dst.size() == k ? dst.back().distance * dst.back().distance : std::numeric_limits<float>::max();
+                    match.distance = std::sqrt(l2sqrPartial(reordered.data(), train_desc_reordered.ptr<float>(ti), ndim, bound));
+                } else {
+                    match.distance = cv::norm(train_desc.row(ti) - query_desc.row(qi), cv::NORM_L2);
                 }
-            }
-            else
-            if (dst.size() == 2) {
-                if (dst[0].distance > match.distance) {
-                    dst[1] = dst[0];
-                    dst[0] = match;
+                match.imgIdx = 0;
+                match.queryIdx = qi;
+                match.trainIdx = ti;
+
+                // dst отсортирован по расстоянию, при равных расстояниях остается сопоставление с меньшим trainIdx
+                if ((int) dst.size() == k && dst.back().distance <= match.distance) {
+                    continue;
+                }
+                if ((int) dst.size() == k) {
+                    dst.pop_back();
                 }
-                else
-                if (dst[1].distance > match.distance) {
-                    dst[1] = match;
+                dst.insert(std::upper_bound(dst.begin(), dst.end(), match), match);
+            }
+        }
+    }
+}
+
+void phg::BruteforceMatcher::knnMatchFlat(const cv::Mat &query_desc, KnnMatches &matches, int k) const
+{
+    if (!train_desc_ptr) {
+        throw std::runtime_error("BruteforceMatcher:: knnMatchFlat : matcher is not trained");
+    }
+
+    if (k != 2) {
+        throw std::runtime_error("BruteforceMatcher:: knnMatchFlat : only k = 2 supported");
+    }
+
+    const cv::Mat &train_desc = *train_desc_ptr;
+    rassert(train_desc.type() == CV_32FC1, 8923591235018);
+    rassert(query_desc.type() == CV_32FC1, 8923591235019);
+    rassert(query_desc.cols == train_desc.cols, 8923591235020);
+
+    std::cout << "BruteforceMatcher::knnMatchFlat : n query desc : " << query_desc.rows << ", n train desc : " << train_desc.rows << std::endl;
+
+    const int ndesc = query_desc.rows;
+    matches.resize(ndesc, 2);
+
+    const cv::Mat &search_desc = partial_distance ? train_desc_reordered : train_desc;
+
+    #pragma omp parallel
+    {
+        std::vector<float> reordered(partial_distance ? query_desc.cols : 0);
+
+        #pragma omp for schedule(dynamic, 16)
+        for (int qi = 0; qi < ndesc; ++qi) {
+            const float *q = query_desc.ptr<float>(qi);
+            if (partial_distance) {
+                reorderQuery(q, reordered.data());
+                q = reordered.data();
+            }
+
+            int best_idx, second_idx;
+            float best_dist2, second_dist2;
+            findTwoNearest(q, search_desc, partial_distance, best_idx, best_dist2, second_idx, second_dist2);
+
+            matches.train_idx[2 * qi] = best_idx;
+            matches.distance[2 * qi] = std::sqrt(best_dist2);
+            matches.train_idx[2 * qi + 1] = second_idx;
+            matches.distance[2 * qi + 1] = second_idx == -1 ? std::numeric_limits<float>::max() : std::sqrt(second_dist2);
+        }
+    }
+}
+
+void phg::BruteforceMatcher::matchRatio(const cv::Mat &query_desc, float ratio, std::vector<cv::DMatch> &matches) const
+{
+    if (!train_desc_ptr) {
+        throw std::runtime_error("BruteforceMatcher:: matchRatio : matcher is not trained");
+    }
+    if (!(ratio > 0.f && ratio <= 1.f)) {
+        throw std::runtime_error("BruteforceMatcher:: matchRatio : invalid ratio");
+    }
+
+    const cv::Mat &train_desc = *train_desc_ptr;
+    rassert(train_desc.type() == CV_32FC1, 8923591235015);
+    rassert(query_desc.type() == CV_32FC1, 8923591235016);
+    rassert(query_desc.cols == train_desc.cols, 8923591235017);
+
+    std::cout << "BruteforceMatcher::matchRatio : n query desc : " << query_desc.rows << ", n train desc : " << train_desc.rows << std::endl;
+
+    const int ndesc = query_desc.rows;
+    // сравниваем квадраты: d1 < ratio * d2 <=> d1^2 < ratio^2 * d2^2
+    const float ratio2 = ratio * ratio;
+
+    // по одному слоту на query, потом сжимаем выжившие подряд (порядок по queryIdx сохраняется)
+    std::vector<cv::DMatch> best(ndesc);
+    std::vector<char> passed(ndesc, false);
+
+    const cv::Mat &search_desc = partial_distance ? train_desc_reordered : train_desc;
+
+    #pragma omp parallel
+    {
+        std::vector<float> reordered(partial_distance ? query_desc.cols : 0);
+
+        #pragma omp for schedule(dynamic, 16)
+        for (int qi = 0; qi < ndesc; ++qi) {
+            const float *q = query_desc.ptr<float>(qi);
+            if (partial_distance) {
+                reorderQuery(q, reordered.data());
+                q = reordered.data();
+            }
+
+            int best_idx, second_idx;
+            float best_dist2, second_dist2;
+            findTwoNearest(q, search_desc, partial_distance, best_idx, best_dist2, second_idx, second_dist2);
+            if (best_idx != -1 && best_dist2 < ratio2 * second_dist2) {
+                best[qi] = cv::DMatch(qi, best_idx, std::sqrt(best_dist2));
+                passed[qi] = true;
+            }
+        }
+    }
+
+    matches.clear();
+    for (int qi = 0; qi < ndesc; ++qi) {
+        if (passed[qi]) {
+            matches.push_back(best[qi]);
+        }
+    }
+}
+
+void phg::BruteforceMatcher::matchMutual(const cv::Mat &query_desc, std::vector<cv::DMatch> &matches) const
+{
+    if (!train_desc_ptr) {
+        throw std::runtime_error("BruteforceMatcher:: matchMutual : matcher is not trained");
+    }
+
+    const cv::Mat &train_desc = *train_desc_ptr;
+    rassert(train_desc.type() == CV_32FC1, 8923591235012);
+    rassert(query_desc.type() == CV_32FC1, 8923591235013);
+    rassert(query_desc.cols == train_desc.cols, 8923591235014);
+
+    std::cout << "BruteforceMatcher::matchMutual : n query desc : " << query_desc.rows << ", n train desc : " << train_desc.rows << std::endl;
+
+    const int ndesc = query_desc.rows;
+    const int n_train_desc = train_desc.rows;
+    const int ndim = query_desc.cols;
+    const int block_size = 64; // блок train дескрипторов остается в кеше пока с ним сравниваются все query блока
+
+    std::vector<float> query_best_dist2(ndesc, std::numeric_limits<float>::max());
+    std::vector<int> query_best_idx(ndesc, -1);
+    std::vector<float> train_best_dist2(n_train_desc, std::numeric_limits<float>::max());
+    std::vector<int> train_best_idx(n_train_desc, -1);
+
+    #pragma omp parallel
+    {
+        // каждый поток копит свои лучшие сопоставления для train дескрипторов, в конце они сливаются
+        std::vector<float> local_train_best_dist2(n_train_desc, std::numeric_limits<float>::max());
+        std::vector<int> local_train_best_idx(n_train_desc, -1);
+
+        #pragma omp for schedule(dynamic)
+        for (int q0 = 0; q0 < ndesc; q0 += block_size) {
+            const int q1 = std::min(q0 + block_size, ndesc);
+            for (int t0 = 0; t0 < n_train_desc; t0 += block_size) {
+                const int t1 = std::min(t0 + block_size, n_train_desc);
+                for (int qi = q0; qi < q1; ++qi) {
+                    const float *q = query_desc.ptr<float>(qi);
+                    float best_dist2 = query_best_dist2[qi];
+                    int best_idx = query_best_idx[qi];
+                    for (int ti = t0; ti < t1; ++ti) {
+                        // каждое расстояние считается один раз и обновляет лучшее и по строке, и по столбцу
+                        float dist2 = l2sqr(q, train_desc.ptr<float>(ti), ndim);
+                        if (dist2 < best_dist2) {
+                            best_dist2 = dist2;
+                            best_idx = ti;
+                        }
+                        if (dist2 < local_train_best_dist2[ti]) {
+                            local_train_best_dist2[ti] = dist2;
+                            local_train_best_idx[ti] = qi;
+                        }
+                    }
+                    query_best_dist2[qi] = best_dist2;
+                    query_best_idx[qi] = best_idx;
                 }
             }
-            else {
-                // если внутри openmp цикла бросить исключение, то программа упадет с сегфолтом
-                // нужно либо перехватывать исключения и обрабатывать их вне цикла, либо оповещать об ошибках иначе
-                std::cerr << "BruteforceMatcher:: knnMatch : invalid number of matches" << std::endl;
+        }
+
+        #pragma omp critical
+        {
+            for (int ti = 0; ti < n_train_desc; ++ti) {
+                if (local_train_best_idx[ti] == -1) {
+                    continue;
+                }
+                // при равных расстояниях побеждает меньший индекс - чтобы результат не зависел от числа потоков
+                if (local_train_best_dist2[ti] < train_best_dist2[ti]
+                    || (local_train_best_dist2[ti] == train_best_dist2[ti] && local_train_best_idx[ti] < train_best_idx[ti])) {
+                    train_best_dist2[ti] = local_train_best_dist2[ti];
+                    train_best_idx[ti] = local_train_best_idx[ti];
+                }
             }
         }
     }
+
+    matches.clear();
+    for (int qi = 0; qi < ndesc; ++qi) {
+        int ti = query_best_idx[qi];
+        if (ti != -1 && train_best_idx[ti] == qi) {
+            matches.emplace_back(qi, ti, std::sqrt(query_best_dist2[qi]));
+        }
+    }
+}
+
+size_t phg::BruteforceMatcher::memoryUsage() const
+{
+    return train_desc_reordered.total() * train_desc_reordered.elemSize() + dims_order.size() * sizeof(int);
 }
@@ -6,12 +6,37 @@ namespace phg {
 
     struct BruteforceMatcher : DescriptorMatcher {
 
+        // partial_distance - ранний отказ от кандидата: при train() измерения упорядочиваются по убыванию дисперсии train дескрипторов,
+        // и сумма квадратов для train дескриптора перестает накапливаться как только превысила текущего k-го лучшего
+        // (на SIFT большинство кандидатов отсеивается по первым нескольким десяткам измерений из 128),
+        // выгоднее всего когда кандидатов немного и блочный перебор не окупается (например guided matching)
+        BruteforceMatcher(bool partial_distance = false);
+
         void train(const cv::Mat &train_desc) override;
 
         void knnMatch(const cv::Mat &query_desc, std::vector<std::vector<cv::DMatch>> &matches, int k) const override;
 
+        void knnMatchFlat(const cv::Mat &query_desc, KnnMatches &matches, int k) const override;
+
+        void matchRatio(const cv::Mat &query_desc, float ratio, std::vector<cv::DMatch> &matches) const override;
+
+        // взаимно ближайшие соседи (cross-check) за один проход по матрице расстояний:
+        // пара (qi, ti) попадает в результат если ti - ближайший к qi среди train, а qi - ближайший к ti среди query
+        void matchMutual(const cv::Mat &query_desc, std::vector<cv::DMatch> &matches) const;
+
+        // в режиме partial_distance - переупорядоченная копия train дескрипторов
+        size_t memoryUsage() const override;
+
     private:
 
+        // query дескриптор в порядке измерений переупорядоченных train дескрипторов
+        void reorderQuery(const float *q, float *reordered) const;
+
+        bool partial_distance;
+
+        std::vector<int> dims_order;      // измерения по убыванию дисперсии (только в режиме partial_distance)
+        cv::Mat train_desc_reordered;     // train дескрипторы с измерениями в порядке dims_order
+
         const cv::Mat *train_desc_ptr = nullptr;
     };
 
@@ -1,6 +1,8 @@
 #include "bruteforce_matcher_gpu.h"
 
 #include <iostream>
+#include <cstring>
+#include <algorithm>
 #include <libutils/misc.h>
 #include <libutils/timer.h>
 #include <libutils/rasserts.h>
@@ -13,6 +15,39 @@
 
 #define BF_MATCHER_GPU_VERBOSE 0
 
+namespace {
+
+    // по умолчанию gpu::chooseDevice предпочитает видеокарту, с cpu_device - первое CPU OpenCL устройство
+    bool findDevice(bool cpu_device, gpu::Device &device)
+    {
+        if (!cpu_device) {
+            device = gpu::chooseDevice(BF_MATCHER_GPU_VERBOSE);
+            return device.supports_opencl;
+        }
+
+        std::vector<gpu::Device> devices = gpu::enumDevices();
+        for (const gpu::Device &candidate : devices) {
+            if (candidate.supports_opencl && candidate.is_cpu) {
+                device = candidate;
+                return true;
+            }
+        }
+        return false;
+    }
+
+}
+
+phg::BruteforceMatcherGPU::BruteforceMatcherGPU(bool tiled_kernel, bool cpu_device)
+    : tiled_kernel(tiled_kernel)
+    , cpu_device(cpu_device)
+{}
+
+bool phg::BruteforceMatcherGPU::hasDevice(bool cpu_device)
+{
+    gpu::Device device;
+    return findDevice(cpu_device, device);
+}
+
 void phg::BruteforceMatcherGPU::train(const cv::Mat &train_desc)
 {
     if (train_desc.rows < 2) {
@@ -36,9 +71,129 @@ void phg::BruteforceMatcherGPU::knnMatch(const cv::Mat &query_desc,
 
     std::cout << "BruteforceMatcherGPU::knnMatch : n query desc : " << query_desc.rows << ", n train desc : " << train_desc_ptr->rows << std::endl;
 
-    gpu::Device device = gpu::chooseDevice(BF_MATCHER_GPU_VERBOSE);
-    if (!device.supports_opencl) {
-        throw std::runtime_error("No OpenCL device found");
+    const int ndesc = query_desc.rows;
+
+    std::vector<float> distance2_res;
+    std::vector<unsigned int> train_idx_res, query_idx_res;
+    runKernel(query_desc, distance2_res, train_idx_res, query_idx_res, nullptr);
+
+    timer t;
+    matches.resize(ndesc);
+    for (int qi = 0; qi < ndesc; ++qi) {
+        std::vector<cv::DMatch> &dst = matches[qi];
+        dst.resize(2);
+
+        for (int ki = 0; ki < 2; ++ki) {
+            cv::DMatch match;
+            match.distance = std::sqrt(distance2_res[qi * 2 + ki]); // кернел хранит квадраты расстояний
+            match.imgIdx = 0;
+            match.queryIdx = query_idx_res[qi * 2 + ki];
+            match.trainIdx = train_idx_res[qi * 2 + ki];
+            if (!(match.queryIdx == qi)) {
+                std::cerr << match.queryIdx << " != " << qi << std::endl;
+            }
+            rassert(match.queryIdx == qi, 345151241241251);
+            dst[ki] = match;
+        }
+        rassert(dst[0].distance <= dst[1].distance, 645151255341241251);
+    }
+    if (BF_MATCHER_GPU_VERBOSE) std::cout << "[BFMatcher] data unpacked in " << t.elapsed() << " s" << std::endl;
+}
+
+void phg::BruteforceMatcherGPU::knnMatchFlat(const cv::Mat &query_desc, KnnMatches &matches, int k) const
+{
+    if (!train_desc_ptr) {
+        throw std::runtime_error("BruteforceMatcher:: knnMatchFlat : matcher is not trained");
+    }
+
+    if (k != 2) {
+        throw std::runtime_error("BruteforceMatcher:: knnMatchFlat : only k = 2 supported");
+    }
+
+    std::cout << "BruteforceMatcherGPU::knnMatchFlat : n query desc : " << query_desc.rows << ", n train desc : " << train_desc_ptr->rows << std::endl;
+
+    const int ndesc = query_desc.rows;
+
+    std::vector<float> distance2_res;
+    std::vector<unsigned int> train_idx_res, query_idx_res;
+    runKernel(query_desc, distance2_res, train_idx_res, query_idx_res, nullptr);
+
+    // кернел и так выдает результаты в раскладке qi * 2 + ki
+    matches.resize(ndesc, 2);
+    for (int i = 0; i < 2 * ndesc; ++i) {
+        rassert(query_idx_res[i] == (unsigned int) (i / 2), 345151241241252);
+        matches.train_idx[i] = (int) train_idx_res[i];
+        matches.distance[i] = std::sqrt(distance2_res[i]);
+    }
+}
+
+void phg::BruteforceMatcherGPU::matchRatio(const cv::Mat &query_desc, float ratio, std::vector<cv::DMatch> &matches) const
+{
+    if (!train_desc_ptr) {
+        throw std::runtime_error("BruteforceMatcherGPU:: matchRatio : matcher is not trained");
+    }
+    if (!(ratio > 0.f && ratio <= 1.f)) {
+        throw std::runtime_error("BruteforceMatcherGPU:: matchRatio : invalid ratio");
+    }
+
+    std::cout << "BruteforceMatcherGPU::matchRatio : n query desc : " << query_desc.rows << ", n train desc : " << train_desc_ptr->rows << std::endl;
+
+    std::vector<float> distance2_res;
+    std::vector<unsigned int> train_idx_res, query_idx_res;
+    runKernel(query_desc, distance2_res, train_idx_res, query_idx_res, nullptr, ratio);
+
+    const size_t nmatches = distance2_res.size();
+    matches.resize(nmatches);
+    for (size_t i = 0; i < nmatches; ++i) {
+        matches[i] = cv::DMatch((int) query_idx_res[i], (int) train_idx_res[i], std::sqrt(distance2_res[i]));
+    }
+    // рабочие группы пишут результаты в порядке завершения
+    std::sort(matches.begin(), matches.end(), [](const cv::DMatch &a, const cv::DMatch &b) {
+        return a.queryIdx < b.queryIdx;
+    });
+}
+
+void phg::BruteforceMatcherGPU::matchMutual(const cv::Mat &query_desc, std::vector<cv::DMatch> &matches) const
+{
+    if (!train_desc_ptr) {
+        throw std::runtime_error("BruteforceMatcher:: matchMutual : matcher is not trained");
+    }
+
+    std::cout << "BruteforceMatcherGPU::matchMutual : n query desc : " << query_desc.rows << ", n train desc : " << train_desc_ptr->rows << std::endl;
+
+    const int ndesc = query_desc.rows;
+    const int n_train_desc = train_desc_ptr->rows;
+
+    std::vector<float> distance2_res;
+    std::vector<unsigned int> train_idx_res, query_idx_res;
+    std::vector<unsigned int> train_best_dist2;
+    runKernel(query_desc, distance2_res, train_idx_res, query_idx_res, &train_best_dist2);
+
+    // query qi взаимно ближайший для своего лучшего train если их расстояние совпадает с минимальным расстоянием до этого train
+    // при равных расстояниях берем query с меньшим индексом, как и CPU версия
+    std::vector<char> train_used(n_train_desc, false);
+    matches.clear();
+    for (int qi = 0; qi < ndesc; ++qi) {
+        float dist2 = distance2_res[qi * 2];
+        unsigned int ti = train_idx_res[qi * 2];
+        rassert(ti < (unsigned int) n_train_desc, 2395812390581);
+
+        unsigned int dist2_bits;
+        std::memcpy(&dist2_bits, &dist2, sizeof(dist2_bits));
+        if (dist2_bits == train_best_dist2[ti] && !train_used[ti]) {
+            train_used[ti] = true;
+            matches.emplace_back(qi, (int) ti, std::sqrt(dist2));
+        }
+    }
+}
+
+void phg::BruteforceMatcherGPU::runKernel(const cv::Mat &query_desc,
+                                          std::vector<float> &distance2_res, std::vector<unsigned int> &train_idx_res, std::vector<unsigned int> &query_idx_res,
+                                          std::vector<unsigned int> *train_best_dist2, float ratio) const
+{
+    gpu::Device device;
+    if (!findDevice(cpu_device, device)) {
+        throw std::runtime_error(cpu_device ? "No CPU OpenCL device found" : "No OpenCL device found");
     }
 
     gpu::Context context;
@@ -53,11 +208,16 @@ void phg::BruteforceMatcherGPU::knnMatch(const cv::Mat &query_desc,
 
     const int ndesc = query_desc.rows;
     const int n_train_desc = train_desc_ptr->rows;
+    const bool cross_check = train_best_dist2 != nullptr;
+    const bool ratio_test = ratio > 0.f;
+    rassert(!(cross_check && ratio_test), 2358123951235);
 
     timer t;
     gpu::gpu_mem_32f train_data, query_data;
     gpu::gpu_mem_32f res_matches_distance;
     gpu::gpu_mem_32u res_matches_train_idx, res_matches_query_idx;
+    gpu::gpu_mem_32u res_train_best_dist2;
+    gpu::gpu_mem_32u res_count;
 
     train_data.resizeN(n_train_desc * ndim);  // массивы в видеопамяти с дескрипторами (выложенными подряд)
     query_data.resizeN(ndesc * ndim);         // массивы в видеопамяти с дескрипторами (выложенными подряд)
@@ -68,13 +228,32 @@ void phg::BruteforceMatcherGPU::knnMatch(const cv::Mat &query_desc,
     rassert(query_desc.isContinuous(), 352365262346252);
     train_data.write(train_desc_ptr->ptr(), train_data.size()); // прогрузили дескрипторы в видеопамять
     query_data.write(query_desc.ptr(), query_data.size());      // прогрузили дескрипторы в видеопамять
+    if (cross_check) {
+        // минимальные квадраты расстояний до каждого train, изначально +бесконечность (неотрицательные float сравниваются как uint)
+        train_best_dist2->assign(n_train_desc, std::numeric_limits<unsigned int>::max());
+        res_train_best_dist2.resizeN(n_train_desc);
+        res_train_best_dist2.writeN(train_best_dist2->data(), n_train_desc);
+    }
+    if (ratio_test) {
+        const unsigned int zero = 0;
+        res_count.resizeN(1);
+        res_count.writeN(&zero, 1);
+    }
 
     if (BF_MATCHER_GPU_VERBOSE) std::cout << "[BFMatcher] data allocated and loaded in " << t.elapsed() << " s" << std::endl;
 
     t.restart();
     const unsigned int keypoints_per_wg = 4;
-    std::string kernel_defines = "-D KEYPOINTS_PER_WG=" + to_string(keypoints_per_wg);
-    ocl::Kernel bruteforce_matcher(bruteforce_matcher_kernel, bruteforce_matcher_kernel_length, "bruteforce_matcher", kernel_defines);
+    const unsigned int tiled_work_group_size = 64;
+    std::string kernel_defines = "-D KEYPOINTS_PER_WG=" + to_string(keypoints_per_wg) + " -D TILED_WG_SIZE=" + to_string(tiled_work_group_size);
+    if (cross_check) {
+        kernel_defines += " -D CROSS_CHECK=1";
+    }
+    if (ratio_test) {
+        kernel_defines += " -D RATIO_TEST=1";
+    }
+    ocl::Kernel bruteforce_matcher(bruteforce_matcher_kernel, bruteforce_matcher_kernel_length,
+                                   tiled_kernel ? "bruteforce_matcher_tiled" : "bruteforce_matcher", kernel_defines);
     bruteforce_matcher.compile(BF_MATCHER_GPU_VERBOSE);
     if (BF_MATCHER_GPU_VERBOSE) std::cout << "[BFMatcher] kernel compiled in " << t.elapsed() << " s" << std::endl;
 
@@ -84,40 +263,55 @@ void phg::BruteforceMatcherGPU::knnMatch(const cv::Mat &query_desc,
     unsigned int global_work_size = (ndesc + keypoints_per_wg - 1) / keypoints_per_wg; // каждая рабочая группа обрабатывает keypoints_per_wg=4 дескриптора из query (сопоставляет их со всеми train)
     gpu::WorkSize ws(work_group_size, 1,
                      work_group_size, global_work_size);
-    bruteforce_matcher.exec(ws,
-                            train_data, query_data,
-                            res_matches_train_idx, res_matches_query_idx, res_matches_distance,
-                            n_train_desc, ndesc);
+    if (tiled_kernel) {
+        // один query на поток
+        ws = gpu::WorkSize(tiled_work_group_size, ndesc);
+    }
+    if (cross_check) {
+        bruteforce_matcher.exec(ws,
+                                train_data, query_data,
+                                res_matches_train_idx, res_matches_query_idx, res_matches_distance,
+                                n_train_desc, ndesc,
+                                res_train_best_dist2);
+    } else if (ratio_test) {
+        bruteforce_matcher.exec(ws,
+                                train_data, query_data,
+                                res_matches_train_idx, res_matches_query_idx, res_matches_distance,
+                                n_train_desc, ndesc,
+                                ratio * ratio, res_count);
+    } else {
+        bruteforce_matcher.exec(ws,
+                                train_data, query_data,
+                                res_matches_train_idx, res_matches_query_idx, res_matches_distance,
+                                n_train_desc, ndesc);
+    }
     if (BF_MATCHER_GPU_VERBOSE) std::cout << "[BFMatcher] kernel executed in " << t.elapsed() << " s" << std::endl;
 
     t.restart();
-    std::vector<float> distance_res(ndesc * 2, std::numeric_limits<float>::max());
-    std::vector<unsigned int> train_idx_res(ndesc * 2, std::numeric_limits<unsigned int>::max());
-    std::vector<unsigned int> query_idx_res(ndesc * 2, std::numeric_limits<unsigned int>::max());
-    res_matches_distance.readN(distance_res.data(), ndesc * 2);
+    if (ratio_test) {
+        // читаем только выжившие сопоставления
+        unsigned int nmatches = 0;
+        res_count.readN(&nmatches, 1);
+        rassert(nmatches <= (unsigned int) ndesc, 2358123951236);
+        distance2_res.resize(nmatches);
+        train_idx_res.resize(nmatches);
+        query_idx_res.resize(nmatches);
+        if (nmatches > 0) {
+            res_matches_distance.readN(distance2_res.data(), nmatches);
+            res_matches_train_idx.readN(train_idx_res.data(), nmatches);
+            res_matches_query_idx.readN(query_idx_res.data(), nmatches);
+        }
+        if (BF_MATCHER_GPU_VERBOSE) std::cout << "[BFMatcher] result data loaded in " << t.elapsed() << " s" << std::endl;
+        return;
+    }
+    distance2_res.assign(ndesc * 2, std::numeric_limits<float>::max());
+    train_idx_res.assign(ndesc * 2, std::numeric_limits<unsigned int>::max());
+    query_idx_res.assign(ndesc * 2, std::numeric_limits<unsigned int>::max());
+    res_matches_distance.readN(distance2_res.data(), ndesc * 2);
     res_matches_train_idx.readN(train_idx_res.data(), ndesc * 2);
     res_matches_query_idx.readN(query_idx_res.data(), ndesc * 2);
-    if (BF_MATCHER_GPU_VERBOSE) std::cout << "[BFMatcher] result data loaded in " << t.elapsed() << " s" << std::endl;
-
-    t.restart();
-    matches.resize(ndesc);
-    for (int qi = 0; qi < ndesc; ++qi) {
-        std::vector<cv::DMatch> &dst = matches[qi];
-        dst.resize(2);
-
-        for (int ki = 0; ki < 2; ++ki) {
-            cv::DMatch match;
-            match.distance = distance_res[qi * 2 + ki];
-            match.imgIdx = 0;
-            match.queryIdx = query_idx_res[qi * 2 + ki];
-            match.trainIdx = train_idx_res[qi * 2 + ki];
-            if (!(match.queryIdx == qi)) {
-                std::cerr << match.queryIdx << " != " << qi << std::endl;
-            }
-            rassert(match.queryIdx == qi, 345151241241251);
-            dst[ki] = match;
-        }
-        rassert(dst[0].distance <= dst[1].distance, 645151255341241251);
+    if (cross_check) {
+        res_train_best_dist2.readN(train_best_dist2->data(), n_train_desc);
     }
-    if (BF_MATCHER_GPU_VERBOSE) std::cout << "[BFMatcher] data unpacked in " << t.elapsed() << " s" << std::endl;
+    if (BF_MATCHER_GPU_VERBOSE) std::cout << "[BFMatcher] result data loaded in " << t.elapsed() << " s" << std::endl;
 }
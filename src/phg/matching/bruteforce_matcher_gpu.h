@@ -6,12 +6,38 @@ namespace phg {
 
     struct BruteforceMatcherGPU : DescriptorMatcher {
 
+        // tiled_kernel - кернел bruteforce_matcher_tiled: каждый work-item считает полные расстояния от своего query до блока train дескрипторов
+        // в регистрах, без редукции по измерениям через локальную память (и без барьеров на каждого кандидата)
+        // cpu_device - считать на CPU OpenCL устройстве (например POCL), даже если есть видеокарта
+        BruteforceMatcherGPU(bool tiled_kernel = false, bool cpu_device = false);
+
+        // есть ли OpenCL устройство, которое будет использовано при таком cpu_device
+        static bool hasDevice(bool cpu_device = false);
+
         void train(const cv::Mat &train_desc) override;
 
         void knnMatch(const cv::Mat &query_desc, std::vector<std::vector<cv::DMatch>> &matches, int k) const override;
 
+        void knnMatchFlat(const cv::Mat &query_desc, KnnMatches &matches, int k) const override;
+
+        void matchRatio(const cv::Mat &query_desc, float ratio, std::vector<cv::DMatch> &matches) const override;
+
+        // взаимно ближайшие соседи (cross-check) за один проход по матрице расстояний:
+        // пара (qi, ti) попадает в результат если ti - ближайший к qi среди train, а qi - ближайший к ti среди query
+        void matchMutual(const cv::Mat &query_desc, std::vector<cv::DMatch> &matches) const;
+
     private:
 
+        // считает два лучших сопоставления для каждого query (квадраты расстояний)
+        // если передан train_best_dist2 - заодно для каждого train минимальный квадрат расстояния до query (в битовом представлении float)
+        // если ratio > 0 - вместо этого только лучшие сопоставления прошедшие ratio test, подряд и в произвольном порядке
+        void runKernel(const cv::Mat &query_desc,
+                       std::vector<float> &distance2_res, std::vector<unsigned int> &train_idx_res, std::vector<unsigned int> &query_idx_res,
+                       std::vector<unsigned int> *train_best_dist2, float ratio = 0.f) const;
+
+        bool tiled_kernel;
+        bool cpu_device;
+
         const cv::Mat *train_desc_ptr = nullptr;
     };
 
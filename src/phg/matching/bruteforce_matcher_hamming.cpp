@@ -0,0 +1,196 @@
+#include "bruteforce_matcher_hamming.h"
+#include "distances.h"
+
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+
+#if PHG_RUNTIME_DISPATCH || defined __AVX2__
+#include <immintrin.h>
+#endif
+
+
+namespace {
+
+    // хвост после векторной части: по 8 байт, затем по байту
+    inline int hammingTail(const uint8_t *a, const uint8_t *b, int i, int nbytes)
+    {
+        int dist = 0;
+        for (; i + 8 <= nbytes; i += 8) {
+            uint64_t va, vb;
+            std::memcpy(&va, a + i, 8);
+            std::memcpy(&vb, b + i, 8);
+            dist += phg::popcount64(va ^ vb);
+        }
+        for (; i < nbytes; ++i) {
+            dist += phg::popcount64((uint64_t) (a[i] ^ b[i]));
+        }
+        return dist;
+    }
+
+    int hammingScalar(const uint8_t *a, const uint8_t *b, int nbytes)
+    {
+        return hammingTail(a, b, 0, nbytes);
+    }
+
+#if PHG_RUNTIME_DISPATCH
+    // тот же код, но __builtin_popcountll компилируется в инструкцию popcnt
+    PHG_TARGET("popcnt") int hammingPopcnt(const uint8_t *a, const uint8_t *b, int nbytes)
+    {
+        return hammingTail(a, b, 0, nbytes);
+    }
+#endif
+
+#if PHG_RUNTIME_DISPATCH || defined __AVX2__
+    // popcount 32 байт: число бит в каждом полубайте берется из таблицы через vpshufb, суммы по байтам - через vpsadbw
+    PHG_TARGET("avx2") inline __m256i popcount256(__m256i v)
+    {
+        const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                                0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+        const __m256i low_mask = _mm256_set1_epi8(0x0f);
+        __m256i lo = _mm256_and_si256(v, low_mask);
+        __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask);
+        __m256i cnt = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo), _mm256_shuffle_epi8(lookup, hi));
+        return _mm256_sad_epu8(cnt, _mm256_setzero_si256());
+    }
+
+    PHG_TARGET("avx2,popcnt") int hammingAVX2(const uint8_t *a, const uint8_t *b, int nbytes)
+    {
+        int i = 0;
+        __m256i acc = _mm256_setzero_si256();
+        for (; i + 32 <= nbytes; i += 32) {
+            __m256i va = _mm256_loadu_si256((const __m256i *) (a + i));
+            __m256i vb = _mm256_loadu_si256((const __m256i *) (b + i));
+            acc = _mm256_add_epi64(acc, popcount256(_mm256_xor_si256(va, vb)));
+        }
+        int dist = (int) (_mm256_extract_epi64(acc, 0) + _mm256_extract_epi64(acc, 1) + _mm256_extract_epi64(acc, 2) + _mm256_extract_epi64(acc, 3));
+        return dist + hammingTail(a, b, i, nbytes);
+    }
+#endif
+
+    // самый быстрый вариант из поддерживаемых процессором
+    phg::BruteforceMatcherHamming::DistanceFunction chooseHamming(const char *&name)
+    {
+#if PHG_RUNTIME_DISPATCH
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+            name = "avx2";
+            return hammingAVX2;
+        }
+        if (__builtin_cpu_supports("popcnt")) {
+            name = "popcnt";
+            return hammingPopcnt;
+        }
+#elif defined __AVX2__
+        name = "avx2";
+        return hammingAVX2;
+#endif
+        name = "scalar";
+        return hammingScalar;
+    }
+
+}
+
+void phg::BruteforceMatcherHamming::train(const cv::Mat &train_desc)
+{
+    if (train_desc.rows < 2) {
+        throw std::runtime_error("BruteforceMatcherHamming:: train : needed at least 2 train descriptors");
+    }
+    if (train_desc.type() != CV_8UC1) {
+        throw std::runtime_error("BruteforceMatcherHamming:: train : only CV_8UC1 descriptors supported");
+    }
+
+    hamming = chooseHamming(kernel_name);
+    train_desc_ptr = &train_desc;
+}
+
+void phg::BruteforceMatcherHamming::knnMatch(const cv::Mat &query_desc,
+                                             std::vector<std::vector<cv::DMatch>> &matches,
+                                             int k) const
+{
+    if (!train_desc_ptr) {
+        throw std::runtime_error("BruteforceMatcherHamming:: knnMatch : matcher is not trained");
+    }
+    if (query_desc.type() != CV_8UC1 || query_desc.cols != train_desc_ptr->cols) {
+        throw std::runtime_error("BruteforceMatcherHamming:: knnMatch : query descriptors type mismatch");
+    }
+    if (k < 1 || k > train_desc_ptr->rows) {
+        throw std::runtime_error("BruteforceMatcherHamming:: knnMatch : invalid k");
+    }
+
+    std::cout << "BruteforceMatcherHamming::knnMatch : n query desc : " << query_desc.rows << ", n train desc : " << train_desc_ptr->rows << ", kernel : " << kernel_name << std::endl;
+
+    const cv::Mat &train_desc = *train_desc_ptr;
+    const int ndesc = query_desc.rows;
+    const int n_train_desc = train_desc.rows;
+    const int nbytes = query_desc.cols;
+
+    matches.resize(ndesc);
+
+    #pragma omp parallel for schedule(dynamic, 16)
+    for (int qi = 0; qi < ndesc; ++qi) {
+        std::vector<cv::DMatch> &dst = matches[qi];
+        dst.clear();
+        dst.reserve(k);
+
+        const uint8_t *q = query_desc.ptr<uint8_t>(qi);
+        for (int ti = 0; ti < n_train_desc; ++ti) {
+            int dist = hamming(q, train_desc.ptr<uint8_t>(ti), nbytes);
+            if ((int) dst.size() == k && dst.back().distance <= dist) {
+                continue;
+            }
+
+            cv::DMatch match(qi, ti, (float) dist);
+            if ((int) dst.size() == k) {
+                dst.pop_back();
+            }
+            dst.insert(std::upper_bound(dst.begin(), dst.end(), match), match);
+        }
+    }
+}
+
+const char *phg::BruteforceMatcherHamming::kernel() const
+{
+    return kernel_name;
+}
+
+void phg::binarizeDescriptors(const cv::Mat &descriptors, cv::Mat &binary_descriptors)
+{
+    if (descriptors.type() != CV_32FC1) {
+        throw std::runtime_error("binarizeDescriptors : only CV_32FC1 descriptors supported");
+    }
+
+    const int ndesc = descriptors.rows;
+    const int ndim = descriptors.cols;
+    const int nbytes = (2 * ndim + 7) / 8;
+
+    binary_descriptors = cv::Mat::zeros(ndesc, nbytes, CV_8UC1);
+
+    #pragma omp parallel
+    {
+        std::vector<float> sorted(ndim);
+
+        #pragma omp for
+        for (int i = 0; i < ndesc; ++i) {
+            const float *x = descriptors.ptr<float>(i);
+            uint8_t *code = binary_descriptors.ptr<uint8_t>(i);
+
+            std::copy(x, x + ndim, sorted.begin());
+            std::nth_element(sorted.begin(), sorted.begin() + ndim / 3, sorted.end());
+            const float t1 = sorted[ndim / 3];
+            std::nth_element(sorted.begin(), sorted.begin() + 2 * ndim / 3, sorted.end());
+            const float t2 = sorted[2 * ndim / 3];
+
+            for (int d = 0; d < ndim; ++d) {
+                if (x[d] > t1) {
+                    code[(2 * d) / 8] |= (uint8_t) (1 << ((2 * d) % 8));
+                }
+                if (x[d] > t2) {
+                    code[(2 * d + 1) / 8] |= (uint8_t) (1 << ((2 * d + 1) % 8));
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "descriptor_matcher.h"
+
+#include <cstdint>
+
+namespace phg {
+
+    // перебор для бинарных дескрипторов (CV_8UC1, биты упакованы по 8 в байт, например 256 или 512 бит):
+    // расстояние Хэмминга = popcount(a xor b), с AVX2 - popcount через vpshufb, иначе popcnt
+    // или скалярно (вариант выбирается в train() по возможностям процессора)
+    // расстояния в DMatch - число различающихся бит, так что ratio test, filterMatchesClusters и GMS работают как обычно
+    struct BruteforceMatcherHamming : DescriptorMatcher {
+
+        void train(const cv::Mat &train_desc) override;
+
+        void knnMatch(const cv::Mat &query_desc, std::vector<std::vector<cv::DMatch>> &matches, int k) const override;
+
+        // вариант подсчета расстояния, выбранный в train(): "avx2", "popcnt" или "scalar"
+        const char *kernel() const;
+
+        typedef int (*DistanceFunction)(const uint8_t *a, const uint8_t *b, int nbytes);
+
+    private:
+
+        DistanceFunction hamming = nullptr;
+        const char *kernel_name = "scalar";
+
+        const cv::Mat *train_desc_ptr = nullptr;
+    };
+
+    // бинаризация float дескрипторов (например SIFT) термометрическим кодом по 2 бита на координату:
+    // порогами служат 1/3 и 2/3 порядковые статистики координат этого же дескриптора, код координаты - 00, 01 или 11,
+    // поэтому расстояние Хэмминга между кодами - это L1 расстояние между уровнями координат (для SIFT 128 -> 256 бит = 32 байта)
+    void binarizeDescriptors(const cv::Mat &descriptors, cv::Mat &binary_descriptors);
+
+}
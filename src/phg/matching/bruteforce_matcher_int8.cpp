@@ -0,0 +1,221 @@
+#include "bruteforce_matcher_int8.h"
+#include "distances.h"
+
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+
+#if PHG_RUNTIME_DISPATCH || defined __AVX2__
+#include <immintrin.h>
+#endif
+
+
+namespace {
+
+    const int max_level = 127;
+    const int code_alignment = 32;
+
+    // во всех вариантах nbytes кратно code_alignment, оба кода в [0, 127], поэтому любой из них можно трактовать и как uint8, и как int8
+    int dotScalar(const uint8_t *a, const uint8_t *b, int nbytes)
+    {
+        int sum = 0;
+        for (int i = 0; i < nbytes; ++i) {
+            sum += (int) a[i] * (int) b[i];
+        }
+        return sum;
+    }
+
+#if PHG_RUNTIME_DISPATCH || defined __AVX2__
+    PHG_TARGET("avx2") inline int hsum(__m256i acc)
+    {
+        __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+        sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+        sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+        return _mm_cvtsi128_si32(sum);
+    }
+
+    PHG_TARGET("avx2") int dotAVX2(const uint8_t *a, const uint8_t *b, int nbytes)
+    {
+        const __m256i ones = _mm256_set1_epi16(1);
+        __m256i acc = _mm256_setzero_si256();
+        for (int i = 0; i < nbytes; i += 32) {
+            __m256i va = _mm256_loadu_si256((const __m256i *) (a + i));
+            __m256i vb = _mm256_loadu_si256((const __m256i *) (b + i));
+            // 2 * 127 * 127 < 32767, поэтому попарные суммы в int16 не насыщаются
+            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_maddubs_epi16(va, vb), ones));
+        }
+        return hsum(acc);
+    }
+#endif
+
+#if PHG_RUNTIME_DISPATCH || (defined __AVX512VNNI__ && defined __AVX512VL__)
+    PHG_TARGET("avx2,avx512vnni,avx512vl") int dotVNNI(const uint8_t *a, const uint8_t *b, int nbytes)
+    {
+        __m256i acc = _mm256_setzero_si256();
+        for (int i = 0; i < nbytes; i += 32) {
+            __m256i va = _mm256_loadu_si256((const __m256i *) (a + i));
+            __m256i vb = _mm256_loadu_si256((const __m256i *) (b + i));
+            acc = _mm256_dpbusd_epi32(acc, va, vb);
+        }
+        return hsum(acc);
+    }
+#endif
+
+    // самый быстрый вариант из поддерживаемых процессором
+    phg::BruteforceMatcherInt8::DotFunction chooseDot(const char *&name)
+    {
+#if PHG_RUNTIME_DISPATCH
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512vnni") && __builtin_cpu_supports("avx512vl")) {
+            name = "avx512vnni";
+            return dotVNNI;
+        }
+        if (__builtin_cpu_supports("avx2")) {
+            name = "avx2";
+            return dotAVX2;
+        }
+#elif defined __AVX512VNNI__ && defined __AVX512VL__
+        name = "avx512vnni";
+        return dotVNNI;
+#elif defined __AVX2__
+        name = "avx2";
+        return dotAVX2;
+#endif
+        name = "scalar";
+        return dotScalar;
+    }
+
+}
+
+phg::BruteforceMatcherInt8::BruteforceMatcherInt8(int n_rerank)
+    : n_rerank(n_rerank)
+    , ndim(0)
+    , code_stride(0)
+    , offset(0.f)
+    , scale(1.f)
+    , dot(nullptr)
+    , kernel_name("scalar")
+{
+    if (n_rerank < 1) {
+        throw std::runtime_error("BruteforceMatcherInt8:: invalid parameters");
+    }
+}
+
+void phg::BruteforceMatcherInt8::quantize(const float *x, uint8_t *code) const
+{
+    for (int d = 0; d < ndim; ++d) {
+        // запросы могут выходить за диапазон train дескрипторов
+        int level = (int) std::lround((x[d] - offset) * scale);
+        code[d] = (uint8_t) std::max(0, std::min(max_level, level));
+    }
+    std::fill(code + ndim, code + code_stride, 0);
+}
+
+void phg::BruteforceMatcherInt8::train(const cv::Mat &train_desc)
+{
+    if (train_desc.rows < 2) {
+        throw std::runtime_error("BruteforceMatcherInt8:: train : needed at least 2 train descriptors");
+    }
+    if (train_desc.type() != CV_32FC1) {
+        throw std::runtime_error("BruteforceMatcherInt8:: train : only CV_32FC1 descriptors supported");
+    }
+
+    const int n_train_desc = train_desc.rows;
+    ndim = train_desc.cols;
+    dot = chooseDot(kernel_name);
+    code_stride = (ndim + code_alignment - 1) / code_alignment * code_alignment;
+
+    // L2 не меняется от сдвига, поэтому дескрипторы с отрицательными координатами тоже квантуются без потерь диапазона
+    double min_value, max_value;
+    cv::minMaxLoc(train_desc, &min_value, &max_value);
+    offset = (float) min_value;
+    scale = max_value > min_value ? (float) (max_level / (max_value - min_value)) : 1.f;
+
+    train_codes.resize((size_t) n_train_desc * code_stride);
+    train_norms2.resize(n_train_desc);
+
+    #pragma omp parallel for
+    for (int ti = 0; ti < n_train_desc; ++ti) {
+        uint8_t *code = train_codes.data() + (size_t) ti * code_stride;
+        quantize(train_desc.ptr<float>(ti), code);
+        train_norms2[ti] = dot(code, code, code_stride);
+    }
+
+    train_desc_ptr = &train_desc;
+}
+
+void phg::BruteforceMatcherInt8::knnMatch(const cv::Mat &query_desc,
+                                          std::vector<std::vector<cv::DMatch>> &matches,
+                                          int k) const
+{
+    if (!train_desc_ptr) {
+        throw std::runtime_error("BruteforceMatcherInt8:: knnMatch : matcher is not trained");
+    }
+    if (query_desc.type() != CV_32FC1 || query_desc.cols != ndim) {
+        throw std::runtime_error("BruteforceMatcherInt8:: knnMatch : query descriptors type mismatch");
+    }
+    if (k < 1 || k > train_desc_ptr->rows) {
+        throw std::runtime_error("BruteforceMatcherInt8:: knnMatch : invalid k");
+    }
+
+    std::cout << "BruteforceMatcherInt8::knnMatch : n query desc : " << query_desc.rows << ", n train desc : " << train_desc_ptr->rows << ", kernel : " << kernel_name << std::endl;
+
+    const cv::Mat &train_desc = *train_desc_ptr;
+    const int ndesc = query_desc.rows;
+    const int n_train_desc = train_desc.rows;
+    const int n_shortlist = std::min(n_train_desc, std::max(k, n_rerank));
+
+    matches.resize(ndesc);
+
+    #pragma omp parallel
+    {
+        std::vector<uint8_t> query_code(code_stride);
+        std::vector<std::pair<int, int>> shortlist;           // (приближенное расстояние, ti) по возрастанию
+        std::vector<std::pair<float, int>> reranked;
+
+        #pragma omp for schedule(dynamic, 16)
+        for (int qi = 0; qi < ndesc; ++qi) {
+            const float *q = query_desc.ptr<float>(qi);
+            quantize(q, query_code.data());
+
+            // |q|^2 одинаков для всех кандидатов, поэтому сравниваем |t|^2 - 2 q.t
+            shortlist.clear();
+            for (int ti = 0; ti < n_train_desc; ++ti) {
+                int dist = train_norms2[ti] - 2 * dot(train_codes.data() + (size_t) ti * code_stride, query_code.data(), code_stride);
+                if ((int) shortlist.size() == n_shortlist && shortlist.back().first <= dist) {
+                    continue;
+                }
+
+                std::pair<int, int> candidate(dist, ti);
+                if ((int) shortlist.size() == n_shortlist) {
+                    shortlist.pop_back();
+                }
+                shortlist.insert(std::upper_bound(shortlist.begin(), shortlist.end(), candidate), candidate);
+            }
+
+            reranked.clear();
+            for (const auto &candidate : shortlist) {
+                reranked.push_back(std::make_pair(l2sqr(q, train_desc.ptr<float>(candidate.second), ndim), candidate.second));
+            }
+            std::sort(reranked.begin(), reranked.end());
+
+            std::vector<cv::DMatch> &dst = matches[qi];
+            dst.clear();
+            for (int ki = 0; ki < k; ++ki) {
+                dst.emplace_back(qi, reranked[ki].second, std::sqrt(reranked[ki].first));
+            }
+        }
+    }
+}
+
+const char *phg::BruteforceMatcherInt8::kernel() const
+{
+    return kernel_name;
+}
+
+size_t phg::BruteforceMatcherInt8::memoryUsage() const
+{
+    return train_codes.size() * sizeof(uint8_t) + train_norms2.size() * sizeof(int);
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "descriptor_matcher.h"
+
+#include <cstdint>
+
+namespace phg {
+
+    // перебор по квантованным дескрипторам: при train() координаты сдвигаются и масштабируются в 7-битные целые [0, 127]
+    // (один общий масштаб на все дескрипторы), L2 = |q|^2 + |t|^2 - 2 q.t считается через целочисленное скалярное произведение:
+    // с AVX512-VNNI - vpdpbusd, с AVX2 - vpmaddubsw + vpmaddwd, иначе скалярно (вариант выбирается в train() по возможностям процессора)
+    // 7 бит а не 8 - чтобы сумма пары произведений в vpmaddubsw не насыщалась в int16
+    // n_rerank лучших по приближенному расстоянию кандидатов перепроверяются точным float L2, так что расстояния в DMatch - точные
+    struct BruteforceMatcherInt8 : DescriptorMatcher {
+
+        BruteforceMatcherInt8(int n_rerank = 8);
+
+        void train(const cv::Mat &train_desc) override;
+
+        void knnMatch(const cv::Mat &query_desc, std::vector<std::vector<cv::DMatch>> &matches, int k) const override;
+
+        // коды train дескрипторов и их нормы
+        size_t memoryUsage() const override;
+
+        // вариант скалярного произведения, выбранный в train(): "avx512vnni", "avx2" или "scalar"
+        const char *kernel() const;
+
+        typedef int (*DotFunction)(const uint8_t *a, const uint8_t *b, int nbytes);
+
+    private:
+
+        void quantize(const float *x, uint8_t *code) const;
+
+        int n_rerank;
+
+        int ndim;
+        int code_stride;                   // длина кода с выравниванием до 32 байт (хвост заполнен нулями)
+        float offset;                      // x_quantized = round((x - offset) * scale)
+        float scale;
+
+        std::vector<uint8_t> train_codes;  // n_train_desc x code_stride
+        std::vector<int> train_norms2;     // |t|^2 квантованных дескрипторов
+
+        DotFunction dot;
+        const char *kernel_name;
+
+        const cv::Mat *train_desc_ptr = nullptr;
+    };
+
+}
@@ -0,0 +1,227 @@
+#include "cascade_hashing_matcher.h"
+#include "distances.h"
+
+#include <cmath>
+#include <random>
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+
+
+namespace {
+
+    const unsigned int projections_seed = 125125; // проекции фиксированы, чтобы результат воспроизводился из раза в раз
+
+}
+
+phg::CascadeHashingMatcher::CascadeHashingMatcher(int n_bucket_groups, int n_bucket_bits, int n_rerank)
+    : n_bucket_groups(n_bucket_groups)
+    , n_bucket_bits(n_bucket_bits)
+    , n_rerank(n_rerank)
+    , ndim(0)
+{
+    if (n_bucket_groups < 1 || n_bucket_bits < 1 || n_bucket_bits > 16 || n_rerank < 1) {
+        throw std::runtime_error("CascadeHashingMatcher:: invalid parameters");
+    }
+}
+
+void phg::CascadeHashingMatcher::hash(const float *x, float *centered, int *buckets, uint64_t *code) const
+{
+    for (int d = 0; d < ndim; ++d) {
+        centered[d] = x[d] - mean[d];
+    }
+
+    int p = 0;
+    for (int g = 0; g < n_bucket_groups; ++g) {
+        int bucket = 0;
+        for (int b = 0; b < n_bucket_bits; ++b, ++p) {
+            const float *w = projections.ptr<float>(p);
+            float dot = 0.f;
+            for (int d = 0; d < ndim; ++d) {
+                dot += w[d] * centered[d];
+            }
+            bucket = (bucket << 1) | (dot > 0.f);
+        }
+        buckets[g] = bucket;
+    }
+    for (int wi = 0; wi < code_words; ++wi) {
+        uint64_t word = 0;
+        for (int b = 0; b < 64; ++b, ++p) {
+            const float *w = projections.ptr<float>(p);
+            float dot = 0.f;
+            for (int d = 0; d < ndim; ++d) {
+                dot += w[d] * centered[d];
+            }
+            word |= (uint64_t) (dot > 0.f) << b;
+        }
+        code[wi] = word;
+    }
+}
+
+void phg::CascadeHashingMatcher::train(const cv::Mat &train_desc)
+{
+    if (train_desc.rows < 2) {
+        throw std::runtime_error("CascadeHashingMatcher:: train : needed at least 2 train descriptors");
+    }
+    if (train_desc.type() != CV_32FC1) {
+        throw std::runtime_error("CascadeHashingMatcher:: train : only CV_32FC1 descriptors supported");
+    }
+
+    const int n_train_desc = train_desc.rows;
+    ndim = train_desc.cols;
+
+    // у SIFT все координаты неотрицательны, без центрирования знаки проекций почти всегда одинаковые
+    mean.assign(ndim, 0.f);
+    for (int ti = 0; ti < n_train_desc; ++ti) {
+        const float *x = train_desc.ptr<float>(ti);
+        for (int d = 0; d < ndim; ++d) {
+            mean[d] += x[d];
+        }
+    }
+    for (int d = 0; d < ndim; ++d) {
+        mean[d] /= n_train_desc;
+    }
+
+    const int n_projections = n_bucket_groups * n_bucket_bits + 64 * code_words;
+    projections.create(n_projections, ndim, CV_32FC1);
+    std::mt19937 rng(projections_seed);
+    std::normal_distribution<float> normal(0.f, 1.f);
+    for (int p = 0; p < n_projections; ++p) {
+        float *w = projections.ptr<float>(p);
+        for (int d = 0; d < ndim; ++d) {
+            w[d] = normal(rng);
+        }
+    }
+
+    std::vector<int> buckets((size_t) n_train_desc * n_bucket_groups);
+    train_codes.resize((size_t) n_train_desc * code_words);
+
+    #pragma omp parallel
+    {
+        std::vector<float> centered(ndim);
+        #pragma omp for
+        for (int ti = 0; ti < n_train_desc; ++ti) {
+            hash(train_desc.ptr<float>(ti), centered.data(), buckets.data() + (size_t) ti * n_bucket_groups, train_codes.data() + (size_t) ti * code_words);
+        }
+    }
+
+    // раскладываем дескрипторы по корзинам каждой группы (CSR)
+    const int n_buckets = 1 << n_bucket_bits;
+    bucket_offsets.assign(n_bucket_groups, std::vector<unsigned int>(n_buckets + 1, 0));
+    bucket_ids.assign(n_bucket_groups, std::vector<unsigned int>(n_train_desc));
+    for (int g = 0; g < n_bucket_groups; ++g) {
+        std::vector<unsigned int> &offsets = bucket_offsets[g];
+        for (int ti = 0; ti < n_train_desc; ++ti) {
+            ++offsets[buckets[(size_t) ti * n_bucket_groups + g] + 1];
+        }
+        for (int b = 0; b < n_buckets; ++b) {
+            offsets[b + 1] += offsets[b];
+        }
+        std::vector<unsigned int> fill(offsets.begin(), offsets.end() - 1);
+        for (int ti = 0; ti < n_train_desc; ++ti) {
+            bucket_ids[g][fill[buckets[(size_t) ti * n_bucket_groups + g]]++] = ti;
+        }
+    }
+
+    train_desc_ptr = &train_desc;
+}
+
+void phg::CascadeHashingMatcher::knnMatch(const cv::Mat &query_desc,
+                                          std::vector<std::vector<cv::DMatch>> &matches,
+                                          int k) const
+{
+    if (!train_desc_ptr) {
+        throw std::runtime_error("CascadeHashingMatcher:: knnMatch : matcher is not trained");
+    }
+    if (query_desc.type() != CV_32FC1 || query_desc.cols != ndim) {
+        throw std::runtime_error("CascadeHashingMatcher:: knnMatch : query descriptors type mismatch");
+    }
+    if (k < 1 || k > train_desc_ptr->rows) {
+        throw std::runtime_error("CascadeHashingMatcher:: knnMatch : invalid k");
+    }
+
+    std::cout << "CascadeHashingMatcher::knnMatch : n query desc : " << query_desc.rows << ", n train desc : " << train_desc_ptr->rows << std::endl;
+
+    const cv::Mat &train_desc = *train_desc_ptr;
+    const int ndesc = query_desc.rows;
+    const int n_train_desc = train_desc.rows;
+    const int n_shortlist = std::max(k, n_rerank);
+
+    matches.resize(ndesc);
+
+    #pragma omp parallel
+    {
+        std::vector<float> centered(ndim);
+        std::vector<int> buckets(n_bucket_groups);
+        uint64_t code[code_words];
+        std::vector<int> visited(n_train_desc, -1);     // номер последнего query, для которого train уже стал кандидатом
+        std::vector<std::pair<int, int>> candidates;    // (расстояние Хэмминга, ti)
+        std::vector<std::pair<float, int>> reranked;
+
+        #pragma omp for schedule(dynamic, 16)
+        for (int qi = 0; qi < ndesc; ++qi) {
+            const float *q = query_desc.ptr<float>(qi);
+            hash(q, centered.data(), buckets.data(), code);
+
+            candidates.clear();
+            for (int g = 0; g < n_bucket_groups; ++g) {
+                const std::vector<unsigned int> &offsets = bucket_offsets[g];
+                for (unsigned int pos = offsets[buckets[g]]; pos < offsets[buckets[g] + 1]; ++pos) {
+                    const unsigned int ti = bucket_ids[g][pos];
+                    if (visited[ti] == qi) {
+                        continue;
+                    }
+                    visited[ti] = qi;
+
+                    const uint64_t *train_code = train_codes.data() + (size_t) ti * code_words;
+                    int dist = 0;
+                    for (int wi = 0; wi < code_words; ++wi) {
+                        dist += popcount64(code[wi] ^ train_code[wi]);
+                    }
+                    candidates.push_back(std::make_pair(dist, (int) ti));
+                }
+            }
+
+            // во всех корзинах запроса оказалось меньше k дескрипторов - тогда кандидаты все train (случается редко)
+            if ((int) candidates.size() < k) {
+                candidates.clear();
+                for (int ti = 0; ti < n_train_desc; ++ti) {
+                    const uint64_t *train_code = train_codes.data() + (size_t) ti * code_words;
+                    int dist = 0;
+                    for (int wi = 0; wi < code_words; ++wi) {
+                        dist += popcount64(code[wi] ^ train_code[wi]);
+                    }
+                    candidates.push_back(std::make_pair(dist, ti));
+                }
+            }
+
+            if ((int) candidates.size() > n_shortlist) {
+                std::nth_element(candidates.begin(), candidates.begin() + n_shortlist, candidates.end());
+                candidates.resize(n_shortlist);
+            }
+
+            reranked.clear();
+            for (const auto &candidate : candidates) {
+                reranked.push_back(std::make_pair(l2sqr(q, train_desc.ptr<float>(candidate.second), ndim), candidate.second));
+            }
+            std::sort(reranked.begin(), reranked.end());
+
+            std::vector<cv::DMatch> &dst = matches[qi];
+            dst.clear();
+            for (int ki = 0; ki < k; ++ki) {
+                dst.emplace_back(qi, reranked[ki].second, std::sqrt(reranked[ki].first));
+            }
+        }
+    }
+}
+
+size_t phg::CascadeHashingMatcher::memoryUsage() const
+{
+    size_t bytes = mean.size() * sizeof(float)
+                 + projections.total() * projections.elemSize()
+                 + train_codes.size() * sizeof(uint64_t);
+    for (int g = 0; g < (int) bucket_offsets.size(); ++g) {
+        bytes += bucket_offsets[g].size() * sizeof(unsigned int) + bucket_ids[g].size() * sizeof(unsigned int);
+    }
+    return bytes;
+}
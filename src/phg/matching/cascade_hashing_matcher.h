@@ -0,0 +1,47 @@
+#pragma once
+
+#include "descriptor_matcher.h"
+
+#include <cstdint>
+
+namespace phg {
+
+    // Cheng, Leng, Wu, Cui, Lu: "Fast and Accurate Image Matching with Cascade Hashing for 3D Reconstruction" (2014)
+    // без обучения: дескрипторы центрируются средним train дескриптором и проецируются на случайные гауссовы направления
+    // 1) n_bucket_groups независимых хешей по n_bucket_bits бит - кандидаты это train дескрипторы попавшие в ту же корзину хотя бы в одной группе
+    // 2) кандидаты упорядочиваются по расстоянию Хэмминга между 128-битными кодами (знаки еще 128 проекций)
+    // 3) n_rerank ближайших по Хэммингу перепроверяются точным L2
+    struct CascadeHashingMatcher : DescriptorMatcher {
+
+        CascadeHashingMatcher(int n_bucket_groups = 6, int n_bucket_bits = 8, int n_rerank = 10);
+
+        void train(const cv::Mat &train_desc) override;
+
+        void knnMatch(const cv::Mat &query_desc, std::vector<std::vector<cv::DMatch>> &matches, int k) const override;
+
+        // проекции, корзины и коды train дескрипторов
+        size_t memoryUsage() const override;
+
+    private:
+
+        static const int code_words = 2; // 128-битный код = 2 x uint64
+
+        // номера корзин во всех группах и 128-битный код дескриптора, centered - буфер на ndim float
+        void hash(const float *x, float *centered, int *buckets, uint64_t *code) const;
+
+        int n_bucket_groups;
+        int n_bucket_bits;
+        int n_rerank;
+
+        int ndim;
+        std::vector<float> mean;                        // средний train дескриптор
+        cv::Mat projections;                            // (n_bucket_groups * n_bucket_bits + 64 * code_words) x ndim
+
+        std::vector<std::vector<unsigned int>> bucket_offsets; // CSR по группам: дескрипторы корзины b лежат в [offsets[b], offsets[b + 1])
+        std::vector<std::vector<unsigned int>> bucket_ids;
+        std::vector<uint64_t> train_codes;              // по code_words слов на дескриптор
+
+        const cv::Mat *train_desc_ptr = nullptr;
+    };
+
+}
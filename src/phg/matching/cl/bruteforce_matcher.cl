@@ -13,7 +13,15 @@ __kernel void bruteforce_matcher(__global const float* train,
                                  __global        uint* res_query_idx,
                                  __global       float* res_distance,
                                  unsigned int n_train_desc,
-                                 unsigned int n_query_desc)
+                                 unsigned int n_query_desc
+#ifdef CROSS_CHECK
+                               , __global       uint* res_train_best_dist2 // минимальный квадрат расстояния от каждого train до query (битовое представление float)
+#endif
+#ifdef RATIO_TEST
+                               , float ratio2                             // квадрат порога ratio test
+                               , __global       uint* res_count           // сколько сопоставлений прошло ratio test (res_* заполнены подряд, по одному на query)
+#endif
+                                 )
 {
     // каждая рабочая группа обрабатывает KEYPOINTS_PER_WG=4 дескриптора из query (сопоставляет их со всеми train)
 
@@ -63,6 +71,14 @@ __kernel void bruteforce_matcher(__global const float* train,
                 // master поток смотрит на полученное расстояние и проверяет не лучше ли оно чем то что было до сих пор
                 float dist2 = dist2_for_reduction[0]; // взяли найденную сумму квадратов (это квадрат расстояния до текущего кандидата train_idx)
 
+#ifdef CROSS_CHECK
+                // неотрицательные float упорядочены так же как их битовые представления, поэтому достаточно atomic_min по uint
+                // (дешевое чтение без атомика отсекает почти все кандидаты, которые все равно не улучшат минимум)
+                if (query_id0 + query_local_i < n_query_desc && as_uint(dist2) < res_train_best_dist2[train_idx]) {
+                    atomic_min(&res_train_best_dist2[train_idx], as_uint(dist2));
+                }
+#endif
+
                 #define BEST_INDEX        0
                 #define SECOND_BEST_INDEX 1
 
@@ -85,6 +101,22 @@ __kernel void bruteforce_matcher(__global const float* train,
     }
 
     // итак, мы нашли два лучших сопоставления для наших KEYPOINTS_PER_WG дескрипторов, надо сохрнить эти результаты в глобальную память
+    barrier(CLK_LOCAL_MEM_FENCE); // дожидаемся пока master поток обновит лучшие сопоставления по последнему train
+#ifdef RATIO_TEST
+    // сразу применяем ratio test и пишем только прошедшие сопоставления - подряд, место выделяется атомарным счетчиком
+    // (порядок по query при этом теряется, его восстанавливают на CPU)
+    if (dim_id < KEYPOINTS_PER_WG) {
+        const unsigned int query_id = query_id0 + dim_id;
+        const float best_dist2 = res_distance2_local[dim_id * 2 + BEST_INDEX];
+        const float second_dist2 = res_distance2_local[dim_id * 2 + SECOND_BEST_INDEX];
+        if (query_id < n_query_desc && best_dist2 < ratio2 * second_dist2) {
+            const unsigned int idx = atomic_inc(res_count);
+            res_train_idx[idx] = res_train_idx_local[dim_id * 2 + BEST_INDEX];
+            res_query_idx[idx] = query_id;
+            res_distance [idx] = best_dist2;
+        }
+    }
+#else
     if (dim_id < KEYPOINTS_PER_WG * 2) { // полагаемся на то что нам надо прогрузить KEYPOINTS_PER_WG*2==4*2<dim_id<=NDIM==128
         const unsigned int query_local_i = dim_id / 2;
         const unsigned int k = dim_id % 2;
@@ -98,4 +130,115 @@ __kernel void bruteforce_matcher(__global const float* train,
             res_distance [global_idx] = res_distance2_local[local_idx];
         }
     }
+#endif
+}
+
+// вариант без редукции через локальную память: каждый work-item ведет свой query и считает полные расстояния от него
+// сразу до блока из TILED_TRAIN_BLOCK train дескрипторов, накапливая их в регистрах (плитка 1 query x TILED_TRAIN_BLOCK train),
+// блоки train дескрипторов всей рабочей группой подгружаются в локальную память - два барьера на блок train, а не по семь на каждого кандидата
+#define TILED_TRAIN_BLOCK 32 // train дескрипторов в локальной памяти за раз: TILED_TRAIN_BLOCK * NDIM * 4 = 16 КБ
+#define TILED_DIM_CHUNK   32 // сколько координат query держим в регистрах за раз
+
+__attribute__((reqd_work_group_size(TILED_WG_SIZE, 1, 1)))
+__kernel void bruteforce_matcher_tiled(__global const float* train,
+                                       __global const float* query,
+                                       __global        uint* res_train_idx,
+                                       __global        uint* res_query_idx,
+                                       __global       float* res_distance,
+                                       unsigned int n_train_desc,
+                                       unsigned int n_query_desc
+#ifdef CROSS_CHECK
+                                     , __global       uint* res_train_best_dist2
+#endif
+#ifdef RATIO_TEST
+                                     , float ratio2
+                                     , __global       uint* res_count
+#endif
+                                       )
+{
+    const unsigned int local_id = get_local_id(0);
+    const unsigned int query_id = get_global_id(0);
+    const int query_valid = query_id < n_query_desc;
+    // потоки за пределами query все равно грузят train и доходят до барьеров, просто считают расстояния до нулевого query
+    __global const float* query_desc = query + (query_valid ? query_id : 0) * NDIM;
+
+    __local float train_local[TILED_TRAIN_BLOCK * NDIM];
+
+    float best_dist2 = FLT_MAX;
+    float second_dist2 = FLT_MAX;
+    uint best_idx = 0;
+    uint second_idx = 0;
+
+    for (unsigned int train_id0 = 0; train_id0 < n_train_desc; train_id0 += TILED_TRAIN_BLOCK) {
+        // соседние потоки грузят соседние значения - чтение из глобальной памяти coalesced
+        for (unsigned int i = local_id; i < TILED_TRAIN_BLOCK * NDIM; i += TILED_WG_SIZE) {
+            const unsigned int train_id = train_id0 + i / NDIM;
+            train_local[i] = (train_id < n_train_desc) ? train[train_id0 * NDIM + i] : 0.0f;
+        }
+        barrier(CLK_LOCAL_MEM_FENCE); // дожидаемся прогрузки блока train
+
+        float dist2[TILED_TRAIN_BLOCK];
+        for (int t = 0; t < TILED_TRAIN_BLOCK; ++t) {
+            dist2[t] = 0.0f;
+        }
+
+        for (int d0 = 0; d0 < NDIM; d0 += TILED_DIM_CHUNK) {
+            float q[TILED_DIM_CHUNK];
+            for (int j = 0; j < TILED_DIM_CHUNK; ++j) {
+                q[j] = query_desc[d0 + j];
+            }
+            for (int t = 0; t < TILED_TRAIN_BLOCK; ++t) {
+                // все потоки рабочей группы читают один и тот же адрес локальной памяти - broadcast без конфликтов банков
+                for (int j = 0; j < TILED_DIM_CHUNK; ++j) {
+                    float diff = train_local[t * NDIM + d0 + j] - q[j];
+                    dist2[t] += diff * diff;
+                }
+            }
+        }
+        barrier(CLK_LOCAL_MEM_FENCE); // прежде чем грузить следующий блок все потоки должны дочитать текущий
+
+        for (int t = 0; t < TILED_TRAIN_BLOCK; ++t) {
+            const unsigned int train_id = train_id0 + t;
+            if (train_id >= n_train_desc) {
+                break;
+            }
+
+#ifdef CROSS_CHECK
+            if (query_valid && as_uint(dist2[t]) < res_train_best_dist2[train_id]) {
+                atomic_min(&res_train_best_dist2[train_id], as_uint(dist2[t]));
+            }
+#endif
+
+            // строгое сравнение: при равных расстояниях остается меньший train индекс, как в CPU версии
+            if (dist2[t] < best_dist2) {
+                second_dist2 = best_dist2;
+                second_idx = best_idx;
+                best_dist2 = dist2[t];
+                best_idx = train_id;
+            } else if (dist2[t] < second_dist2) {
+                second_dist2 = dist2[t];
+                second_idx = train_id;
+            }
+        }
+    }
+
+    if (!query_valid) {
+        return;
+    }
+
+#ifdef RATIO_TEST
+    if (best_dist2 < ratio2 * second_dist2) {
+        const unsigned int idx = atomic_inc(res_count);
+        res_train_idx[idx] = best_idx;
+        res_query_idx[idx] = query_id;
+        res_distance [idx] = best_dist2;
+    }
+#else
+    res_train_idx[query_id * 2 + 0] = best_idx;
+    res_query_idx[query_id * 2 + 0] = query_id;
+    res_distance [query_id * 2 + 0] = best_dist2;
+    res_train_idx[query_id * 2 + 1] = second_idx;
+    res_query_idx[query_id * 2 + 1] = query_id;
+    res_distance [query_id * 2 + 1] = second_dist2;
+#endif
 }
@@ -1,30 +1,197 @@
 #include "descriptor_matcher.h"
 
-#include <opencv2/flann/miniflann.hpp>
-#include "flann_factory.h"
+#include "keypoints_grid.h"
+
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <stdexcept>
+
+
+namespace {
+
+    const int total_neighbours = 5;  // total number of neighbours to test (including candidate)
+    const int points_per_cell = 2;   // средняя заполненность ячейки сетки для поиска соседей
+
+    // сетка над точками с ячейкой такого размера, чтобы в среднем на ячейку приходилось points_per_cell точек
+    phg::KeypointsGrid buildPointsGrid(const std::vector<cv::Point2f> &points)
+    {
+        float xmin = points[0].x, xmax = points[0].x;
+        float ymin = points[0].y, ymax = points[0].y;
+        for (const cv::Point2f &pt : points) {
+            xmin = std::min(xmin, pt.x);
+            xmax = std::max(xmax, pt.x);
+            ymin = std::min(ymin, pt.y);
+            ymax = std::max(ymax, pt.y);
+        }
+        double area = std::max(1.0, (double) (xmax - xmin) * (ymax - ymin));
+        float cell_size = (float) std::max(1.0, std::sqrt(area * points_per_cell / points.size()));
+        return phg::KeypointsGrid(points, cell_size);
+    }
+
+    // точный поиск total_neighbours ближайших соседей (включая саму точку): обходим квадратные кольца ячеек вокруг точки,
+    // пока ближайшая непросмотренная ячейка не окажется дальше текущего total_neighbours-го соседа
+    // результат отсортирован по возрастанию расстояния
+    void knnSearchGrid(const phg::KeypointsGrid &grid, const std::vector<cv::Point2f> &points, int i,
+                       int *indices, float *distances2)
+    {
+        const cv::Point2f &pt = points[i];
+        const float cell_size = grid.cellSize();
+        const int c0 = grid.col(pt.x);
+        const int r0 = grid.row(pt.y);
+
+        // до границы своей ячейки (точки за пределами сетки не бывает - сетка строится по этим же точкам)
+        const float cell_x = grid.origin().x + c0 * cell_size;
+        const float cell_y = grid.origin().y + r0 * cell_size;
+        const float to_border = std::max(0.f, std::min(std::min(pt.x - cell_x, cell_x + cell_size - pt.x),
+                                                       std::min(pt.y - cell_y, cell_y + cell_size - pt.y)));
+
+        int found = 0;
+        const int max_ring = std::max(grid.ncols(), grid.nrows());
+        for (int ring = 0; ring <= max_ring; ++ring) {
+            for (int r = r0 - ring; r <= r0 + ring; ++r) {
+                if (r < 0 || r >= grid.nrows()) {
+                    continue;
+                }
+                const bool full_row = (r == r0 - ring || r == r0 + ring);
+                for (int c = c0 - ring; c <= c0 + ring; c += (full_row || ring == 0) ? 1 : 2 * ring) {
+                    if (c < 0 || c >= grid.ncols()) {
+                        continue;
+                    }
+                    for (const int *id = grid.cellBegin(c, r); id != grid.cellEnd(c, r); ++id) {
+                        const float dx = points[*id].x - pt.x;
+                        const float dy = points[*id].y - pt.y;
+                        const float d2 = dx * dx + dy * dy;
+                        if (found == total_neighbours && d2 >= distances2[found - 1]) {
+                            continue;
+                        }
+                        // вставка в отсортированный массив фиксированного размера
+                        int pos = (found < total_neighbours) ? found++ : found - 1;
+                        while (pos > 0 && distances2[pos - 1] > d2) {
+                            distances2[pos] = distances2[pos - 1];
+                            indices[pos] = indices[pos - 1];
+                            --pos;
+                        }
+                        distances2[pos] = d2;
+                        indices[pos] = *id;
+                    }
+                }
+            }
+
+            const float unseen_dist = to_border + ring * cell_size;
+            if (found == total_neighbours && distances2[found - 1] <= unseen_dist * unseen_dist) {
+                break;
+            }
+        }
+    }
+
+}
+
+void phg::KnnMatches::resize(int nquery, int k)
+{
+    this->nquery = nquery;
+    this->k = k;
+    train_idx.resize((size_t) nquery * k);
+    distance.resize((size_t) nquery * k);
+}
+
+cv::DMatch phg::KnnMatches::match(int qi, int ki) const
+{
+    const size_t i = (size_t) qi * k + ki;
+    return cv::DMatch(qi, train_idx[i], distance[i]);
+}
+
+void phg::DescriptorMatcher::knnMatchFlat(const cv::Mat &query_desc, KnnMatches &matches, int k) const
+{
+    std::vector<std::vector<cv::DMatch>> knn_matches;
+    knnMatch(query_desc, knn_matches, k);
+
+    matches.resize((int) knn_matches.size(), k);
+    std::fill(matches.train_idx.begin(), matches.train_idx.end(), -1);
+    std::fill(matches.distance.begin(), matches.distance.end(), std::numeric_limits<float>::max());
+    for (int qi = 0; qi < matches.nquery; ++qi) {
+        for (int ki = 0; ki < k && ki < (int) knn_matches[qi].size(); ++ki) {
+            matches.train_idx[(size_t) qi * k + ki] = knn_matches[qi][ki].trainIdx;
+            matches.distance[(size_t) qi * k + ki] = knn_matches[qi][ki].distance;
+        }
+    }
+}
+
+void phg::DescriptorMatcher::matchRatio(const cv::Mat &query_desc, float ratio, std::vector<cv::DMatch> &matches) const
+{
+    if (!(ratio > 0.f && ratio <= 1.f)) {
+        throw std::runtime_error("DescriptorMatcher:: matchRatio : invalid ratio");
+    }
+
+    std::vector<std::vector<cv::DMatch>> knn_matches;
+    knnMatch(query_desc, knn_matches, 2);
+    filterMatchesRatioTest(knn_matches, ratio, matches);
+}
+
+size_t phg::DescriptorMatcher::memoryUsage() const
+{
+    return 0;
+}
 
 void phg::DescriptorMatcher::filterMatchesRatioTest(const std::vector<std::vector<cv::DMatch>> &matches,
                                                     std::vector<cv::DMatch> &filtered_matches)
 {
     const double filter_ratio = 0.7;
 
+    filterMatchesRatioTest(matches, filter_ratio, filtered_matches);
+}
+
+void phg::DescriptorMatcher::filterMatchesRatioTest(const std::vector<std::vector<cv::DMatch>> &matches,
+                                                    double ratio,
+                                                    std::vector<cv::DMatch> &filtered_matches)
+{
     filtered_matches.clear();
     for (auto& vec: matches) {
-        if (vec[0].distance < vec[1].distance * filter_ratio) {
+        // например guided matching может найти меньше двух кандидатов - тогда проверить однозначность нечем
+        if (vec.size() < 2) {
+            continue;
+        }
+        if (vec[0].distance < vec[1].distance * ratio) {
             filtered_matches.push_back(vec[0]);
         }
     }
 }
 
+void phg::DescriptorMatcher::filterMatchesRatioTest(const KnnMatches &matches,
+                                                    std::vector<cv::DMatch> &filtered_matches)
+{
+    const double filter_ratio = 0.7;
+
+    filterMatchesRatioTest(matches, filter_ratio, filtered_matches);
+}
+
+void phg::DescriptorMatcher::filterMatchesRatioTest(const KnnMatches &matches,
+                                                    double ratio,
+                                                    std::vector<cv::DMatch> &filtered_matches)
+{
+    filtered_matches.clear();
+    if (matches.k < 2) {
+        return;
+    }
+    for (int qi = 0; qi < matches.nquery; ++qi) {
+        const size_t i = (size_t) qi * matches.k;
+        if (matches.train_idx[i + 1] == -1) {
+            continue;
+        }
+        if (matches.distance[i] < matches.distance[i + 1] * ratio) {
+            filtered_matches.emplace_back(qi, matches.train_idx[i], matches.distance[i]);
+        }
+    }
+}
+
 void phg::DescriptorMatcher::filterMatchesClusters(const std::vector<cv::DMatch> &matches,
-                                                   const std::vector<cv::KeyPoint> keypoints_query,
-                                                   const std::vector<cv::KeyPoint> keypoints_train,
+                                                   const std::vector<cv::KeyPoint> &keypoints_query,
+                                                   const std::vector<cv::KeyPoint> &keypoints_train,
                                                    std::vector<cv::DMatch> &filtered_matches)
 {
     filtered_matches.clear();
 
-    const size_t  total_neighbours  = 5;  // total number of neighbours to test (including candidate)
-    const size_t  consistent_matches  = 3;  // minimum number of consistent matches (including candidate)
+    const int  consistent_matches  = 3;  // minimum number of consistent matches (including candidate)
     const float  radius_limit_scale  = 2.f;  // limit search radius by scaled median
 
     const int n_matches = matches.size();
@@ -33,28 +200,28 @@ void phg::DescriptorMatcher::filterMatchesClusters(const std::vector<cv::DMatch>
         throw std::runtime_error("DescriptorMatcher::filterMatchesClusters : too few matches");
     }
 
-    cv::Mat points_query(n_matches, 2, CV_32FC1);
-    cv::Mat points_train(n_matches, 2, CV_32FC1);
+    std::vector<cv::Point2f> points_query(n_matches);
+    std::vector<cv::Point2f> points_train(n_matches);
     for (int i = 0; i < n_matches; ++i) {
-        points_query.at<cv::Point2f>(i) = keypoints_query[matches[i].queryIdx].pt;
-        points_train.at<cv::Point2f>(i) = keypoints_train[matches[i].trainIdx].pt;
+        points_query[i] = keypoints_query[matches[i].queryIdx].pt;
+        points_train[i] = keypoints_train[matches[i].trainIdx].pt;
     }
 
-    // размерность всего 2, так что точное KD-дерево
-    std::shared_ptr<cv::flann::IndexParams> index_params = flannKdTreeIndexParams(1);
-    std::shared_ptr<cv::flann::SearchParams> search_params = flannKsTreeSearchParams(32);
-
-    std::shared_ptr<cv::flann::Index> index_query = flannKdTreeIndex(points_query, index_params);
-    std::shared_ptr<cv::flann::Index> index_train = flannKdTreeIndex(points_train, index_params);
+    // размерность всего 2, так что вместо KD-дерева - равномерная сетка, поиск соседей по ней точный
+    const KeypointsGrid grid_query = buildPointsGrid(points_query);
+    const KeypointsGrid grid_train = buildPointsGrid(points_train);
 
     // для каждой точки найти total neighbors ближайших соседей
-    cv::Mat indices_query(n_matches, total_neighbours, CV_32SC1);
-    cv::Mat distances2_query(n_matches, total_neighbours, CV_32FC1);
-    cv::Mat indices_train(n_matches, total_neighbours, CV_32SC1);
-    cv::Mat distances2_train(n_matches, total_neighbours, CV_32FC1);
+    std::vector<int> indices_query(n_matches * total_neighbours);
+    std::vector<float> distances2_query(n_matches * total_neighbours);
+    std::vector<int> indices_train(n_matches * total_neighbours);
+    std::vector<float> distances2_train(n_matches * total_neighbours);
 
-    index_query->knnSearch(points_query, indices_query, distances2_query, total_neighbours, *search_params);
-    index_train->knnSearch(points_train, indices_train, distances2_train, total_neighbours, *search_params);
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (int i = 0; i < n_matches; ++i) {
+        knnSearchGrid(grid_query, points_query, i, &indices_query[i * total_neighbours], &distances2_query[i * total_neighbours]);
+        knnSearchGrid(grid_train, points_train, i, &indices_train[i * total_neighbours], &distances2_train[i * total_neighbours]);
+    }
 
     // оценить радиус поиска для каждой картинки
     // NB: radius2_query, radius2_train: квадраты радиуса!
@@ -63,8 +230,8 @@ void phg::DescriptorMatcher::filterMatchesClusters(const std::vector<cv::DMatch>
         std::vector<double> max_dists2_query(n_matches);
         std::vector<double> max_dists2_train(n_matches);
         for (int i = 0; i < n_matches; ++i) {
-            max_dists2_query[i] = distances2_query.at<float>(i, total_neighbours - 1);
-            max_dists2_train[i] = distances2_train.at<float>(i, total_neighbours - 1);
+            max_dists2_query[i] = distances2_query[i * total_neighbours + total_neighbours - 1];
+            max_dists2_train[i] = distances2_train[i * total_neighbours + total_neighbours - 1];
         }
 
         int median_pos = n_matches / 2;
@@ -78,30 +245,29 @@ void phg::DescriptorMatcher::filterMatchesClusters(const std::vector<cv::DMatch>
     // метч остается, если левое и правое множества первых total_neighbors соседей в радиусах поиска(radius2_query, radius2_train)
     // имеют как минимум consistent_matches общих элементов
 
-    for (size_t i = 0; i < matches.size(); ++i) {
-        std::vector<int> query_neighbors, train_neighbors;
-        
-        for (size_t j = 0; j < total_neighbours; ++j) {
-            int query_idx = indices_query.at<int>(i, j);
-            float query_dist = distances2_query.at<float>(i, j);
-            if (query_dist <= radius2_query) {
-                query_neighbors.push_back(query_idx);
-            }
+    std::vector<char> is_consistent(n_matches);
 
-            int train_idx = indices_train.at<int>(i, j);
-            float train_dist = distances2_train.at<float>(i, j);
-            if (train_dist <= radius2_train) {
-                train_neighbors.push_back(train_idx);
-            }
-        }
+    #pragma omp parallel for
+    for (int i = 0; i < n_matches; ++i) {
+        const int *query_neighbors = &indices_query[i * total_neighbours];
+        const int *train_neighbors = &indices_train[i * total_neighbours];
+        const float *query_dists = &distances2_query[i * total_neighbours];
+        const float *train_dists = &distances2_train[i * total_neighbours];
 
         int num_matches = 0;
-        for (size_t j = 0; j < query_neighbors.size(); ++j) {
-            if (std::find(train_neighbors.begin(), train_neighbors.end(), query_neighbors[j]) != train_neighbors.end()) {
-                num_matches++;
+        for (int j = 0; j < total_neighbours && query_dists[j] <= radius2_query; ++j) {
+            for (int l = 0; l < total_neighbours && train_dists[l] <= radius2_train; ++l) {
+                if (query_neighbors[j] == train_neighbors[l]) {
+                    num_matches++;
+                    break;
+                }
             }
         }
-        if (num_matches >= consistent_matches) {
+        is_consistent[i] = num_matches >= consistent_matches;
+    }
+
+    for (int i = 0; i < n_matches; ++i) {
+        if (is_consistent[i]) {
             filtered_matches.push_back(matches[i]);
         }
     }
@@ -4,16 +4,45 @@
 
 namespace phg {
 
+    // результат knn поиска одним куском памяти вместо вектора на каждый query: ki-й сосед query qi лежит по индексу qi * k + ki,
+    // соседи каждого query упорядочены по возрастанию расстояния, если соседей меньше k - хвост заполнен train_idx = -1
+    struct KnnMatches {
+        int nquery = 0;
+        int k = 0;
+        std::vector<int> train_idx;
+        std::vector<float> distance;
+
+        void resize(int nquery, int k);
+
+        cv::DMatch match(int qi, int ki) const;
+    };
+
     struct DescriptorMatcher {
 
+        virtual ~DescriptorMatcher() {}
+
         virtual void train(const cv::Mat &train_desc) = 0;
         virtual void knnMatch(const cv::Mat &query_desc, std::vector<std::vector<cv::DMatch>> &matches, int k) const = 0;
 
+        // то же что knnMatch, но без аллокаций на каждый query, по умолчанию - конвертация результата knnMatch
+        virtual void knnMatchFlat(const cv::Mat &query_desc, KnnMatches &matches, int k) const;
+
+        // ближайший сосед каждого query, прошедший ratio test (d1 < ratio * d2), все результаты подряд в одном массиве по возрастанию queryIdx
+        // по умолчанию - knnMatch + filterMatchesRatioTest, матчеры переопределяют это чтобы не создавать промежуточные вектора на каждый query
+        virtual void matchRatio(const cv::Mat &query_desc, float ratio, std::vector<cv::DMatch> &matches) const;
+
+        // сколько байт держит обученный матчер (индекс, собственные копии и преобразования дескрипторов) - освобождается вместе с ним,
+        // по умолчанию 0: матчер только ссылается на train дескрипторы, которыми владеет вызывающий код
+        virtual size_t memoryUsage() const;
+
         static void filterMatchesRatioTest(const std::vector<std::vector<cv::DMatch>> &matches, std::vector<cv::DMatch> &filtered_matches);
+        static void filterMatchesRatioTest(const std::vector<std::vector<cv::DMatch>> &matches, double ratio, std::vector<cv::DMatch> &filtered_matches);
+        static void filterMatchesRatioTest(const KnnMatches &matches, std::vector<cv::DMatch> &filtered_matches);
+        static void filterMatchesRatioTest(const KnnMatches &matches, double ratio, std::vector<cv::DMatch> &filtered_matches);
 
         static void filterMatchesClusters(const std::vector<cv::DMatch> &matches,
-                                          const std::vector<cv::KeyPoint> keypoints_query,
-                                          const std::vector<cv::KeyPoint> keypoints_train,
+                                          const std::vector<cv::KeyPoint> &keypoints_query,
+                                          const std::vector<cv::KeyPoint> &keypoints_train,
                                           std::vector<cv::DMatch> &filtered_matches);
     };
 
@@ -0,0 +1,201 @@
+#include "descriptor_pca.h"
+#include "distances.h"
+
+#include <cmath>
+#include <fstream>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+#include <libutils/rasserts.h>
+
+
+namespace {
+
+    const char pca_magic[8] = {'P', 'H', 'G', 'P', 'C', 'A', '0', '1'};
+
+}
+
+phg::DescriptorPCA::DescriptorPCA(int output_dim)
+    : output_dim(output_dim)
+{
+    if (output_dim < 1) {
+        throw std::runtime_error("DescriptorPCA:: invalid parameters");
+    }
+}
+
+void phg::DescriptorPCA::train(const cv::Mat &sample)
+{
+    if (sample.type() != CV_32FC1 || sample.rows <= output_dim || sample.cols < output_dim) {
+        throw std::runtime_error("DescriptorPCA:: train : needed more than output_dim CV_32FC1 descriptors of at least output_dim size");
+    }
+
+    cv::PCA pca(sample, cv::Mat(), cv::PCA::DATA_AS_ROW, output_dim);
+    pca.mean.convertTo(mean, CV_32FC1);
+    pca.eigenvectors.convertTo(basis, CV_32FC1);
+    rassert(mean.rows == 1 && mean.cols == sample.cols, 2389512395123);
+    rassert(basis.rows == output_dim && basis.cols == sample.cols, 2389512395124);
+}
+
+void phg::DescriptorPCA::save(const std::string &path) const
+{
+    if (empty()) {
+        throw std::runtime_error("DescriptorPCA:: save : PCA is not trained");
+    }
+
+    std::ofstream out(path, std::ios::binary);
+    if (!out) {
+        throw std::runtime_error("DescriptorPCA:: save : can't open file " + path);
+    }
+
+    const int32_t dims[2] = {(int32_t) inputDim(), (int32_t) outputDim()};
+    out.write(pca_magic, sizeof(pca_magic));
+    out.write((const char *) dims, sizeof(dims));
+    rassert(mean.isContinuous() && basis.isContinuous(), 2389512395125);
+    out.write((const char *) mean.ptr<float>(), mean.total() * sizeof(float));
+    out.write((const char *) basis.ptr<float>(), basis.total() * sizeof(float));
+
+    if (!out) {
+        throw std::runtime_error("DescriptorPCA:: save : failed to write " + path);
+    }
+}
+
+void phg::DescriptorPCA::load(const std::string &path)
+{
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        throw std::runtime_error("DescriptorPCA:: load : can't open file " + path);
+    }
+
+    char magic[sizeof(pca_magic)];
+    int32_t dims[2];
+    in.read(magic, sizeof(magic));
+    in.read((char *) dims, sizeof(dims));
+    if (!in || std::memcmp(magic, pca_magic, sizeof(magic)) != 0) {
+        throw std::runtime_error("DescriptorPCA:: load : not a PCA file " + path);
+    }
+    if (dims[0] <= 0 || dims[1] <= 0 || dims[1] > dims[0]) {
+        throw std::runtime_error("DescriptorPCA:: load : corrupted header in " + path);
+    }
+
+    cv::Mat loaded_mean(1, dims[0], CV_32FC1);
+    cv::Mat loaded_basis(dims[1], dims[0], CV_32FC1);
+    in.read((char *) loaded_mean.ptr<float>(), loaded_mean.total() * sizeof(float));
+    in.read((char *) loaded_basis.ptr<float>(), loaded_basis.total() * sizeof(float));
+    if (!in) {
+        throw std::runtime_error("DescriptorPCA:: load : unexpected end of file " + path);
+    }
+
+    output_dim = dims[1];
+    mean = loaded_mean;
+    basis = loaded_basis;
+}
+
+void phg::DescriptorPCA::project(const cv::Mat &descriptors, cv::Mat &reduced) const
+{
+    if (empty()) {
+        throw std::runtime_error("DescriptorPCA:: project : PCA is not trained");
+    }
+    if (descriptors.type() != CV_32FC1 || descriptors.cols != inputDim()) {
+        throw std::runtime_error("DescriptorPCA:: project : descriptors type mismatch");
+    }
+
+    const int ndesc = descriptors.rows;
+    const int ndim = inputDim();
+    const int nout = outputDim();
+    const float *m = mean.ptr<float>();
+
+    reduced.create(ndesc, nout, CV_32FC1);
+
+    #pragma omp parallel
+    {
+        std::vector<float> centered(ndim);
+
+        #pragma omp for
+        for (int i = 0; i < ndesc; ++i) {
+            const float *x = descriptors.ptr<float>(i);
+            for (int d = 0; d < ndim; ++d) {
+                centered[d] = x[d] - m[d];
+            }
+
+            float *y = reduced.ptr<float>(i);
+            for (int j = 0; j < nout; ++j) {
+                const float *w = basis.ptr<float>(j);
+                float dot = 0.f;
+                for (int d = 0; d < ndim; ++d) {
+                    dot += w[d] * centered[d];
+                }
+                y[j] = dot;
+            }
+        }
+    }
+}
+
+phg::PCAMatcher::PCAMatcher(const DescriptorPCA &pca, std::unique_ptr<DescriptorMatcher> matcher, int n_rerank)
+    : pca(pca)
+    , matcher(std::move(matcher))
+    , n_rerank(n_rerank)
+{
+    if (!this->matcher || n_rerank < 1) {
+        throw std::runtime_error("PCAMatcher:: invalid parameters");
+    }
+}
+
+void phg::PCAMatcher::train(const cv::Mat &train_desc)
+{
+    if (train_desc.rows < 2) {
+        throw std::runtime_error("PCAMatcher:: train : needed at least 2 train descriptors");
+    }
+    if (pca.empty()) {
+        throw std::runtime_error("PCAMatcher:: train : PCA is not trained");
+    }
+
+    pca.project(train_desc, reduced_train_desc);
+    matcher->train(reduced_train_desc);
+    train_desc_ptr = &train_desc;
+}
+
+void phg::PCAMatcher::knnMatch(const cv::Mat &query_desc,
+                               std::vector<std::vector<cv::DMatch>> &matches,
+                               int k) const
+{
+    if (!train_desc_ptr) {
+        throw std::runtime_error("PCAMatcher:: knnMatch : matcher is not trained");
+    }
+    if (query_desc.type() != CV_32FC1 || query_desc.cols != train_desc_ptr->cols) {
+        throw std::runtime_error("PCAMatcher:: knnMatch : query descriptors type mismatch");
+    }
+    if (k < 1 || k > train_desc_ptr->rows) {
+        throw std::runtime_error("PCAMatcher:: knnMatch : invalid k");
+    }
+
+    const cv::Mat &train_desc = *train_desc_ptr;
+    const int ndesc = query_desc.rows;
+    const int ndim = query_desc.cols;
+    const int n_shortlist = std::min(train_desc.rows, std::max(k, n_rerank));
+
+    cv::Mat reduced_query_desc;
+    pca.project(query_desc, reduced_query_desc);
+
+    matches.clear();
+    matcher->knnMatch(reduced_query_desc, matches, n_shortlist);
+    rassert((int) matches.size() == ndesc, 2389512395126);
+
+    // перепроверка кандидатов по полным дескрипторам, результат пишется на место shortlist-а
+    #pragma omp parallel for schedule(dynamic, 16)
+    for (int qi = 0; qi < ndesc; ++qi) {
+        std::vector<cv::DMatch> &dst = matches[qi];
+        const float *q = query_desc.ptr<float>(qi);
+        for (cv::DMatch &match : dst) {
+            match.distance = std::sqrt(l2sqr(q, train_desc.ptr<float>(match.trainIdx), ndim));
+        }
+        std::sort(dst.begin(), dst.end());
+        if ((int) dst.size() > k) {
+            dst.resize(k);
+        }
+    }
+}
+
+size_t phg::PCAMatcher::memoryUsage() const
+{
+    return reduced_train_desc.total() * reduced_train_desc.elemSize() + matcher->memoryUsage();
+}
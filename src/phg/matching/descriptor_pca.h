@@ -0,0 +1,62 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <opencv2/core.hpp>
+
+#include "descriptor_matcher.h"
+
+namespace phg {
+
+    // проекция дескрипторов на первые главные компоненты (например SIFT 128 -> 32 или 64):
+    // учится один раз на выборке дескрипторов (обычно со всех картинок) и сохраняется на диск рядом с остальными кешами
+    class DescriptorPCA {
+    public:
+        DescriptorPCA(int output_dim = 32);
+
+        void train(const cv::Mat &sample);
+
+        void save(const std::string &path) const;
+        void load(const std::string &path);
+
+        bool empty() const { return basis.empty(); }
+        int inputDim() const { return basis.cols; }
+        int outputDim() const { return basis.rows; }
+
+        // reduced = (descriptors - mean) * basis^T, CV_32FC1
+        void project(const cv::Mat &descriptors, cv::Mat &reduced) const;
+
+    private:
+
+        int output_dim;
+
+        cv::Mat mean;   // 1 x input_dim
+        cv::Mat basis;  // output_dim x input_dim, строки - главные компоненты по убыванию дисперсии
+    };
+
+    // поиск кандидатов по PCA-проекциям любым матчером (FLANN, перебор) - индекс и поиск дешевле пропорционально размерности,
+    // затем n_rerank лучших кандидатов перепроверяются точным L2 по исходным дескрипторам
+    // NB: внутренний матчер должен поддерживать k = max(k, n_rerank)
+    struct PCAMatcher : DescriptorMatcher {
+
+        // pca должен жить дольше матчера
+        PCAMatcher(const DescriptorPCA &pca, std::unique_ptr<DescriptorMatcher> matcher, int n_rerank = 8);
+
+        void train(const cv::Mat &train_desc) override;
+
+        void knnMatch(const cv::Mat &query_desc, std::vector<std::vector<cv::DMatch>> &matches, int k) const override;
+
+        // проекции train дескрипторов и индекс внутреннего матчера по ним
+        size_t memoryUsage() const override;
+
+    private:
+
+        const DescriptorPCA &pca;
+        std::unique_ptr<DescriptorMatcher> matcher;
+        int n_rerank;
+
+        cv::Mat reduced_train_desc;  // на нем обучен внутренний матчер
+        const cv::Mat *train_desc_ptr = nullptr;
+    };
+
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstdint>
+
+#if defined _MSC_VER
+#include <intrin.h>
+#endif
+
+// SIMD ядра матчеров компилируются под нужный набор инструкций атрибутом target и выбираются во время работы по __builtin_cpu_supports,
+// так что обычная сборка (без -march=native) тоже ими пользуется, а на старых процессорах работает скалярный вариант;
+// без поддержки атрибута (MSVC, не x86) - только то, что разрешено флагами сборки (например /arch:AVX2)
+#if (defined __GNUC__ || defined __clang__) && (defined __x86_64__ || defined __i386__)
+#define PHG_RUNTIME_DISPATCH 1
+#define PHG_TARGET(features) __attribute__((target(features)))
+#else
+#define PHG_RUNTIME_DISPATCH 0
+#define PHG_TARGET(features)
+#endif
+
+namespace phg {
+
+    // общие для матчеров расстояния между дескрипторами
+
+    // квадрат L2 расстояния, простой цикл - компилятор сам его векторизует
+    inline float l2sqr(const float *a, const float *b, int n)
+    {
+        float sum = 0.f;
+        for (int i = 0; i < n; ++i) {
+            float d = a[i] - b[i];
+            sum += d * d;
+        }
+        return sum;
+    }
+
+    // число единичных бит (для расстояния Хэмминга)
+    inline int popcount64(uint64_t x)
+    {
+#if defined _MSC_VER
+        return (int) __popcnt64(x);
+#else
+        return __builtin_popcountll(x);
+#endif
+    }
+
+}
@@ -0,0 +1,80 @@
+#include "feature_index_cache.h"
+
+#include <stdexcept>
+
+
+phg::FeatureIndexCache::FeatureIndexCache(const std::vector<cv::Mat> &descriptors, const MatcherFactory &create_matcher, size_t max_memory)
+    : descriptors(descriptors)
+    , create_matcher(create_matcher)
+    , max_memory(max_memory)
+    , entries(descriptors.size())
+    , memory_usage(0)
+    , nbuilds_(0)
+{
+    if (!create_matcher) {
+        throw std::runtime_error("FeatureIndexCache:: matcher factory is empty");
+    }
+}
+
+std::shared_ptr<const phg::DescriptorMatcher> phg::FeatureIndexCache::get(int image)
+{
+    if (image < 0 || image >= nimages()) {
+        throw std::runtime_error("FeatureIndexCache:: get : invalid image");
+    }
+    Entry &entry = entries[image];
+
+    {
+        Lock lock(mutex);
+        if (entry.matcher) {
+            lru.splice(lru.begin(), lru, entry.lru_position);
+            return entry.matcher;
+        }
+    }
+
+    // строим без общей блокировки, чтобы индексы разных картинок строились параллельно,
+    // а второй поток, запросивший ту же картинку, дождется первого на build_mutex и возьмет готовый индекс
+    Lock build_lock(entry.build_mutex);
+    {
+        Lock lock(mutex);
+        if (entry.matcher) {
+            lru.splice(lru.begin(), lru, entry.lru_position);
+            return entry.matcher;
+        }
+    }
+
+    std::unique_ptr<DescriptorMatcher> matcher = create_matcher();
+    matcher->train(descriptors[image]);
+    std::shared_ptr<const DescriptorMatcher> result(matcher.release());
+    const size_t index_memory = result->memoryUsage();
+
+    Lock lock(mutex);
+    entry.matcher = result;
+    entry.memory = index_memory;
+    lru.push_front(image);
+    entry.lru_position = lru.begin();
+    memory_usage += index_memory;
+    ++nbuilds_;
+
+    // только что построенный индекс не выбрасываем, даже если он один больше лимита
+    while (max_memory > 0 && memory_usage > max_memory && lru.size() > 1) {
+        const int evicted = lru.back();
+        lru.pop_back();
+        entries[evicted].matcher.reset();
+        memory_usage -= entries[evicted].memory;
+        entries[evicted].memory = 0;
+    }
+
+    return result;
+}
+
+int phg::FeatureIndexCache::nbuilds() const
+{
+    Lock lock(mutex);
+    return nbuilds_;
+}
+
+size_t phg::FeatureIndexCache::memoryUsage() const
+{
+    Lock lock(mutex);
+    return memory_usage;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <list>
+#include <memory>
+#include <vector>
+#include <functional>
+#include <opencv2/core.hpp>
+#include <libutils/thread_mutex.h>
+
+#include "descriptor_matcher.h"
+
+namespace phg {
+
+    // обученные матчеры (kd-деревья FLANN и т.п.) по картинкам набора, чтобы при сопоставлении всех пар
+    // индекс по дескрипторам картинки строился один раз, а не для каждой пары где она выступает как train:
+    // индекс строится лениво при первом запросе, параллельные запросы той же картинки ждут одного построения,
+    // при превышении лимита памяти из кеша выбрасываются давно не использованные индексы (LRU)
+    class FeatureIndexCache {
+    public:
+        typedef std::function<std::unique_ptr<DescriptorMatcher>()> MatcherFactory;
+
+        // descriptors должны жить дольше кеша - матчеры хранят ссылку на train дескрипторы
+        // max_memory - лимит в байтах (0 - без ограничения) на память, которую держат сами индексы (DescriptorMatcher::memoryUsage),
+        // train дескрипторы принадлежат вызывающему коду и не учитываются - выбрасывание индекса их не освобождает
+        FeatureIndexCache(const std::vector<cv::Mat> &descriptors, const MatcherFactory &create_matcher, size_t max_memory = 0);
+
+        // потокобезопасно, выброшенный из кеша индекс остается жив пока на него есть ссылки
+        std::shared_ptr<const DescriptorMatcher> get(int image);
+
+        int nimages() const { return (int) entries.size(); }
+
+        // сколько раз строились индексы (больше nimages() только если срабатывал лимит памяти)
+        int nbuilds() const;
+
+        // суммарная оценка памяти индексов в кеше
+        size_t memoryUsage() const;
+
+    private:
+
+        struct Entry {
+            Mutex build_mutex;                                // сериализует построение индекса одной картинки
+            std::shared_ptr<const DescriptorMatcher> matcher; // nullptr если не построен или выброшен
+            std::list<int>::iterator lru_position;
+            size_t memory = 0;                                // memoryUsage построенного индекса
+        };
+
+        const std::vector<cv::Mat> &descriptors;
+        MatcherFactory create_matcher;
+        size_t max_memory;
+
+        Mutex mutex;                                          // защищает matcher и memory у всех записей, lru, memory_usage и nbuilds_
+        std::vector<Entry> entries;
+        std::list<int> lru;                                   // построенные индексы, в начале - последний использованный
+        size_t memory_usage;
+        int nbuilds_;
+    };
+
+}
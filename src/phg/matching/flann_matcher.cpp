@@ -1,36 +1,133 @@
+#include <string>
 #include <iostream>
+#include <algorithm>
+#include <stdexcept>
 #include "flann_matcher.h"
 #include "flann_factory.h"
 
-phg::FlannMatcher::FlannMatcher()
+#include <libutils/rasserts.h>
+
+
+namespace {
+
+    // запросы ищутся блоками параллельно по общему индексу (поиск по kd-деревьям его не меняет),
+    // каждый блок пишет в свои строки результата - порядок не зависит от числа потоков
+    const int QUERY_BLOCK_SIZE = 256;
+
+    void knnSearchBlocks(cv::flann::Index &index, const cv::flann::SearchParams &search_params,
+                         const cv::Mat &query_desc, cv::Mat &indices, cv::Mat &distances2, int k)
+    {
+        const int nquery = query_desc.rows;
+        const int nblocks = (nquery + QUERY_BLOCK_SIZE - 1) / QUERY_BLOCK_SIZE;
+
+        #pragma omp parallel for schedule(dynamic, 1)
+        for (int block = 0; block < nblocks; ++block) {
+            const int from = block * QUERY_BLOCK_SIZE;
+            const int to = std::min(nquery, from + QUERY_BLOCK_SIZE);
+
+            cv::Mat block_indices = indices.rowRange(from, to);
+            cv::Mat block_distances2 = distances2.rowRange(from, to);
+            index.knnSearch(query_desc.rowRange(from, to), block_indices, block_distances2, k, search_params);
+            rassert(block_indices.ptr<int>() == indices.ptr<int>(from) && block_distances2.ptr<float>() == distances2.ptr<float>(from), 2381923591236);
+        }
+    }
+
+}
+
+phg::FlannMatcher::FlannMatcher(int num_trees, int num_checks)
+    : num_trees(num_trees)
+    , num_checks(num_checks)
+    , index_memory(0)
 {
-    const int num_trees = 4;
-    const int num_checks = 32;
+    if (num_trees < 1 || num_checks < 1) {
+        throw std::runtime_error("FlannMatcher:: invalid parameters");
+    }
 
     // параметры для приближенного поиска
     index_params = flannKdTreeIndexParams(num_trees);
     search_params = flannKsTreeSearchParams(num_checks);
 }
 
+std::string phg::FlannMatcher::params() const
+{
+    return "flann_t" + std::to_string(num_trees) + "_c" + std::to_string(num_checks);
+}
+
 void phg::FlannMatcher::train(const cv::Mat &train_desc)
 {
+    // случайность нужна только при построении kd-деревьев, фиксируем ее не трогая глобальный генератор
+    cv::RNG rng_backup = cv::theRNG();
+    cv::setRNGSeed(125125);
     flann_index = flannKdTreeIndex(train_desc, index_params);
+    cv::theRNG() = rng_backup;
+
+    // узел kd-дерева FLANN: номер измерения, порог и два указателя на детей
+    const size_t n = train_desc.rows;
+    const size_t node_size = sizeof(int) + sizeof(float) + 2 * sizeof(void *);
+    index_memory = train_desc.total() * train_desc.elemSize() + num_trees * (n * sizeof(int) + 2 * n * node_size);
+}
+
+size_t phg::FlannMatcher::memoryUsage() const
+{
+    return index_memory;
 }
 
 void phg::FlannMatcher::knnMatch(const cv::Mat &query_desc, std::vector<std::vector<cv::DMatch>> &matches, int k) const
 {
-    cv::setRNGSeed(125125);
-    cv::Mat indices;
-    cv::Mat distances2;
-    flann_index->knnSearch(query_desc, indices, distances2, k, *search_params);
-    int numMatches = indices.rows;
-    for (size_t i = 0; i < numMatches; ++i) {
-        std::vector<cv::DMatch> kMatches;
-        for (size_t j = 0; j < k; j++) {
-            int idx = indices.at<int>(i, j);
-            float dist = sqrt(distances2.at<float>(i, j));
-            kMatches.emplace_back(i, idx, dist);
+    KnnMatches flat;
+    knnMatchFlat(query_desc, flat, k);
+
+    const int nquery = query_desc.rows;
+    matches.assign(nquery, std::vector<cv::DMatch>(k));
+
+    #pragma omp parallel for
+    for (int qi = 0; qi < nquery; ++qi) {
+        for (int ki = 0; ki < k; ++ki) {
+            matches[qi][ki] = flat.match(qi, ki);
+        }
+    }
+}
+
+void phg::FlannMatcher::knnMatchFlat(const cv::Mat &query_desc, KnnMatches &matches, int k) const
+{
+    matches.resize(query_desc.rows, k);
+    if (query_desc.rows == 0) {
+        return;
+    }
+
+    // flann пишет прямо в буферы результата: матрицы нужного размера и типа не переаллоцируются
+    cv::Mat indices(query_desc.rows, k, CV_32SC1, matches.train_idx.data());
+    cv::Mat distances2(query_desc.rows, k, CV_32FC1, matches.distance.data());
+    knnSearchBlocks(*flann_index, *search_params, query_desc, indices, distances2, k);
+
+    #pragma omp parallel for
+    for (int i = 0; i < (int) matches.distance.size(); ++i) {
+        matches.distance[i] = std::sqrt(matches.distance[i]);
+    }
+}
+
+void phg::FlannMatcher::matchRatio(const cv::Mat &query_desc, float ratio, std::vector<cv::DMatch> &matches) const
+{
+    if (!(ratio > 0.f && ratio <= 1.f)) {
+        throw std::runtime_error("FlannMatcher:: matchRatio : invalid ratio");
+    }
+
+    matches.clear();
+    if (query_desc.rows == 0) {
+        return;
+    }
+
+    cv::Mat indices(query_desc.rows, 2, CV_32SC1);
+    cv::Mat distances2(query_desc.rows, 2, CV_32FC1);
+    knnSearchBlocks(*flann_index, *search_params, query_desc, indices, distances2, 2);
+
+    // flann возвращает квадраты расстояний: d1 < ratio * d2 <=> d1^2 < ratio^2 * d2^2
+    const float ratio2 = ratio * ratio;
+
+    for (int i = 0; i < indices.rows; ++i) {
+        const float *dists2 = distances2.ptr<float>(i);
+        if (dists2[0] < ratio2 * dists2[1]) {
+            matches.emplace_back(i, indices.at<int>(i, 0), std::sqrt(dists2[0]));
         }
-        matches.push_back(kMatches);
     }
 }
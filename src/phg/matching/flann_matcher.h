@@ -1,5 +1,7 @@
 #pragma once
 
+#include <string>
+
 #include "descriptor_matcher.h"
 #include <opencv2/flann/miniflann.hpp>
 
@@ -7,14 +9,28 @@ namespace phg {
 
     struct FlannMatcher : DescriptorMatcher {
 
-        FlannMatcher();
+        FlannMatcher(int num_trees = 4, int num_checks = 32);
+
+        // параметры индекса и поиска строкой (например для ключей кешей сопоставлений): "flann_t4_c32"
+        std::string params() const;
 
         void train(const cv::Mat &train_desc) override;
 
         void knnMatch(const cv::Mat &query_desc, std::vector<std::vector<cv::DMatch>> &matches, int k) const override;
 
+        void knnMatchFlat(const cv::Mat &query_desc, KnnMatches &matches, int k) const override;
+
+        void matchRatio(const cv::Mat &query_desc, float ratio, std::vector<cv::DMatch> &matches) const override;
+
+        // оценка: cv::flann::Index хранит копию train дескрипторов и num_trees kd-деревьев (перестановка индексов и ~2n узлов на дерево)
+        size_t memoryUsage() const override;
+
     private:
 
+        int num_trees;
+        int num_checks;
+        size_t index_memory;
+
         std::shared_ptr<cv::flann::IndexParams> index_params;
         std::shared_ptr<cv::flann::SearchParams> search_params;
         std::shared_ptr<cv::flann::Index> flann_index;
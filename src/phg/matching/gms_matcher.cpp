@@ -2,14 +2,52 @@
 
 #include "gms_matcher_impl.h"
 
+namespace {
+
+    const bool gms_with_scale = true;
+    const bool gms_with_rotation = true;
+
+}
+
+phg::GMSImageGrid::GMSImageGrid(const std::vector<cv::KeyPoint> &keypoints, const cv::Size &size)
+{
+    const size_t npoints = keypoints.size();
+    for (int type = 1; type <= 4; ++type) {
+        left_cells[type - 1].resize(npoints);
+    }
+    for (int scale = 0; scale < 5; ++scale) {
+        right_cells[scale].resize(npoints);
+    }
+
+    for (size_t i = 0; i < npoints; ++i) {
+        // координаты нормируются в [0, 1]
+        const cv::Point2f pt(keypoints[i].pt.x / size.width, keypoints[i].pt.y / size.height);
+        for (int type = 1; type <= 4; ++type) {
+            left_cells[type - 1][i] = GetGridIndexLeft(pt, type);
+        }
+        for (int scale = 0; scale < 5; ++scale) {
+            right_cells[scale][i] = GetGridIndexRight(pt, scale);
+        }
+    }
+}
+
 // source: https://github.com/JiawangBian/GMS-Feature-Matcher
 int phg::filterMatchesGMS(const std::vector <cv::DMatch> &matches_all,
-                           const std::vector <cv::KeyPoint> kp1,
-                           const std::vector <cv::KeyPoint> kp2,
+                           const std::vector <cv::KeyPoint> &kp1,
+                           const std::vector <cv::KeyPoint> &kp2,
                            const cv::Size &sz1,
                            const cv::Size &sz2,
                            std::vector <cv::DMatch> &matches_gms,
                            bool verbose)
+{
+    return filterMatchesGMS(matches_all, GMSImageGrid(kp1, sz1), GMSImageGrid(kp2, sz2), matches_gms, verbose);
+}
+
+int phg::filterMatchesGMS(const std::vector <cv::DMatch> &matches_all,
+                           const GMSImageGrid &grid1,
+                           const GMSImageGrid &grid2,
+                           std::vector <cv::DMatch> &matches_gms,
+                           bool verbose)
 {
     matches_gms.clear();
 
@@ -17,8 +55,8 @@ int phg::filterMatchesGMS(const std::vector <cv::DMatch> &matches_all,
     using namespace cv;
 
     std::vector<bool> vbInliers;
-    gms_matcher gms(kp1, sz1, kp2, sz2, matches_all);
-    int num_inliers = gms.GetInlierMask(vbInliers, true, true);
+    gms_matcher gms(grid1, grid2, matches_all);
+    int num_inliers = gms.GetInlierMask(vbInliers, gms_with_scale, gms_with_rotation);
     if (verbose) {
         cout << "Get total " << num_inliers << " matches." << endl;
     }
@@ -31,3 +69,9 @@ int phg::filterMatchesGMS(const std::vector <cv::DMatch> &matches_all,
 
     return num_inliers;
 }
+
+std::string phg::filterMatchesGMSParams()
+{
+    return "gms_g" + std::to_string(mGridWidthLeft) + "x" + std::to_string(mGridHeightLeft) + "_th" + std::to_string(THRESH_FACTOR)
+           + (gms_with_scale ? "_scale" : "") + (gms_with_rotation ? "_rot" : "");
+}
@@ -1,16 +1,38 @@
 #pragma once
 
+#include <string>
+#include <vector>
 #include <opencv2/core.hpp>
 
 namespace phg {
 
+    // часть GMS, зависящая только от одной картинки: номера ячеек каждой ключевой точки
+    // в 4 сдвинутых сетках 20x20 (когда картинка - query) и в сетках всех 5 масштабов (когда картинка - train)
+    // при сопоставлении всех пар строится один раз на картинку, на пару остается только подсчет статистики
+    struct GMSImageGrid {
+        GMSImageGrid() {}
+        GMSImageGrid(const std::vector<cv::KeyPoint> &keypoints, const cv::Size &size);
+
+        std::vector<int> left_cells[4];  // -1 если точка вне сетки
+        std::vector<int> right_cells[5];
+    };
+
     // source: https://github.com/JiawangBian/GMS-Feature-Matcher
     int filterMatchesGMS(const std::vector<cv::DMatch> &matches,
-                                      const std::vector<cv::KeyPoint> keypoints_query,
-                                      const std::vector<cv::KeyPoint> keypoints_train,
+                                      const std::vector<cv::KeyPoint> &keypoints_query,
+                                      const std::vector<cv::KeyPoint> &keypoints_train,
                                       const cv::Size &sz_query,
                                       const cv::Size &sz_train,
                                       std::vector<cv::DMatch> &filtered_matches,
                                       bool verbose=true);
 
+    int filterMatchesGMS(const std::vector<cv::DMatch> &matches,
+                         const GMSImageGrid &grid_query,
+                         const GMSImageGrid &grid_train,
+                         std::vector<cv::DMatch> &filtered_matches,
+                         bool verbose=true);
+
+    // параметры фильтрации GMS строкой (например для ключей кешей сопоставлений)
+    std::string filterMatchesGMSParams();
+
 }
@@ -35,10 +35,12 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.*/
 // source: https://github.com/JiawangBian/GMS-Feature-Matcher
 
 #pragma once
+#include "gms_matcher.h"
 #include <opencv2/opencv.hpp>
 #include <vector>
 #include <iostream>
 #include <ctime>
+#include <algorithm>
 using namespace std;
 using namespace cv;
 
@@ -83,157 +85,77 @@ const int mRotationPatterns[8][9] = {
 const double mScaleRatios[5] = { 1.0, 1.0 / 2, 1.0 / sqrt(2.0), sqrt(2.0), 2.0 };
 
 
-class gms_matcher
-{
-public:
-    // OpenCV Keypoints & Correspond Image Size & Nearest Neighbor Matches
-    gms_matcher(const vector<KeyPoint> &vkp1, const Size size1, const vector<KeyPoint> &vkp2, const Size size2, const vector<DMatch> &vDMatches)
-    {
-        // Input initialize
-        NormalizePoints(vkp1, size1, mvP1);
-        NormalizePoints(vkp2, size2, mvP2);
-        mNumberMatches = vDMatches.size();
-        ConvertMatches(vDMatches, mvMatches);
-
-        // Grid initialize
-        mGridSizeLeft = Size(20, 20);
-        mGridNumberLeft = mGridSizeLeft.width * mGridSizeLeft.height;
-
-        // Initialize the neihbor of left grid
-        mGridNeighborLeft = Mat::zeros(mGridNumberLeft, 9, CV_32SC1);
-        InitalizeNiehbors(mGridNeighborLeft, mGridSizeLeft);
-    };
-    ~gms_matcher() {};
-
-private:
-
-    // Normalized Points
-    vector<Point2f> mvP1, mvP2;
-
-    // Matches
-    vector<pair<int, int> > mvMatches;
-
-    // Number of Matches
-    size_t mNumberMatches;
+// Grid sizes do not depend on images: left grid is 20 x 20, right grids are scaled by mScaleRatios
+const int mGridWidthLeft = 20;
+const int mGridHeightLeft = 20;
+const int mGridNumberLeft = mGridWidthLeft * mGridHeightLeft;
 
-    // Grid Size
-    Size mGridSizeLeft, mGridSizeRight;
-    int mGridNumberLeft;
-    int mGridNumberRight;
-
-    // x	  : left grid idx
-    // y      :  right grid idx
-    // value  : how many matches from idx_left to idx_right
-    Mat mMotionStatistics;
-
-    //
-    vector<int> mNumberPointsInPerCellLeft;
-
-    // Inldex  : grid_idx_left
-    // Value   : grid_idx_right
-    vector<int> mCellPairs;
-
-    // Every Matches has a cell-pair
-    // first  : grid_idx_left
-    // second : grid_idx_right
-    vector<pair<int, int> > mvMatchPairs;
-
-    // Inlier Mask for output
-    vector<bool> mvbInlierMask;
-
-    //
-    Mat mGridNeighborLeft;
-    Mat mGridNeighborRight;
-
-public:
-
-    // Get Inlier Mask
-    // Return number of inliers
-    int GetInlierMask(vector<bool> &vbInliers, bool WithScale = false, bool WithRotation = false);
-
-private:
+inline Size GetGridSizeRight(int Scale) {
+    return Size(mGridWidthLeft * mScaleRatios[Scale], mGridHeightLeft * mScaleRatios[Scale]);
+}
 
-    // Normalize Key Points to Range(0 - 1)
-    void NormalizePoints(const vector<KeyPoint> &kp, const Size &size, vector<Point2f> &npts) {
-        const size_t numP = kp.size();
-        const int width   = size.width;
-        const int height  = size.height;
-        npts.resize(numP);
+// Cell of normalized point in one of 4 shifted left grids (-1 if outside)
+inline int GetGridIndexLeft(const Point2f &pt, int type) {
+    int x = 0, y = 0;
 
-        for (size_t i = 0; i < numP; i++)
-        {
-            npts[i].x = kp[i].pt.x / width;
-            npts[i].y = kp[i].pt.y / height;
-        }
-    }
+    if (type == 1) {
+        x = floor(pt.x * mGridWidthLeft);
+        y = floor(pt.y * mGridHeightLeft);
 
-    // Convert OpenCV DMatch to Match (pair<int, int>)
-    void ConvertMatches(const vector<DMatch> &vDMatches, vector<pair<int, int> > &vMatches) {
-        vMatches.resize(mNumberMatches);
-        for (size_t i = 0; i < mNumberMatches; i++)
-        {
-            vMatches[i] = pair<int, int>(vDMatches[i].queryIdx, vDMatches[i].trainIdx);
+        if (y >= mGridHeightLeft || x >= mGridWidthLeft){
+            return -1;
         }
     }
 
-    int GetGridIndexLeft(const Point2f &pt, int type) {
-        int x = 0, y = 0;
-
-        if (type == 1) {
-            x = floor(pt.x * mGridSizeLeft.width);
-            y = floor(pt.y * mGridSizeLeft.height);
+    if (type == 2) {
+        x = floor(pt.x * mGridWidthLeft + 0.5);
+        y = floor(pt.y * mGridHeightLeft);
 
-            if (y >= mGridSizeLeft.height || x >= mGridSizeLeft.width){
-                return -1;
-            }
-        }
-
-        if (type == 2) {
-            x = floor(pt.x * mGridSizeLeft.width + 0.5);
-            y = floor(pt.y * mGridSizeLeft.height);
-
-            if (x >= mGridSizeLeft.width || x < 1) {
-                return -1;
-            }
+        if (x >= mGridWidthLeft || x < 1) {
+            return -1;
         }
+    }
 
-        if (type == 3) {
-            x = floor(pt.x * mGridSizeLeft.width);
-            y = floor(pt.y * mGridSizeLeft.height + 0.5);
+    if (type == 3) {
+        x = floor(pt.x * mGridWidthLeft);
+        y = floor(pt.y * mGridHeightLeft + 0.5);
 
-            if (y >= mGridSizeLeft.height || y < 1) {
-                return -1;
-            }
+        if (y >= mGridHeightLeft || y < 1) {
+            return -1;
         }
+    }
 
-        if (type == 4) {
-            x = floor(pt.x * mGridSizeLeft.width + 0.5);
-            y = floor(pt.y * mGridSizeLeft.height + 0.5);
+    if (type == 4) {
+        x = floor(pt.x * mGridWidthLeft + 0.5);
+        y = floor(pt.y * mGridHeightLeft + 0.5);
 
-            if (y >= mGridSizeLeft.height || y < 1 || x >= mGridSizeLeft.width || x < 1) {
-                return -1;
-            }
+        if (y >= mGridHeightLeft || y < 1 || x >= mGridWidthLeft || x < 1) {
+            return -1;
         }
-
-        return x + y * mGridSizeLeft.width;
     }
 
-    int GetGridIndexRight(const Point2f &pt) {
-        int x = floor(pt.x * mGridSizeRight.width);
-        int y = floor(pt.y * mGridSizeRight.height);
+    return x + y * mGridWidthLeft;
+}
 
-        return x + y * mGridSizeRight.width;
-    }
+// Cell of normalized point in right grid of given scale (-1 if outside)
+inline int GetGridIndexRight(const Point2f &pt, int Scale) {
+    const Size GridSize = GetGridSizeRight(Scale);
+    int x = floor(pt.x * GridSize.width);
+    int y = floor(pt.y * GridSize.height);
 
-    // Assign Matches to Cell Pairs
-    void AssignMatchPairs(int GridType);
+    if (x < 0 || y < 0 || x >= GridSize.width || y >= GridSize.height) {
+        return -1;
+    }
 
-    // Verify Cell Pairs
-    void VerifyCellPairs(int RotationType);
+    return x + y * GridSize.width;
+}
 
-    // Get Neighbor 9
-    vector<int> GetNB9(const int idx, const Size& GridSize) {
-        vector<int> NB9(9, -1);
+// 3 x 3 neighbourhoods of all cells of a grid (-1 outside the grid): flat array, 9 ints per cell
+inline void InitalizeNiehbors(vector<int> &neighbor, const Size& GridSize) {
+    neighbor.assign(GridSize.width * GridSize.height * 9, -1);
+    for (int idx = 0; idx < GridSize.width * GridSize.height; idx++)
+    {
+        int *NB9 = &neighbor[idx * 9];
 
         int idx_x = idx % GridSize.width;
         int idx_y = idx / GridSize.width;
@@ -251,155 +173,210 @@ private:
                 NB9[xi + 4 + yi * 3] = idx_xx + idx_yy * GridSize.width;
             }
         }
-        return NB9;
+    }
+}
+
+// Neighbour tables are the same for all image pairs, so they are built once (thread-safe since C++11)
+struct GridNeighbors
+{
+    vector<int> left;
+    vector<int> right[5];
+
+    static const GridNeighbors &instance() {
+        static const GridNeighbors neighbors;
+        return neighbors;
     }
 
-    void InitalizeNiehbors(Mat &neighbor, const Size& GridSize) {
-        for (int i = 0; i < neighbor.rows; i++)
+private:
+    GridNeighbors() {
+        InitalizeNiehbors(left, Size(mGridWidthLeft, mGridHeightLeft));
+        for (int Scale = 0; Scale < 5; Scale++)
         {
-            vector<int> NB9 = GetNB9(i, GridSize);
-            int *data = neighbor.ptr<int>(i);
-            memcpy(data, &NB9[0], sizeof(int) * 9);
+            InitalizeNiehbors(right[Scale], GetGridSizeRight(Scale));
         }
     }
+};
 
-    void SetScale(int Scale) {
-        // Set Scale
-        mGridSizeRight.width = mGridSizeLeft.width  * mScaleRatios[Scale];
-        mGridSizeRight.height = mGridSizeLeft.height * mScaleRatios[Scale];
-        mGridNumberRight = mGridSizeRight.width * mGridSizeRight.height;
 
-        // Initialize the neihbor of right grid
-        mGridNeighborRight = Mat::zeros(mGridNumberRight, 9, CV_32SC1);
-        InitalizeNiehbors(mGridNeighborRight, mGridSizeRight);
-    }
+class gms_matcher
+{
+public:
+    // Precomputed grids of both images & Nearest Neighbor Matches
+    gms_matcher(const phg::GMSImageGrid &grid1, const phg::GMSImageGrid &grid2, const vector<DMatch> &vDMatches)
+        : mGrid1(grid1)
+        , mGrid2(grid2)
+        , mNeighbors(GridNeighbors::instance())
+    {
+        mNumberMatches = vDMatches.size();
+        ConvertMatches(vDMatches, mvMatches);
+    };
+    ~gms_matcher() {};
 
-    // Run
-    int run(int RotationType);
-};
+private:
 
-int gms_matcher::GetInlierMask(vector<bool> &vbInliers, bool WithScale, bool WithRotation) {
+    // Cells of keypoints of both images
+    const phg::GMSImageGrid &mGrid1;
+    const phg::GMSImageGrid &mGrid2;
 
-    int max_inlier = 0;
+    // Matches
+    vector<pair<int, int> > mvMatches;
 
-    if (!WithScale && !WithRotation)
-    {
-        SetScale(0);
-        max_inlier = run(1);
-        vbInliers = mvbInlierMask;
-        return max_inlier;
-    }
+    // Number of Matches
+    size_t mNumberMatches;
 
-    if (WithRotation && WithScale)
-    {
-        for (int Scale = 0; Scale < 5; Scale++)
-        {
-            SetScale(Scale);
-            for (int RotationType = 1; RotationType <= 8; RotationType++)
-            {
-                int num_inlier = run(RotationType);
+    const GridNeighbors &mNeighbors;
 
-                if (num_inlier > max_inlier)
-                {
-                    vbInliers = mvbInlierMask;
-                    max_inlier = num_inlier;
-                }
-            }
+    // Sparse motion statistics: for every left cell - sorted (right cell, how many matches from left cell to right cell)
+    // only non-empty cell pairs are stored: number of them is bounded by number of matches, not by mGridNumberLeft x mGridNumberRight
+    struct MotionStatistics
+    {
+        // CSR: cell pairs of left cell i are in [offsets[i], offsets[i + 1])
+        vector<int> offsets;
+        vector<pair<int, int> > cells;
+
+        // Index  : grid_idx_left
+        // Value  : number of matches in left cell
+        vector<int> mNumberPointsInPerCellLeft;
+
+        int Get(int ll, int rr) const {
+            auto from = cells.begin() + offsets[ll];
+            auto to = cells.begin() + offsets[ll + 1];
+            auto it = std::lower_bound(from, to, pair<int, int>(rr, 0));
+            return (it != to && it->first == rr) ? it->second : 0;
         }
-        return max_inlier;
-    }
+    };
 
-    if (WithRotation && !WithScale)
-    {
-        SetScale(0);
-        for (int RotationType = 1; RotationType <= 8; RotationType++)
-        {
-            int num_inlier = run(RotationType);
+public:
 
-            if (num_inlier > max_inlier)
-            {
-                vbInliers = mvbInlierMask;
-                max_inlier = num_inlier;
-            }
+    // Get Inlier Mask
+    // Return number of inliers
+    int GetInlierMask(vector<bool> &vbInliers, bool WithScale = false, bool WithRotation = false);
+
+private:
+
+    // Convert OpenCV DMatch to Match (pair<int, int>)
+    void ConvertMatches(const vector<DMatch> &vDMatches, vector<pair<int, int> > &vMatches) {
+        vMatches.resize(mNumberMatches);
+        for (size_t i = 0; i < mNumberMatches; i++)
+        {
+            vMatches[i] = pair<int, int>(vDMatches[i].queryIdx, vDMatches[i].trainIdx);
         }
-        return max_inlier;
     }
 
-    if (!WithRotation && WithScale)
-    {
-        for (int Scale = 0; Scale < 5; Scale++)
-        {
-            SetScale(Scale);
+    // Assign Matches to Cell Pairs
+    void AssignMatchPairs(int GridType, int Scale, vector<pair<int, int> > &vMatchPairs, MotionStatistics &statistics) const;
 
-            int num_inlier = run(1);
+    // Verify Cell Pairs
+    void VerifyCellPairs(int RotationType, int Scale, const MotionStatistics &statistics, vector<int> &vCellPairs) const;
 
-            if (num_inlier > max_inlier)
-            {
-                vbInliers = mvbInlierMask;
-                max_inlier = num_inlier;
-            }
+    // Run one (scale, rotation) hypothesis
+    // all state is local, so different hypotheses can be run concurrently
+    int run(int Scale, int RotationType, vector<char> &vbInlierMask) const;
+};
 
-        }
-        return max_inlier;
+int gms_matcher::GetInlierMask(vector<bool> &vbInliers, bool WithScale, bool WithRotation) {
+
+    const int NumScales = WithScale ? 5 : 1;
+    const int NumRotations = WithRotation ? 8 : 1;
+    const int NumHypotheses = NumScales * NumRotations;
+
+    vector<int> vNumInliers(NumHypotheses, 0);
+    vector<vector<char> > vInlierMasks(NumHypotheses);
+
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int h = 0; h < NumHypotheses; h++)
+    {
+        int Scale = h / NumRotations;
+        int RotationType = h % NumRotations + 1;
+        vNumInliers[h] = run(Scale, RotationType, vInlierMasks[h]);
+    }
+
+    // the same hypothesis as in sequential search is taken: the first one with maximal number of inliers
+    int best = 0;
+    for (int h = 1; h < NumHypotheses; h++)
+    {
+        if (vNumInliers[h] > vNumInliers[best])
+            best = h;
     }
 
-    return max_inlier;
+    vbInliers.assign(vInlierMasks[best].begin(), vInlierMasks[best].end());
+    return vNumInliers[best];
 }
 
-void gms_matcher::AssignMatchPairs(int GridType) {
+void gms_matcher::AssignMatchPairs(int GridType, int Scale, vector<pair<int, int> > &vMatchPairs, MotionStatistics &statistics) const {
+
+    // (left cell, right cell) of every match that falls into both grids
+    vector<pair<int, int> > vCells;
+    vCells.reserve(mNumberMatches);
+
+    // cells of keypoints are precomputed per image, only pair-specific counting is left here
+    const vector<int> &vCellsLeft = mGrid1.left_cells[GridType - 1];
+    const vector<int> &vCellsRight = mGrid2.right_cells[Scale];
 
     for (size_t i = 0; i < mNumberMatches; i++)
     {
-        Point2f &lp = mvP1[mvMatches[i].first];
-        Point2f &rp = mvP2[mvMatches[i].second];
+        int lgidx = vMatchPairs[i].first = vCellsLeft[mvMatches[i].first];
+        int rgidx = vMatchPairs[i].second = vCellsRight[mvMatches[i].second];
 
-        int lgidx = mvMatchPairs[i].first = GetGridIndexLeft(lp, GridType);
-        int rgidx = -1;
+        if (lgidx < 0 || rgidx < 0)	continue;
 
-        if (GridType == 1)
-        {
-            rgidx = mvMatchPairs[i].second = GetGridIndexRight(rp);
-        }
-        else
-        {
-            rgidx = mvMatchPairs[i].second;
-        }
+        vCells.push_back(pair<int, int>(lgidx, rgidx));
+    }
 
-        if (lgidx < 0 || rgidx < 0)	continue;
+    std::sort(vCells.begin(), vCells.end());
+
+    statistics.offsets.assign(mGridNumberLeft + 1, 0);
+    statistics.mNumberPointsInPerCellLeft.assign(mGridNumberLeft, 0);
+    statistics.cells.clear();
 
-        mMotionStatistics.at<int>(lgidx, rgidx)++;
-        mNumberPointsInPerCellLeft[lgidx]++;
+    for (size_t i = 0; i < vCells.size();)
+    {
+        size_t j = i;
+        while (j < vCells.size() && vCells[j] == vCells[i])
+            j++;
+
+        int lgidx = vCells[i].first;
+        statistics.cells.push_back(pair<int, int>(vCells[i].second, (int) (j - i)));
+        statistics.offsets[lgidx + 1]++;
+        statistics.mNumberPointsInPerCellLeft[lgidx] += (int) (j - i);
+        i = j;
     }
 
+    for (int i = 0; i < mGridNumberLeft; i++)
+    {
+        statistics.offsets[i + 1] += statistics.offsets[i];
+    }
 }
 
-void gms_matcher::VerifyCellPairs(int RotationType) {
+void gms_matcher::VerifyCellPairs(int RotationType, int Scale, const MotionStatistics &statistics, vector<int> &vCellPairs) const {
 
     const int *CurrentRP = mRotationPatterns[RotationType - 1];
 
+    vCellPairs.assign(mGridNumberLeft, -1);
+
     for (int i = 0; i < mGridNumberLeft; i++)
     {
-        if (sum(mMotionStatistics.row(i))[0] == 0)
+        if (statistics.offsets[i] == statistics.offsets[i + 1])
         {
-            mCellPairs[i] = -1;
+            vCellPairs[i] = -1;
             continue;
         }
 
+        // right cells are sorted, so on ties the lowest right cell wins as in dense version
         int max_number = 0;
-        for (int j = 0; j < mGridNumberRight; j++)
+        for (int j = statistics.offsets[i]; j < statistics.offsets[i + 1]; j++)
         {
-            int *value = mMotionStatistics.ptr<int>(i);
-            if (value[j] > max_number)
+            if (statistics.cells[j].second > max_number)
             {
-                mCellPairs[i] = j;
-                max_number = value[j];
+                vCellPairs[i] = statistics.cells[j].first;
+                max_number = statistics.cells[j].second;
             }
         }
 
-        int idx_grid_rt = mCellPairs[i];
+        int idx_grid_rt = vCellPairs[i];
 
-        const int *NB9_lt = mGridNeighborLeft.ptr<int>(i);
-        const int *NB9_rt = mGridNeighborRight.ptr<int>(idx_grid_rt);
+        const int *NB9_lt = &mNeighbors.left[i * 9];
+        const int *NB9_rt = &mNeighbors.right[Scale][idx_grid_rt * 9];
 
         int score = 0;
         double thresh = 0;
@@ -411,47 +388,42 @@ void gms_matcher::VerifyCellPairs(int RotationType) {
             int rr = NB9_rt[CurrentRP[j] - 1];
             if (ll == -1 || rr == -1)	continue;
 
-            score += mMotionStatistics.at<int>(ll, rr);
-            thresh += mNumberPointsInPerCellLeft[ll];
+            score += statistics.Get(ll, rr);
+            thresh += statistics.mNumberPointsInPerCellLeft[ll];
             numpair++;
         }
 
         thresh = THRESH_FACTOR * sqrt(thresh / numpair);
 
         if (score < thresh)
-            mCellPairs[i] = -2;
+            vCellPairs[i] = -2;
     }
 }
 
-int gms_matcher::run(int RotationType) {
+int gms_matcher::run(int Scale, int RotationType, vector<char> &vbInlierMask) const {
 
-    mvbInlierMask.assign(mNumberMatches, false);
+    vbInlierMask.assign(mNumberMatches, false);
 
-    // Initialize Motion Statisctics
-    mMotionStatistics = Mat::zeros(mGridNumberLeft, mGridNumberRight, CV_32SC1);
-    mvMatchPairs.assign(mNumberMatches, pair<int, int>(0, 0));
+    MotionStatistics statistics;
+    vector<int> vCellPairs;
+    vector<pair<int, int> > vMatchPairs(mNumberMatches, pair<int, int>(0, 0));
 
     for (int GridType = 1; GridType <= 4; GridType++)
     {
-        // initialize
-        mMotionStatistics.setTo(0);
-        mCellPairs.assign(mGridNumberLeft, -1);
-        mNumberPointsInPerCellLeft.assign(mGridNumberLeft, 0);
-
-        AssignMatchPairs(GridType);
-        VerifyCellPairs(RotationType);
+        AssignMatchPairs(GridType, Scale, vMatchPairs, statistics);
+        VerifyCellPairs(RotationType, Scale, statistics, vCellPairs);
 
         // Mark inliers
         for (size_t i = 0; i < mNumberMatches; i++)
         {
-            if (mvMatchPairs[i].first >= 0) {
-                if (mCellPairs[mvMatchPairs[i].first] == mvMatchPairs[i].second)
+            if (vMatchPairs[i].first >= 0 && vMatchPairs[i].second >= 0) {
+                if (vCellPairs[vMatchPairs[i].first] == vMatchPairs[i].second)
                 {
-                    mvbInlierMask[i] = true;
+                    vbInlierMask[i] = true;
                 }
             }
         }
     }
-    int num_inlier = sum(mvbInlierMask)[0];
+    int num_inlier = (int) std::count(vbInlierMask.begin(), vbInlierMask.end(), (char) true);
     return num_inlier;
 }
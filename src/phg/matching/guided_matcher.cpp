@@ -0,0 +1,250 @@
+#include "guided_matcher.h"
+#include "distances.h"
+
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+
+
+namespace {
+
+    // dst отсортирован по расстоянию и хранит не больше k лучших, при равных расстояниях остается сопоставление найденное раньше
+    inline void insertMatch(std::vector<cv::DMatch> &dst, const cv::DMatch &match, int k)
+    {
+        if ((int) dst.size() == k && dst.back().distance <= match.distance) {
+            return;
+        }
+        if ((int) dst.size() == k) {
+            dst.pop_back();
+        }
+        dst.insert(std::upper_bound(dst.begin(), dst.end(), match), match);
+    }
+
+}
+
+phg::EpipolarGuidedMatcher::EpipolarGuidedMatcher(float cell_size)
+    : cell_size(cell_size)
+{
+    if (!(cell_size > 0.f)) {
+        throw std::runtime_error("EpipolarGuidedMatcher:: invalid cell size");
+    }
+}
+
+void phg::EpipolarGuidedMatcher::train(const cv::Mat &train_desc, const std::vector<cv::KeyPoint> &train_keypoints)
+{
+    if (train_desc.type() != CV_32FC1) {
+        throw std::runtime_error("EpipolarGuidedMatcher:: train : only CV_32FC1 descriptors supported");
+    }
+    if (train_desc.rows != (int) train_keypoints.size()) {
+        throw std::runtime_error("EpipolarGuidedMatcher:: train : descriptors and keypoints count mismatch");
+    }
+
+    train_points.resize(train_keypoints.size());
+    for (size_t i = 0; i < train_keypoints.size(); ++i) {
+        train_points[i] = train_keypoints[i].pt;
+    }
+    grid = std::make_shared<KeypointsGrid>(train_points, cell_size);
+
+    train_desc_ptr = &train_desc;
+}
+
+size_t phg::EpipolarGuidedMatcher::knnMatch(const cv::Mat &query_desc, const std::vector<cv::KeyPoint> &query_keypoints,
+                                            const cv::Matx33d &F, double threshold_px,
+                                            std::vector<std::vector<cv::DMatch>> &matches, int k) const
+{
+    if (!train_desc_ptr) {
+        throw std::runtime_error("EpipolarGuidedMatcher:: knnMatch : matcher is not trained");
+    }
+    if (query_desc.type() != CV_32FC1 || query_desc.cols != train_desc_ptr->cols) {
+        throw std::runtime_error("EpipolarGuidedMatcher:: knnMatch : query descriptors type mismatch");
+    }
+    if (query_desc.rows != (int) query_keypoints.size()) {
+        throw std::runtime_error("EpipolarGuidedMatcher:: knnMatch : descriptors and keypoints count mismatch");
+    }
+    if (k < 1) {
+        throw std::runtime_error("EpipolarGuidedMatcher:: knnMatch : invalid k");
+    }
+
+    const cv::Mat &train_desc = *train_desc_ptr;
+    const KeypointsGrid &g = *grid;
+    const int ndesc = query_desc.rows;
+    const int ndim = query_desc.cols;
+
+    const float x_from = g.origin().x;
+    const float y_from = g.origin().y;
+    const float x_to = x_from + g.ncols() * g.cellSize();
+    const float y_to = y_from + g.nrows() * g.cellSize();
+
+    matches.resize(ndesc);
+
+    long long ncompared = 0;
+
+    #pragma omp parallel for schedule(dynamic, 16) reduction(+:ncompared)
+    for (int qi = 0; qi < ndesc; ++qi) {
+        std::vector<cv::DMatch> &dst = matches[qi];
+        dst.clear();
+
+        const cv::Point2f &pt = query_keypoints[qi].pt;
+        const cv::Vec3d l = F * cv::Vec3d(pt.x, pt.y, 1.0);
+        const double norm = std::sqrt(l[0] * l[0] + l[1] * l[1]);
+        if (norm == 0.0) {
+            continue;
+        }
+        // полоса |a x + b y + c| <= threshold * |(a, b)|
+        const double band = threshold_px * norm;
+
+        const float *q = query_desc.ptr<float>(qi);
+
+        auto visitCell = [&](int c, int r) {
+            for (const int *id = g.cellBegin(c, r); id != g.cellEnd(c, r); ++id) {
+                const cv::Point2f &tp = train_points[*id];
+                if (std::abs(l[0] * tp.x + l[1] * tp.y + l[2]) > band) {
+                    continue;
+                }
+
+                cv::DMatch match(qi, *id, std::sqrt(l2sqr(q, train_desc.ptr<float>(*id), ndim)));
+                ++ncompared;
+                insertMatch(dst, match, k);
+            }
+        };
+
+        // идем вдоль линии по той оси, вдоль которой она более пологая: на каждый столбец (строку) сетки приходится непрерывный отрезок ячеек
+        if (std::abs(l[1]) >= std::abs(l[0])) {
+            const double half_height = band / std::abs(l[1]);
+            for (int c = 0; c < g.ncols(); ++c) {
+                double x0 = x_from + c * g.cellSize();
+                double x1 = x0 + g.cellSize();
+                double y0 = -(l[0] * x0 + l[2]) / l[1];
+                double y1 = -(l[0] * x1 + l[2]) / l[1];
+                double ymin = std::min(y0, y1) - half_height;
+                double ymax = std::max(y0, y1) + half_height;
+                if (ymax < y_from || ymin > y_to) {
+                    continue;
+                }
+                for (int r = g.row((float) ymin); r <= g.row((float) ymax); ++r) {
+                    visitCell(c, r);
+                }
+            }
+        } else {
+            const double half_width = band / std::abs(l[0]);
+            for (int r = 0; r < g.nrows(); ++r) {
+                double y0 = y_from + r * g.cellSize();
+                double y1 = y0 + g.cellSize();
+                double x0 = -(l[1] * y0 + l[2]) / l[0];
+                double x1 = -(l[1] * y1 + l[2]) / l[0];
+                double xmin = std::min(x0, x1) - half_width;
+                double xmax = std::max(x0, x1) + half_width;
+                if (xmax < x_from || xmin > x_to) {
+                    continue;
+                }
+                for (int c = g.col((float) xmin); c <= g.col((float) xmax); ++c) {
+                    visitCell(c, r);
+                }
+            }
+        }
+    }
+
+    return (size_t) ncompared;
+}
+
+phg::HomographyGuidedMatcher::HomographyGuidedMatcher(float cell_size)
+    : cell_size(cell_size)
+{
+    if (!(cell_size > 0.f)) {
+        throw std::runtime_error("HomographyGuidedMatcher:: invalid cell size");
+    }
+}
+
+void phg::HomographyGuidedMatcher::train(const cv::Mat &train_desc, const std::vector<cv::KeyPoint> &train_keypoints)
+{
+    if (train_desc.type() != CV_32FC1) {
+        throw std::runtime_error("HomographyGuidedMatcher:: train : only CV_32FC1 descriptors supported");
+    }
+    if (train_desc.rows != (int) train_keypoints.size()) {
+        throw std::runtime_error("HomographyGuidedMatcher:: train : descriptors and keypoints count mismatch");
+    }
+
+    train_points.resize(train_keypoints.size());
+    for (size_t i = 0; i < train_keypoints.size(); ++i) {
+        train_points[i] = train_keypoints[i].pt;
+    }
+    grid = std::make_shared<KeypointsGrid>(train_points, cell_size);
+
+    train_desc_ptr = &train_desc;
+}
+
+size_t phg::HomographyGuidedMatcher::knnMatch(const cv::Mat &query_desc, const std::vector<cv::KeyPoint> &query_keypoints,
+                                              const cv::Matx33d &H, double radius_px,
+                                              std::vector<std::vector<cv::DMatch>> &matches, int k) const
+{
+    if (!train_desc_ptr) {
+        throw std::runtime_error("HomographyGuidedMatcher:: knnMatch : matcher is not trained");
+    }
+    if (query_desc.type() != CV_32FC1 || query_desc.cols != train_desc_ptr->cols) {
+        throw std::runtime_error("HomographyGuidedMatcher:: knnMatch : query descriptors type mismatch");
+    }
+    if (query_desc.rows != (int) query_keypoints.size()) {
+        throw std::runtime_error("HomographyGuidedMatcher:: knnMatch : descriptors and keypoints count mismatch");
+    }
+    if (k < 1 || !(radius_px > 0.0)) {
+        throw std::runtime_error("HomographyGuidedMatcher:: knnMatch : invalid parameters");
+    }
+
+    const cv::Mat &train_desc = *train_desc_ptr;
+    const KeypointsGrid &g = *grid;
+    const int ndesc = query_desc.rows;
+    const int ndim = query_desc.cols;
+
+    const float x_from = g.origin().x;
+    const float y_from = g.origin().y;
+    const float x_to = x_from + g.ncols() * g.cellSize();
+    const float y_to = y_from + g.nrows() * g.cellSize();
+    const double radius2 = radius_px * radius_px;
+
+    matches.resize(ndesc);
+
+    long long ncompared = 0;
+
+    #pragma omp parallel for schedule(dynamic, 16) reduction(+:ncompared)
+    for (int qi = 0; qi < ndesc; ++qi) {
+        std::vector<cv::DMatch> &dst = matches[qi];
+        dst.clear();
+
+        const cv::Point2f &pt = query_keypoints[qi].pt;
+        const cv::Vec3d p = H * cv::Vec3d(pt.x, pt.y, 1.0);
+        // точка уходит на бесконечность или за камеру - предсказания нет
+        if (!(p[2] > 0.0)) {
+            continue;
+        }
+        const double x = p[0] / p[2];
+        const double y = p[1] / p[2];
+        if (x + radius_px < x_from || x - radius_px > x_to || y + radius_px < y_from || y - radius_px > y_to) {
+            continue;
+        }
+
+        const float *q = query_desc.ptr<float>(qi);
+
+        const int c0 = g.col((float) (x - radius_px));
+        const int c1 = g.col((float) (x + radius_px));
+        const int r0 = g.row((float) (y - radius_px));
+        const int r1 = g.row((float) (y + radius_px));
+        for (int r = r0; r <= r1; ++r) {
+            for (int c = c0; c <= c1; ++c) {
+                for (const int *id = g.cellBegin(c, r); id != g.cellEnd(c, r); ++id) {
+                    const cv::Point2f &tp = train_points[*id];
+                    const double dx = tp.x - x;
+                    const double dy = tp.y - y;
+                    if (dx * dx + dy * dy > radius2) {
+                        continue;
+                    }
+
+                    cv::DMatch match(qi, *id, std::sqrt(l2sqr(q, train_desc.ptr<float>(*id), ndim)));
+                    ++ncompared;
+                    insertMatch(dst, match, k);
+                }
+            }
+        }
+    }
+
+    return (size_t) ncompared;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <memory>
+#include <opencv2/core.hpp>
+
+#include "keypoints_grid.h"
+
+namespace phg {
+
+    // повторное (более плотное) сопоставление пары после того как оценена фундаментальная матрица:
+    // для каждой query точки дескрипторы сравниваются только с train точками в полосе вокруг ее эпиполярной линии,
+    // полосу ищем по ячейкам сетки над train точками, поэтому перебирается лишь малая доля train дескрипторов
+    struct EpipolarGuidedMatcher {
+
+        // cell_size - размер ячейки сетки в пикселях
+        EpipolarGuidedMatcher(float cell_size = 32.f);
+
+        void train(const cv::Mat &train_desc, const std::vector<cv::KeyPoint> &train_keypoints);
+
+        // F в той же конвенции что и phg::findFMatrix(points_query, points_train): x_train^T * F * x_query = 0
+        // у query точки может найтись меньше k кандидатов (в т.ч. ни одного)
+        // возвращает сколько пар дескрипторов было сравнено
+        size_t knnMatch(const cv::Mat &query_desc, const std::vector<cv::KeyPoint> &query_keypoints,
+                        const cv::Matx33d &F, double threshold_px,
+                        std::vector<std::vector<cv::DMatch>> &matches, int k) const;
+
+    private:
+
+        float cell_size;
+
+        const cv::Mat *train_desc_ptr = nullptr;
+        std::vector<cv::Point2f> train_points;
+        std::shared_ptr<KeypointsGrid> grid;
+    };
+
+    // то же для пары связанной гомографией (панорамы, ортофото): гомография оценивается грубо (например по уменьшенным картинкам),
+    // и каждая query точка сравнивается только с train точками в радиусе radius_px вокруг своего предсказанного положения H * x_query
+    struct HomographyGuidedMatcher {
+
+        // cell_size - размер ячейки сетки в пикселях
+        HomographyGuidedMatcher(float cell_size = 32.f);
+
+        void train(const cv::Mat &train_desc, const std::vector<cv::KeyPoint> &train_keypoints);
+
+        // H в той же конвенции что и phg::findHomography(points_query, points_train): x_train ~ H * x_query
+        // у query точки может найтись меньше k кандидатов (в т.ч. ни одного)
+        // возвращает сколько пар дескрипторов было сравнено
+        size_t knnMatch(const cv::Mat &query_desc, const std::vector<cv::KeyPoint> &query_keypoints,
+                        const cv::Matx33d &H, double radius_px,
+                        std::vector<std::vector<cv::DMatch>> &matches, int k) const;
+
+    private:
+
+        float cell_size;
+
+        const cv::Mat *train_desc_ptr = nullptr;
+        std::vector<cv::Point2f> train_points;
+        std::shared_ptr<KeypointsGrid> grid;
+    };
+
+}
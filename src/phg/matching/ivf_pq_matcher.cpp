@@ -0,0 +1,259 @@
+#include "ivf_pq_matcher.h"
+#include "kmeans.h"
+#include "distances.h"
+
+#include <queue>
+#include <iostream>
+#include <libutils/rasserts.h>
+
+
+namespace {
+
+    const int max_training_samples = 65536; // словари учим на подвыборке - на десятках миллионов дескрипторов k-means слишком дорог
+    const int min_samples_per_list = 16;
+    const int max_codewords = 256;          // чтобы код подпространства помещался в один байт
+
+    int nearestCentroid(const float *x, const cv::Mat &centroids)
+    {
+        int best = 0;
+        float best_dist = std::numeric_limits<float>::max();
+        for (int ci = 0; ci < centroids.rows; ++ci) {
+            float dist = phg::l2sqr(x, centroids.ptr<float>(ci), centroids.cols);
+            if (dist < best_dist) {
+                best_dist = dist;
+                best = ci;
+            }
+        }
+        return best;
+    }
+
+}
+
+phg::IVFPQMatcher::IVFPQMatcher(int n_lists, int n_subspaces, int n_probe, int n_rerank)
+    : n_lists(n_lists)
+    , n_subspaces(n_subspaces)
+    , n_probe(n_probe)
+    , n_rerank(n_rerank)
+    , ndim(0)
+    , subspace_dim(0)
+    , n_codewords(0)
+{
+    if (n_lists < 1 || n_subspaces < 1 || n_probe < 1 || n_rerank < 0) {
+        throw std::runtime_error("IVFPQMatcher:: invalid parameters");
+    }
+}
+
+void phg::IVFPQMatcher::train(const cv::Mat &train_desc)
+{
+    if (train_desc.rows < 2) {
+        throw std::runtime_error("IVFPQMatcher:: train : needed at least 2 train descriptors");
+    }
+    if (train_desc.type() != CV_32FC1) {
+        throw std::runtime_error("IVFPQMatcher:: train : only CV_32FC1 descriptors supported");
+    }
+    if (train_desc.cols % n_subspaces != 0) {
+        throw std::runtime_error("IVFPQMatcher:: train : descriptor size should be divisible by number of subspaces");
+    }
+
+    const int n_train_desc = train_desc.rows;
+    ndim = train_desc.cols;
+    subspace_dim = ndim / n_subspaces;
+
+    // равномерная подвыборка для обучения словарей
+    const int n_samples = std::min(n_train_desc, max_training_samples);
+    cv::Mat samples(n_samples, ndim, CV_32FC1);
+    for (int i = 0; i < n_samples; ++i) {
+        train_desc.row((int) ((int64_t) i * n_train_desc / n_samples)).copyTo(samples.row(i));
+    }
+
+    // грубый квантователь
+    const int n_lists_used = std::max(1, std::min(n_lists, n_samples / min_samples_per_list));
+    coarse_centroids = trainKMeans(samples, n_lists_used);
+
+    // словари product quantization учатся на остатках относительно центра своего списка
+    cv::Mat residuals(n_samples, ndim, CV_32FC1);
+    #pragma omp parallel for
+    for (int i = 0; i < n_samples; ++i) {
+        const float *x = samples.ptr<float>(i);
+        const float *c = coarse_centroids.ptr<float>(nearestCentroid(x, coarse_centroids));
+        float *r = residuals.ptr<float>(i);
+        for (int d = 0; d < ndim; ++d) {
+            r[d] = x[d] - c[d];
+        }
+    }
+
+    n_codewords = std::min(max_codewords, n_samples);
+    pq_codebooks.resize(n_subspaces);
+    for (int m = 0; m < n_subspaces; ++m) {
+        cv::Mat subspace = residuals.colRange(m * subspace_dim, (m + 1) * subspace_dim).clone();
+        pq_codebooks[m] = trainKMeans(subspace, n_codewords);
+    }
+
+    // кодируем все train дескрипторы
+    std::vector<int> list_of_desc(n_train_desc);
+    std::vector<unsigned char> codes((size_t) n_train_desc * n_subspaces);
+    #pragma omp parallel
+    {
+        std::vector<float> r(ndim);
+        #pragma omp for
+        for (int i = 0; i < n_train_desc; ++i) {
+            const float *x = train_desc.ptr<float>(i);
+            int list = nearestCentroid(x, coarse_centroids);
+            list_of_desc[i] = list;
+
+            const float *c = coarse_centroids.ptr<float>(list);
+            for (int d = 0; d < ndim; ++d) {
+                r[d] = x[d] - c[d];
+            }
+            for (int m = 0; m < n_subspaces; ++m) {
+                const cv::Mat &codebook = pq_codebooks[m];
+                const float *rm = r.data() + m * subspace_dim;
+                int best = 0;
+                float best_dist = std::numeric_limits<float>::max();
+                for (int j = 0; j < codebook.rows; ++j) {
+                    float dist = l2sqr(rm, codebook.ptr<float>(j), subspace_dim);
+                    if (dist < best_dist) {
+                        best_dist = dist;
+                        best = j;
+                    }
+                }
+                codes[(size_t) i * n_subspaces + m] = (unsigned char) best;
+            }
+        }
+    }
+
+    // раскладываем коды по inverted lists (CSR)
+    list_offsets.assign(n_lists_used + 1, 0);
+    for (int i = 0; i < n_train_desc; ++i) {
+        ++list_offsets[list_of_desc[i] + 1];
+    }
+    for (int l = 0; l < n_lists_used; ++l) {
+        list_offsets[l + 1] += list_offsets[l];
+    }
+
+    list_ids.resize(n_train_desc);
+    list_codes.resize((size_t) n_train_desc * n_subspaces);
+    std::vector<unsigned int> fill(list_offsets.begin(), list_offsets.end() - 1);
+    for (int i = 0; i < n_train_desc; ++i) {
+        unsigned int pos = fill[list_of_desc[i]]++;
+        list_ids[pos] = i;
+        std::copy(codes.begin() + (size_t) i * n_subspaces, codes.begin() + (size_t) (i + 1) * n_subspaces,
+                  list_codes.begin() + (size_t) pos * n_subspaces);
+    }
+
+    // без перепроверки исходные дескрипторы после обучения не нужны
+    train_desc_ptr = n_rerank > 0 ? &train_desc : nullptr;
+}
+
+void phg::IVFPQMatcher::knnMatch(const cv::Mat &query_desc,
+                                 std::vector<std::vector<cv::DMatch>> &matches,
+                                 int k) const
+{
+    if (list_offsets.empty()) {
+        throw std::runtime_error("IVFPQMatcher:: knnMatch : matcher is not trained");
+    }
+    if (query_desc.type() != CV_32FC1 || query_desc.cols != ndim) {
+        throw std::runtime_error("IVFPQMatcher:: knnMatch : query descriptors type mismatch");
+    }
+    if (k < 1 || k > (int) list_ids.size()) {
+        throw std::runtime_error("IVFPQMatcher:: knnMatch : invalid k");
+    }
+
+    const int ndesc = query_desc.rows;
+    const int n_lists_used = coarse_centroids.rows;
+    const int n_shortlist = std::max(k, n_rerank);
+
+    matches.resize(ndesc);
+
+    #pragma omp parallel
+    {
+        std::vector<std::pair<float, int>> lists_order(n_lists_used);
+        std::vector<float> r(ndim);
+        std::vector<float> distance_table((size_t) n_subspaces * n_codewords);
+        std::vector<std::pair<float, unsigned int>> shortlist;
+
+        #pragma omp for schedule(dynamic, 16)
+        for (int qi = 0; qi < ndesc; ++qi) {
+            const float *q = query_desc.ptr<float>(qi);
+
+            for (int l = 0; l < n_lists_used; ++l) {
+                lists_order[l] = std::make_pair(l2sqr(q, coarse_centroids.ptr<float>(l), ndim), l);
+            }
+            std::sort(lists_order.begin(), lists_order.end());
+
+            // max-heap из n_shortlist лучших кандидатов по приближенному расстоянию
+            std::priority_queue<std::pair<float, unsigned int>> heap;
+
+            // просматриваем n_probe ближайших списков, но не меньше чем нужно чтобы набрать k кандидатов
+            for (int p = 0; p < n_lists_used && (p < n_probe || (int) heap.size() < k); ++p) {
+                const int list = lists_order[p].second;
+                const unsigned int from = list_offsets[list];
+                const unsigned int to = list_offsets[list + 1];
+                if (from == to) {
+                    continue;
+                }
+
+                // asymmetric distance computation: запрос не квантуется, расстояния до всех кодовых слов считаются один раз на список
+                const float *c = coarse_centroids.ptr<float>(list);
+                for (int d = 0; d < ndim; ++d) {
+                    r[d] = q[d] - c[d];
+                }
+                for (int m = 0; m < n_subspaces; ++m) {
+                    const cv::Mat &codebook = pq_codebooks[m];
+                    for (int j = 0; j < codebook.rows; ++j) {
+                        distance_table[m * n_codewords + j] = l2sqr(r.data() + m * subspace_dim, codebook.ptr<float>(j), subspace_dim);
+                    }
+                }
+
+                for (unsigned int pos = from; pos < to; ++pos) {
+                    const unsigned char *code = list_codes.data() + (size_t) pos * n_subspaces;
+                    float dist2 = 0.f;
+                    for (int m = 0; m < n_subspaces; ++m) {
+                        dist2 += distance_table[m * n_codewords + code[m]];
+                    }
+                    if ((int) heap.size() < n_shortlist) {
+                        heap.push(std::make_pair(dist2, list_ids[pos]));
+                    } else if (dist2 < heap.top().first) {
+                        heap.pop();
+                        heap.push(std::make_pair(dist2, list_ids[pos]));
+                    }
+                }
+            }
+
+            shortlist.clear();
+            while (!heap.empty()) {
+                shortlist.push_back(heap.top());
+                heap.pop();
+            }
+
+            // точная перепроверка shortlist-а
+            if (n_rerank > 0) {
+                for (auto &candidate : shortlist) {
+                    candidate.first = l2sqr(q, train_desc_ptr->ptr<float>(candidate.second), ndim);
+                }
+            }
+            std::sort(shortlist.begin(), shortlist.end());
+
+            std::vector<cv::DMatch> &dst = matches[qi];
+            dst.clear();
+            for (int ki = 0; ki < k && ki < (int) shortlist.size(); ++ki) {
+                dst.emplace_back(qi, (int) shortlist[ki].second, std::sqrt(shortlist[ki].first));
+            }
+        }
+    }
+}
+
+size_t phg::IVFPQMatcher::memoryUsage() const
+{
+    size_t bytes = list_offsets.size() * sizeof(unsigned int)
+                 + list_ids.size() * sizeof(unsigned int)
+                 + list_codes.size() * sizeof(unsigned char)
+                 + coarse_centroids.total() * sizeof(float);
+    for (const cv::Mat &codebook : pq_codebooks) {
+        bytes += codebook.total() * sizeof(float);
+    }
+    if (train_desc_ptr) {
+        bytes += train_desc_ptr->total() * train_desc_ptr->elemSize();
+    }
+    return bytes;
+}
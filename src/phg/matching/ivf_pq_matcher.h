@@ -0,0 +1,48 @@
+#pragma once
+
+#include "descriptor_matcher.h"
+
+namespace phg {
+
+    // Inverted file + product quantization, см. Jegou, Douze, Schmid: "Product quantization for nearest neighbor search" (2011)
+    // каждый train дескриптор хранится как номер списка (грубый k-means) + n_subspaces байт PQ-кода остатка,
+    // т.е. 16 байт вместо 512 байт у float SIFT - это позволяет держать в памяти десятки миллионов дескрипторов
+    // NB: точная перепроверка (n_rerank > 0) читает исходные float дескрипторы - матчер держит указатель на переданную в train матрицу,
+    // так что она должна оставаться в памяти и учитывается в memoryUsage, только сжатый индекс - n_rerank = 0
+    struct IVFPQMatcher : DescriptorMatcher {
+
+        // n_lists      - число кластеров грубого квантователя (inverted lists)
+        // n_subspaces  - на сколько подпространств режется дескриптор (размерность должна на него делиться), у каждого свой словарь из 256 центров
+        // n_probe      - сколько ближайших inverted lists просматривать для каждого запроса
+        // n_rerank     - длина shortlist-а по приближенным (asymmetric) расстояниям, который затем перепроверяется точным L2 (0 - без перепроверки)
+        IVFPQMatcher(int n_lists = 1024, int n_subspaces = 16, int n_probe = 16, int n_rerank = 32);
+
+        void train(const cv::Mat &train_desc) override;
+
+        void knnMatch(const cv::Mat &query_desc, std::vector<std::vector<cv::DMatch>> &matches, int k) const override;
+
+        // сколько байт держит матчер: сжатый индекс (коды + индексы + словари) и, если включена перепроверка, исходные дескрипторы
+        size_t memoryUsage() const override;
+
+    private:
+
+        int n_lists;
+        int n_subspaces;
+        int n_probe;
+        int n_rerank;
+
+        int ndim;
+        int subspace_dim;
+        int n_codewords;
+
+        cv::Mat coarse_centroids;                  // n_lists x ndim
+        std::vector<cv::Mat> pq_codebooks;         // n_subspaces x (n_codewords x subspace_dim)
+
+        std::vector<unsigned int> list_offsets;    // CSR: дескрипторы списка i лежат в [list_offsets[i], list_offsets[i + 1])
+        std::vector<unsigned int> list_ids;        // номер train дескриптора
+        std::vector<unsigned char> list_codes;     // по n_subspaces байт на дескриптор
+
+        const cv::Mat *train_desc_ptr = nullptr;   // нужен только для точной перепроверки shortlist-а (n_rerank > 0)
+    };
+
+}
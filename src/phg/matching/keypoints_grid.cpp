@@ -0,0 +1,61 @@
+#include "keypoints_grid.h"
+
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+
+
+phg::KeypointsGrid::KeypointsGrid(const std::vector<cv::Point2f> &points, float cell_size)
+    : cell_size(cell_size)
+    , origin_(0.f, 0.f)
+    , ncols_(1)
+    , nrows_(1)
+{
+    if (!(cell_size > 0.f)) {
+        throw std::runtime_error("KeypointsGrid:: invalid cell size");
+    }
+
+    const int npoints = (int) points.size();
+
+    if (npoints > 0) {
+        float xmin = points[0].x, xmax = points[0].x;
+        float ymin = points[0].y, ymax = points[0].y;
+        for (const cv::Point2f &pt : points) {
+            xmin = std::min(xmin, pt.x);
+            xmax = std::max(xmax, pt.x);
+            ymin = std::min(ymin, pt.y);
+            ymax = std::max(ymax, pt.y);
+        }
+        origin_ = cv::Point2f(xmin, ymin);
+        ncols_ = (int) ((xmax - xmin) / cell_size) + 1;
+        nrows_ = (int) ((ymax - ymin) / cell_size) + 1;
+    }
+
+    std::vector<int> cell_of_point(npoints);
+    cell_offsets.assign(ncols_ * nrows_ + 1, 0);
+    for (int i = 0; i < npoints; ++i) {
+        cell_of_point[i] = row(points[i].y) * ncols_ + col(points[i].x);
+        ++cell_offsets[cell_of_point[i] + 1];
+    }
+    for (int c = 0; c < ncols_ * nrows_; ++c) {
+        cell_offsets[c + 1] += cell_offsets[c];
+    }
+
+    ids.resize(npoints);
+    std::vector<int> fill(cell_offsets.begin(), cell_offsets.end() - 1);
+    for (int i = 0; i < npoints; ++i) {
+        ids[fill[cell_of_point[i]]++] = i;
+    }
+}
+
+int phg::KeypointsGrid::col(float x) const
+{
+    float c = std::floor((x - origin_.x) / cell_size);
+    return (int) std::max(0.f, std::min(c, (float) (ncols_ - 1)));
+}
+
+int phg::KeypointsGrid::row(float y) const
+{
+    float r = std::floor((y - origin_.y) / cell_size);
+    return (int) std::max(0.f, std::min(r, (float) (nrows_ - 1)));
+}
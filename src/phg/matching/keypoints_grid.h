@@ -0,0 +1,39 @@
+#pragma once
+
+#include <vector>
+#include <opencv2/core.hpp>
+
+namespace phg {
+
+    // равномерная сетка над точками картинки: точки каждой ячейки лежат подряд (CSR), чтобы быстро перебирать точки в заданной области
+    class KeypointsGrid {
+    public:
+        KeypointsGrid(const std::vector<cv::Point2f> &points, float cell_size);
+
+        int ncols() const { return ncols_; }
+        int nrows() const { return nrows_; }
+        float cellSize() const { return cell_size; }
+
+        // координаты левого верхнего угла ячейки (0, 0)
+        cv::Point2f origin() const { return origin_; }
+
+        // номер столбца/строки ячейки содержащей координату (с обрезкой по границам сетки)
+        int col(float x) const;
+        int row(float y) const;
+
+        // номера точек попавших в ячейку: [cellBegin(c, r), cellEnd(c, r))
+        const int *cellBegin(int c, int r) const { return ids.data() + cell_offsets[r * ncols_ + c]; }
+        const int *cellEnd(int c, int r) const { return ids.data() + cell_offsets[r * ncols_ + c + 1]; }
+
+    private:
+
+        float cell_size;
+        cv::Point2f origin_;
+        int ncols_;
+        int nrows_;
+
+        std::vector<int> cell_offsets; // nrows * ncols + 1
+        std::vector<int> ids;
+    };
+
+}
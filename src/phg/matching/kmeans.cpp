@@ -0,0 +1,19 @@
+#include "kmeans.h"
+
+
+cv::Mat phg::trainKMeans(const cv::Mat &data, int k, int iterations, cv::Mat *labels, uint64_t seed)
+{
+    if (data.type() != CV_32FC1 || data.rows < k) {
+        throw std::runtime_error("trainKMeans : invalid data");
+    }
+
+    cv::RNG rng_backup = cv::theRNG();
+    cv::theRNG().state = seed;
+
+    cv::Mat local_labels, centers;
+    cv::kmeans(data, k, labels ? *labels : local_labels, cv::TermCriteria(cv::TermCriteria::COUNT + cv::TermCriteria::EPS, iterations, 1e-4),
+               1, cv::KMEANS_PP_CENTERS, centers);
+
+    cv::theRNG() = rng_backup;
+    return centers;
+}
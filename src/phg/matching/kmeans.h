@@ -0,0 +1,12 @@
+#pragma once
+
+#include <cstdint>
+#include <opencv2/core.hpp>
+
+namespace phg {
+
+    // cv::kmeans (k-means++ инициализация) с фиксированным сидом и без побочного эффекта на глобальный генератор случайных чисел
+    // data - CV_32FC1 по строке на точку, возвращает k x data.cols центров, labels (если передан) - номер центра для каждой точки
+    cv::Mat trainKMeans(const cv::Mat &data, int k, int iterations = 16, cv::Mat *labels = nullptr, uint64_t seed = 125125);
+
+}
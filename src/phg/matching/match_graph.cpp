@@ -0,0 +1,318 @@
+#include "match_graph.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <algorithm>
+#include <stdexcept>
+#include <phg/utils/mapped_file.h>
+
+
+namespace {
+
+    const char match_graph_magic[8] = {'P', 'H', 'G', 'M', 'A', 'T', 'G', '1'};
+
+    struct FileHeader {
+        char magic[8];
+        int32_t nimages;
+        int32_t reserved;
+        uint64_t npairs;
+        uint64_t nmatches;
+    };
+
+    // секции файла выравниваются на 8 байт, чтобы массивы в отображенной памяти можно было читать напрямую
+    size_t align8(size_t offset)
+    {
+        return (offset + 7) / 8 * 8;
+    }
+
+    template <typename T>
+    void writeSection(std::ofstream &out, size_t &offset, const T *data, size_t n)
+    {
+        const char zeros[8] = {0};
+        size_t aligned = align8(offset);
+        out.write(zeros, aligned - offset);
+        out.write((const char *) data, n * sizeof(T));
+        offset = aligned + n * sizeof(T);
+    }
+
+    template <typename T>
+    const T *mapSection(const char *data, size_t file_size, size_t &offset, size_t n)
+    {
+        size_t aligned = align8(offset);
+        // n приходит из файла - проверяем без переполнения
+        if (aligned > file_size || n > (file_size - aligned) / sizeof(T)) {
+            return nullptr;
+        }
+        offset = aligned + n * sizeof(T);
+        return (const T *) (data + aligned);
+    }
+
+}
+
+phg::MatchGraph::MatchGraph(int nimages)
+    : nimages_(nimages)
+    , finalized_(false)
+    , npairs_(0)
+    , nmatches_(0)
+    , image_offsets_ptr(nullptr)
+    , pairs_ptr(nullptr)
+    , query_ids_ptr(nullptr)
+    , train_ids_ptr(nullptr)
+    , distances_ptr(nullptr)
+{
+    if (nimages < 0) {
+        throw std::runtime_error("MatchGraph:: invalid number of images");
+    }
+}
+
+phg::MatchGraph::~MatchGraph()
+{}
+
+void phg::MatchGraph::addMatches(int img_query, int img_train, const std::vector<cv::DMatch> &matches)
+{
+    if (finalized_) {
+        throw std::runtime_error("MatchGraph:: addMatches : graph is already finalized");
+    }
+    if (img_query < 0 || img_query >= nimages_ || img_train < 0 || img_train >= nimages_) {
+        throw std::runtime_error("MatchGraph:: addMatches : invalid image");
+    }
+
+    // упаковываем вне критической секции, под мьютексом - только резервирование места и копирование
+    const size_t n = matches.size();
+    std::vector<uint32_t> q(n), t(n);
+    std::vector<uint16_t> d(n);
+    for (size_t i = 0; i < n; ++i) {
+        q[i] = (uint32_t) matches[i].queryIdx;
+        t[i] = (uint32_t) matches[i].trainIdx;
+        d[i] = cv::float16_t(matches[i].distance).bits();
+    }
+
+    Lock lock(append_mutex);
+
+    PendingPair pair;
+    pair.img_query = img_query;
+    pair.img_train = img_train;
+    pair.offset = query_ids.size();
+    pair.nmatches = n;
+    pending_pairs.push_back(pair);
+
+    query_ids.insert(query_ids.end(), q.begin(), q.end());
+    train_ids.insert(train_ids.end(), t.begin(), t.end());
+    distances.insert(distances.end(), d.begin(), d.end());
+}
+
+void phg::MatchGraph::finalize()
+{
+    if (finalized_) {
+        throw std::runtime_error("MatchGraph:: finalize : graph is already finalized");
+    }
+
+    std::sort(pending_pairs.begin(), pending_pairs.end(), [](const PendingPair &a, const PendingPair &b) {
+        return a.img_query < b.img_query || (a.img_query == b.img_query && a.img_train < b.img_train);
+    });
+    for (size_t i = 1; i < pending_pairs.size(); ++i) {
+        if (pending_pairs[i].img_query == pending_pairs[i - 1].img_query && pending_pairs[i].img_train == pending_pairs[i - 1].img_train) {
+            throw std::runtime_error("MatchGraph:: finalize : pair added twice");
+        }
+    }
+
+    std::vector<uint32_t> sorted_query_ids(query_ids.size());
+    std::vector<uint32_t> sorted_train_ids(train_ids.size());
+    std::vector<uint16_t> sorted_distances(distances.size());
+
+    image_offsets.assign(nimages_ + 1, 0);
+    pairs.resize(pending_pairs.size());
+    uint64_t offset = 0;
+    for (size_t i = 0; i < pending_pairs.size(); ++i) {
+        const PendingPair &pending = pending_pairs[i];
+        ++image_offsets[pending.img_query + 1];
+
+        pairs[i].img_train = (uint32_t) pending.img_train;
+        pairs[i].nmatches = (uint32_t) pending.nmatches;
+        pairs[i].offset = offset;
+
+        std::copy(query_ids.begin() + pending.offset, query_ids.begin() + pending.offset + pending.nmatches, sorted_query_ids.begin() + offset);
+        std::copy(train_ids.begin() + pending.offset, train_ids.begin() + pending.offset + pending.nmatches, sorted_train_ids.begin() + offset);
+        std::copy(distances.begin() + pending.offset, distances.begin() + pending.offset + pending.nmatches, sorted_distances.begin() + offset);
+        offset += pending.nmatches;
+    }
+    for (int i = 0; i < nimages_; ++i) {
+        image_offsets[i + 1] += image_offsets[i];
+    }
+
+    query_ids.swap(sorted_query_ids);
+    train_ids.swap(sorted_train_ids);
+    distances.swap(sorted_distances);
+    std::vector<PendingPair>().swap(pending_pairs);
+
+    npairs_ = pairs.size();
+    nmatches_ = query_ids.size();
+    setPointers();
+    finalized_ = true;
+}
+
+void phg::MatchGraph::setPointers()
+{
+    image_offsets_ptr = image_offsets.data();
+    pairs_ptr = pairs.data();
+    query_ids_ptr = query_ids.data();
+    train_ids_ptr = train_ids.data();
+    distances_ptr = distances.data();
+}
+
+size_t phg::MatchGraph::npairs() const
+{
+    return finalized_ ? npairs_ : pending_pairs.size();
+}
+
+size_t phg::MatchGraph::nmatches() const
+{
+    return finalized_ ? nmatches_ : query_ids.size();
+}
+
+ptrdiff_t phg::MatchGraph::findPair(int img_query, int img_train) const
+{
+    if (!finalized_) {
+        throw std::runtime_error("MatchGraph:: graph is not finalized");
+    }
+    if (img_query < 0 || img_query >= nimages_ || img_train < 0 || img_train >= nimages_) {
+        throw std::runtime_error("MatchGraph:: invalid image");
+    }
+
+    const PairEntry *from = pairs_ptr + image_offsets_ptr[img_query];
+    const PairEntry *to = pairs_ptr + image_offsets_ptr[img_query + 1];
+    const PairEntry *it = std::lower_bound(from, to, (uint32_t) img_train, [](const PairEntry &pair, uint32_t img) {
+        return pair.img_train < img;
+    });
+    if (it == to || it->img_train != (uint32_t) img_train) {
+        return -1;
+    }
+    return it - pairs_ptr;
+}
+
+size_t phg::MatchGraph::nmatches(int img_query, int img_train) const
+{
+    ptrdiff_t pair = findPair(img_query, img_train);
+    return pair == -1 ? 0 : pairs_ptr[pair].nmatches;
+}
+
+void phg::MatchGraph::getMatches(int img_query, int img_train, std::vector<cv::DMatch> &matches) const
+{
+    matches.clear();
+
+    ptrdiff_t pair = findPair(img_query, img_train);
+    if (pair == -1) {
+        return;
+    }
+
+    const PairEntry &entry = pairs_ptr[pair];
+    matches.resize(entry.nmatches);
+    for (uint32_t i = 0; i < entry.nmatches; ++i) {
+        const uint64_t m = entry.offset + i;
+        matches[i] = cv::DMatch(query_ids_ptr[m], train_ids_ptr[m], img_train, (float) cv::float16_t::fromBits(distances_ptr[m]));
+    }
+}
+
+void phg::MatchGraph::save(const std::string &path) const
+{
+    if (!finalized_) {
+        throw std::runtime_error("MatchGraph:: save : graph is not finalized");
+    }
+
+    FileHeader header;
+    std::memcpy(header.magic, match_graph_magic, sizeof(header.magic));
+    header.nimages = nimages_;
+    header.reserved = 0;
+    header.npairs = npairs_;
+    header.nmatches = nmatches_;
+
+    // пишем во временный файл и переименовываем - чтобы прерванный запуск не оставил обрезанный файл под настоящим именем
+    const std::string tmp_path = path + ".tmp";
+    {
+        std::ofstream out(tmp_path, std::ios::binary);
+        if (!out) {
+            throw std::runtime_error("MatchGraph:: save : can't open file " + tmp_path);
+        }
+
+        size_t offset = 0;
+        writeSection(out, offset, &header, 1);
+        writeSection(out, offset, image_offsets_ptr, nimages_ + 1);
+        writeSection(out, offset, pairs_ptr, npairs_);
+        writeSection(out, offset, query_ids_ptr, nmatches_);
+        writeSection(out, offset, train_ids_ptr, nmatches_);
+        writeSection(out, offset, distances_ptr, nmatches_);
+
+        if (!out) {
+            throw std::runtime_error("MatchGraph:: save : failed to write " + tmp_path);
+        }
+    }
+
+    if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+        // на Windows rename не заменяет существующий файл
+        std::remove(path.c_str());
+        if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+            throw std::runtime_error("MatchGraph:: save : can't rename " + tmp_path + " to " + path);
+        }
+    }
+}
+
+void phg::MatchGraph::load(const std::string &path)
+{
+    std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>(path);
+    const char *data = file->data();
+    const size_t size = file->size();
+
+    size_t offset = 0;
+    const FileHeader *header = mapSection<FileHeader>(data, size, offset, 1);
+    if (!header || std::memcmp(header->magic, match_graph_magic, sizeof(match_graph_magic)) != 0) {
+        throw std::runtime_error("MatchGraph:: load : not a match graph file " + path);
+    }
+    if (header->nimages < 0) {
+        throw std::runtime_error("MatchGraph:: load : corrupted header in " + path);
+    }
+
+    const uint64_t *offsets = mapSection<uint64_t>(data, size, offset, (size_t) header->nimages + 1);
+    const PairEntry *pair_entries = mapSection<PairEntry>(data, size, offset, header->npairs);
+    const uint32_t *q = mapSection<uint32_t>(data, size, offset, header->nmatches);
+    const uint32_t *t = mapSection<uint32_t>(data, size, offset, header->nmatches);
+    const uint16_t *d = mapSection<uint16_t>(data, size, offset, header->nmatches);
+    if (!offsets || !pair_entries || !q || !t || !d) {
+        throw std::runtime_error("MatchGraph:: load : unexpected end of file " + path);
+    }
+
+    // файл мог быть испорчен - проверяем все, по чему потом будут адресоваться массивы
+    if (offsets[0] != 0 || offsets[header->nimages] != header->npairs) {
+        throw std::runtime_error("MatchGraph:: load : corrupted image offsets in " + path);
+    }
+    for (int i = 0; i < header->nimages; ++i) {
+        if (offsets[i] > offsets[i + 1]) {
+            throw std::runtime_error("MatchGraph:: load : corrupted image offsets in " + path);
+        }
+    }
+    for (uint64_t p = 0; p < header->npairs; ++p) {
+        const PairEntry &entry = pair_entries[p];
+        if (entry.img_train >= (uint32_t) header->nimages
+            || entry.offset > header->nmatches || entry.nmatches > header->nmatches - entry.offset) {
+            throw std::runtime_error("MatchGraph:: load : corrupted pair entry in " + path);
+        }
+    }
+
+    std::vector<PendingPair>().swap(pending_pairs);
+    std::vector<uint64_t>().swap(image_offsets);
+    std::vector<PairEntry>().swap(pairs);
+    std::vector<uint32_t>().swap(query_ids);
+    std::vector<uint32_t>().swap(train_ids);
+    std::vector<uint16_t>().swap(distances);
+
+    mapped = file;
+    nimages_ = header->nimages;
+    npairs_ = header->npairs;
+    nmatches_ = header->nmatches;
+    image_offsets_ptr = offsets;
+    pairs_ptr = pair_entries;
+    query_ids_ptr = q;
+    train_ids_ptr = t;
+    distances_ptr = d;
+    finalized_ = true;
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <opencv2/core.hpp>
+#include <libutils/thread_mutex.h>
+
+namespace phg {
+
+    class MappedFile;
+
+    // компактное хранилище попарных сопоставлений всех картинок набора:
+    // вместо n^2 векторов DMatch (16 байт на матч) - общие массивы (uint32 query, uint32 train, half-float расстояние), т.е. 10 байт на матч,
+    // пары (i, j) упорядочены по i, затем по j и адресуются как CSR: пары картинки i - [image_offsets[i], image_offsets[i + 1])
+    // жизненный цикл: addMatches (можно из многих потоков) -> finalize -> чтение, либо load (сразу готов к чтению)
+    class MatchGraph {
+    public:
+        MatchGraph(int nimages = 0);
+        ~MatchGraph();
+
+        int nimages() const { return nimages_; }
+        bool finalized() const { return finalized_; }
+
+        // потокобезопасно, каждую упорядоченную пару (img_query, img_train) можно добавить не больше одного раза
+        void addMatches(int img_query, int img_train, const std::vector<cv::DMatch> &matches);
+
+        // раскладывает добавленные матчи в CSR, после этого добавлять больше нельзя
+        void finalize();
+
+        size_t npairs() const;
+        size_t nmatches() const;
+        size_t nmatches(int img_query, int img_train) const;
+
+        // imgIdx у результата - img_train, расстояние восстанавливается с точностью half-float
+        void getMatches(int img_query, int img_train, std::vector<cv::DMatch> &matches) const;
+
+        // файл рассчитан на отображение в память: load не читает матчи, а только отображает файл, страницы подгружаются при обращении
+        // NB: числа пишутся в порядке байт текущей платформы
+        void save(const std::string &path) const;
+        void load(const std::string &path);
+
+    private:
+
+        struct PairEntry {
+            uint32_t img_train;
+            uint32_t nmatches;
+            uint64_t offset;    // номер первого матча пары в общих массивах
+        };
+
+        struct PendingPair {
+            int img_query;
+            int img_train;
+            size_t offset;      // где лежат матчи пары в staging массивах
+            size_t nmatches;
+        };
+
+        // -1 если пары нет
+        ptrdiff_t findPair(int img_query, int img_train) const;
+
+        void setPointers();
+
+        int nimages_;
+        bool finalized_;
+
+        // до finalize: матчи лежат в порядке добавления
+        Mutex append_mutex;
+        std::vector<PendingPair> pending_pairs;
+
+        // собственные данные (после finalize) - на них указывают указатели ниже
+        std::vector<uint64_t> image_offsets;
+        std::vector<PairEntry> pairs;
+        std::vector<uint32_t> query_ids;
+        std::vector<uint32_t> train_ids;
+        std::vector<uint16_t> distances;
+
+        // после load данные лежат в отображенном файле, иначе - в векторах выше
+        std::shared_ptr<MappedFile> mapped;
+        size_t npairs_;
+        size_t nmatches_;
+        const uint64_t *image_offsets_ptr;
+        const PairEntry *pairs_ptr;
+        const uint32_t *query_ids_ptr;
+        const uint32_t *train_ids_ptr;
+        const uint16_t *distances_ptr;
+    };
+
+}
@@ -0,0 +1,113 @@
+#include "multi_image_matcher.h"
+#include "distances.h"
+
+#include <cmath>
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+
+
+namespace {
+
+    const int query_block_size = 8; // столько query дескрипторов сравниваются с каждой train строкой пока она в кеше
+
+}
+
+void phg::MultiImageMatcher::train(const std::vector<cv::Mat> &train_descs)
+{
+    if (train_descs.empty()) {
+        throw std::runtime_error("MultiImageMatcher:: train : no images");
+    }
+
+    // у картинки без ключевых точек матрица пустая и ее размерность ни о чем не говорит - берем первую непустую
+    int ndim = -1;
+    for (const cv::Mat &desc : train_descs) {
+        if (!desc.empty()) {
+            ndim = desc.cols;
+            break;
+        }
+    }
+    if (ndim == -1) {
+        throw std::runtime_error("MultiImageMatcher:: train : no train descriptors");
+    }
+
+    std::vector<int> offsets(1, 0);
+    for (const cv::Mat &desc : train_descs) {
+        if (!desc.empty() && (desc.type() != CV_32FC1 || desc.cols != ndim)) {
+            throw std::runtime_error("MultiImageMatcher:: train : only CV_32FC1 descriptors of the same size supported");
+        }
+        offsets.push_back(offsets.back() + (desc.empty() ? 0 : desc.rows));
+    }
+    image_offsets.swap(offsets);
+
+    train_desc.create(image_offsets.back(), ndim, CV_32FC1);
+    for (size_t i = 0; i < train_descs.size(); ++i) {
+        if (!train_descs[i].empty()) {
+            train_descs[i].copyTo(train_desc.rowRange(image_offsets[i], image_offsets[i + 1]));
+        }
+    }
+}
+
+void phg::MultiImageMatcher::knnMatch(const cv::Mat &query_desc,
+                                      std::vector<std::vector<std::vector<cv::DMatch>>> &matches,
+                                      int k) const
+{
+    if (image_offsets.empty()) {
+        throw std::runtime_error("MultiImageMatcher:: knnMatch : matcher is not trained");
+    }
+    if (query_desc.type() != CV_32FC1 || query_desc.cols != train_desc.cols) {
+        throw std::runtime_error("MultiImageMatcher:: knnMatch : query descriptors type mismatch");
+    }
+    if (k < 1) {
+        throw std::runtime_error("MultiImageMatcher:: knnMatch : invalid k");
+    }
+
+    std::cout << "MultiImageMatcher::knnMatch : n query desc : " << query_desc.rows << ", n images : " << nimages() << ", n train desc : " << train_desc.rows << std::endl;
+
+    const int ndesc = query_desc.rows;
+    const int ndim = query_desc.cols;
+    const int nimgs = nimages();
+
+    matches.resize(nimgs);
+    for (int img = 0; img < nimgs; ++img) {
+        matches[img].resize(ndesc);
+    }
+
+    const int nblocks = (ndesc + query_block_size - 1) / query_block_size;
+
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int block = 0; block < nblocks; ++block) {
+        const int from = block * query_block_size;
+        const int to = std::min(ndesc, from + query_block_size);
+
+        for (int img = 0; img < nimgs; ++img) {
+            for (int qi = from; qi < to; ++qi) {
+                matches[img][qi].clear();
+            }
+
+            for (int ti = image_offsets[img]; ti < image_offsets[img + 1]; ++ti) {
+                const float *t = train_desc.ptr<float>(ti);
+                for (int qi = from; qi < to; ++qi) {
+                    std::vector<cv::DMatch> &dst = matches[img][qi];
+                    float dist2 = l2sqr(query_desc.ptr<float>(qi), t, ndim);
+                    // пока храним квадраты расстояний, корень - в конце
+                    if ((int) dst.size() == k && dst.back().distance <= dist2) {
+                        continue;
+                    }
+
+                    cv::DMatch match(qi, ti - image_offsets[img], img, dist2);
+                    if ((int) dst.size() == k) {
+                        dst.pop_back();
+                    }
+                    dst.insert(std::upper_bound(dst.begin(), dst.end(), match), match);
+                }
+            }
+
+            for (int qi = from; qi < to; ++qi) {
+                for (cv::DMatch &match : matches[img][qi]) {
+                    match.distance = std::sqrt(match.distance);
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <vector>
+#include <opencv2/core.hpp>
+
+namespace phg {
+
+    // сопоставление дескрипторов одной картинки сразу с несколькими (например новой камеры - со всеми уже выравненными):
+    // train дескрипторы всех картинок склеены в одну матрицу, за один проход по ней для каждого query дескриптора
+    // находятся k ближайших в каждой картинке - query дескрипторы читаются из памяти один раз, а не по разу на каждую пару
+    struct MultiImageMatcher {
+
+        // NB: дескрипторы копируются
+        void train(const std::vector<cv::Mat> &train_descs);
+
+        int nimages() const { return (int) image_offsets.size() - 1; }
+
+        // matches[img][qi] - до k ближайших к qi среди дескрипторов картинки img (по возрастанию расстояния),
+        // DMatch::imgIdx = img, DMatch::trainIdx - номер дескриптора внутри картинки img
+        void knnMatch(const cv::Mat &query_desc, std::vector<std::vector<std::vector<cv::DMatch>>> &matches, int k = 2) const;
+
+    private:
+
+        cv::Mat train_desc;              // дескрипторы всех картинок подряд
+        std::vector<int> image_offsets;  // дескрипторы картинки i - строки [image_offsets[i], image_offsets[i + 1])
+    };
+
+}
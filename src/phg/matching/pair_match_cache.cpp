@@ -0,0 +1,163 @@
+#include "pair_match_cache.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <phg/utils/mapped_file.h>
+
+
+namespace {
+
+    const char pair_matches_magic[8] = {'P', 'H', 'G', 'P', 'M', 'C', 'H', '1'};
+
+    // заголовок кратен 8 байтам - сопоставления за ним выровнены
+    struct FileHeader {
+        char magic[8];
+        uint64_t key;
+        uint64_t features_query;
+        uint64_t features_train;
+        uint64_t params_hash;
+        uint64_t nmatches;
+    };
+
+    // сопоставления пишутся и читаются как есть: queryIdx, trainIdx, imgIdx (int32), distance (float32)
+    static_assert(sizeof(cv::DMatch) == 4 * sizeof(int32_t), "unexpected cv::DMatch layout");
+
+    // FNV-1a
+    const uint64_t fnv_offset_basis = 14695981039346656037ull;
+    const uint64_t fnv_prime = 1099511628211ull;
+
+    uint64_t hashBytes(uint64_t hash, const void *data, size_t size)
+    {
+        const unsigned char *bytes = (const unsigned char *) data;
+        for (size_t i = 0; i < size; ++i) {
+            hash ^= bytes[i];
+            hash *= fnv_prime;
+        }
+        return hash;
+    }
+
+    template <typename T>
+    uint64_t hashValue(uint64_t hash, const T &value)
+    {
+        return hashBytes(hash, &value, sizeof(value));
+    }
+
+}
+
+phg::PairMatchCache::PairMatchCache(const std::string &path_prefix, const std::string &params)
+    : path_prefix(path_prefix)
+    , params_hash(hashBytes(fnv_offset_basis, params.data(), params.size()))
+{}
+
+uint64_t phg::PairMatchCache::hashFeatures(const std::vector<cv::KeyPoint> &keypoints, const cv::Mat &descriptors)
+{
+    if ((int) keypoints.size() != descriptors.rows) {
+        throw std::runtime_error("PairMatchCache:: hashFeatures : keypoints and descriptors count mismatch");
+    }
+
+    uint64_t hash = fnv_offset_basis;
+    hash = hashValue(hash, (uint64_t) keypoints.size());
+    for (const cv::KeyPoint &keypoint : keypoints) {
+        hash = hashValue(hash, keypoint.pt.x);
+        hash = hashValue(hash, keypoint.pt.y);
+        hash = hashValue(hash, keypoint.size);
+        hash = hashValue(hash, keypoint.angle);
+        hash = hashValue(hash, keypoint.octave);
+    }
+
+    hash = hashValue(hash, (int32_t) descriptors.type());
+    hash = hashValue(hash, (int32_t) descriptors.cols);
+    for (int i = 0; i < descriptors.rows; ++i) {
+        hash = hashBytes(hash, descriptors.ptr(i), descriptors.cols * descriptors.elemSize());
+    }
+    return hash;
+}
+
+uint64_t phg::PairMatchCache::hashValues(const std::vector<uint64_t> &values)
+{
+    uint64_t hash = fnv_offset_basis;
+    hash = hashValue(hash, (uint64_t) values.size());
+    return hashBytes(hash, values.data(), values.size() * sizeof(uint64_t));
+}
+
+uint64_t phg::PairMatchCache::pairKey(uint64_t features_query, uint64_t features_train) const
+{
+    uint64_t hash = fnv_offset_basis;
+    hash = hashValue(hash, features_query);
+    hash = hashValue(hash, features_train);
+    hash = hashValue(hash, params_hash);
+    return hash;
+}
+
+std::string phg::PairMatchCache::pairPath(uint64_t key) const
+{
+    char hex[17];
+    std::snprintf(hex, sizeof(hex), "%016llx", (unsigned long long) key);
+    return path_prefix + hex + ".bin";
+}
+
+bool phg::PairMatchCache::find(uint64_t features_query, uint64_t features_train, Matches &matches) const
+{
+    const uint64_t key = pairKey(features_query, features_train);
+    const std::string path = pairPath(key);
+    if (!std::ifstream(path)) {
+        return false;
+    }
+
+    std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>(path);
+    if (file->size() < sizeof(FileHeader)) {
+        return false;
+    }
+
+    // недописанный или чужой (коллизия имени) файл - считаем что пары в кеше нет
+    const FileHeader *header = (const FileHeader *) file->data();
+    if (std::memcmp(header->magic, pair_matches_magic, sizeof(pair_matches_magic)) != 0
+        || header->key != key
+        || header->features_query != features_query
+        || header->features_train != features_train
+        || header->params_hash != params_hash
+        || sizeof(FileHeader) + header->nmatches * sizeof(cv::DMatch) != file->size()) {
+        return false;
+    }
+
+    matches.file = file;
+    matches.data = (const cv::DMatch *) (file->data() + sizeof(FileHeader));
+    matches.size = header->nmatches;
+    return true;
+}
+
+void phg::PairMatchCache::store(uint64_t features_query, uint64_t features_train, const std::vector<cv::DMatch> &matches) const
+{
+    FileHeader header;
+    std::memcpy(header.magic, pair_matches_magic, sizeof(header.magic));
+    header.key = pairKey(features_query, features_train);
+    header.features_query = features_query;
+    header.features_train = features_train;
+    header.params_hash = params_hash;
+    header.nmatches = matches.size();
+
+    // пишем во временный файл и переименовываем - чтобы прерванный запуск не оставил обрезанный файл под настоящим именем
+    const std::string path = pairPath(header.key);
+    const std::string tmp_path = path + ".tmp";
+    {
+        std::ofstream out(tmp_path, std::ios::binary);
+        if (!out) {
+            throw std::runtime_error("PairMatchCache:: store : can't open file " + tmp_path);
+        }
+        out.write((const char *) &header, sizeof(header));
+        out.write((const char *) matches.data(), matches.size() * sizeof(cv::DMatch));
+        if (!out) {
+            throw std::runtime_error("PairMatchCache:: store : failed to write " + tmp_path);
+        }
+    }
+
+    if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+        // на Windows rename не заменяет существующий файл
+        std::remove(path.c_str());
+        if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+            throw std::runtime_error("PairMatchCache:: store : can't rename " + tmp_path + " to " + path);
+        }
+    }
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <opencv2/core.hpp>
+
+namespace phg {
+
+    class MappedFile;
+
+    // дисковый кеш проверенных сопоставлений пар картинок: на каждую пару - свой файл, ключ - хеши признаков обеих картинок
+    // и строка с параметрами матчера и фильтров, так что при изменении картинки, детектора или параметров сопоставления
+    // старые файлы просто перестают находиться, а все остальные пары берутся из кеша
+    // чтение без разбора и копирования: файл отображается в память и сопоставления лежат в нем прямо в виде cv::DMatch
+    // NB: числа пишутся в порядке байт текущей платформы
+    class PairMatchCache {
+    public:
+        // сопоставления внутри отображенного файла, указатель действителен пока жив объект
+        struct Matches {
+            std::shared_ptr<MappedFile> file;
+            const cv::DMatch *data = nullptr;
+            size_t size = 0;
+
+            const cv::DMatch *begin() const { return data; }
+            const cv::DMatch *end() const { return data + size; }
+        };
+
+        // файлы пар: path_prefix + ключ + ".bin", params - например "flann_t4_c32_gms"
+        PairMatchCache(const std::string &path_prefix, const std::string &params);
+
+        static uint64_t hashFeatures(const std::vector<cv::KeyPoint> &keypoints, const cv::Mat &descriptors);
+        // тем же хешем - произвольный набор значений, например ключ кеша, зависящего от признаков всех картинок
+        static uint64_t hashValues(const std::vector<uint64_t> &values);
+
+        // потокобезопасны, упорядоченная пара: сопоставления картинки query с картинкой train
+        bool find(uint64_t features_query, uint64_t features_train, Matches &matches) const;
+        void store(uint64_t features_query, uint64_t features_train, const std::vector<cv::DMatch> &matches) const;
+
+    private:
+
+        uint64_t pairKey(uint64_t features_query, uint64_t features_train) const;
+        std::string pairPath(uint64_t key) const;
+
+        std::string path_prefix;
+        uint64_t params_hash;
+    };
+
+}
@@ -0,0 +1,161 @@
+#include "pair_scheduler.h"
+
+#include <deque>
+#include <atomic>
+#include <memory>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <stdexcept>
+#include <libutils/thread_mutex.h>
+#include <libutils/string_utils.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+
+namespace {
+
+    struct WorkQueue {
+        Mutex mutex;
+        std::deque<int> pairs;
+    };
+
+    // свои задачи поток берет с головы очереди (там самые дорогие), чужие - ворует с хвоста
+    bool popOwn(WorkQueue &queue, int &pair)
+    {
+        Lock lock(queue.mutex);
+        if (queue.pairs.empty()) {
+            return false;
+        }
+        pair = queue.pairs.front();
+        queue.pairs.pop_front();
+        return true;
+    }
+
+    bool steal(WorkQueue &queue, int &pair)
+    {
+        Lock lock(queue.mutex);
+        if (queue.pairs.empty()) {
+            return false;
+        }
+        pair = queue.pairs.back();
+        queue.pairs.pop_back();
+        return true;
+    }
+
+}
+
+phg::PairScheduler::PairScheduler(int nimages)
+    : nimages(nimages)
+{
+    if (nimages < 0) {
+        throw std::runtime_error("PairScheduler:: invalid number of images");
+    }
+}
+
+void phg::PairScheduler::addPair(int img0, int img1, double cost)
+{
+    if (img0 < 0 || img0 >= nimages || img1 < 0 || img1 >= nimages || img0 == img1) {
+        throw std::runtime_error("PairScheduler:: addPair : invalid pair");
+    }
+
+    Pair pair;
+    pair.img0 = std::min(img0, img1);
+    pair.img1 = std::max(img0, img1);
+    pair.cost = cost;
+    pairs.push_back(pair);
+}
+
+void phg::PairScheduler::setImageLabels(const std::vector<std::string> &image_labels)
+{
+    if ((int) image_labels.size() != nimages) {
+        throw std::runtime_error("PairScheduler:: setImageLabels : number of labels differs from number of images");
+    }
+    labels = image_labels;
+}
+
+void phg::PairScheduler::run(const MatchPairFunction &match_pair, MatchGraph &graph, bool verbose) const
+{
+    if (graph.nimages() != nimages) {
+        throw std::runtime_error("PairScheduler:: run : match graph has different number of images");
+    }
+
+    // самые дорогие пары - первыми, раздаем по кругу, чтобы изначально у потоков было примерно поровну работы
+    std::vector<int> order(pairs.size());
+    for (size_t i = 0; i < pairs.size(); ++i) {
+        order[i] = (int) i;
+    }
+    std::stable_sort(order.begin(), order.end(), [this](int a, int b) {
+        return pairs[a].cost > pairs[b].cost;
+    });
+
+#ifdef _OPENMP
+    const int nthreads = omp_get_max_threads();
+#else
+    const int nthreads = 1;
+#endif
+
+    std::vector<std::unique_ptr<WorkQueue>> queues(nthreads);
+    for (int t = 0; t < nthreads; ++t) {
+        queues[t].reset(new WorkQueue());
+    }
+    for (size_t i = 0; i < order.size(); ++i) {
+        queues[i % nthreads]->pairs.push_back(order[i]);
+    }
+
+    // прогресс считается по направлениям: на каждую пару - два сопоставления
+    const size_t total = 2 * pairs.size();
+    std::atomic<size_t> ndone(0);
+
+    #pragma omp parallel num_threads(nthreads)
+    {
+#ifdef _OPENMP
+        const int thread = omp_get_thread_num();
+#else
+        const int thread = 0;
+#endif
+
+        std::vector<cv::DMatch> matches;
+
+        while (true) {
+            int pair_id = -1;
+            if (!popOwn(*queues[thread], pair_id)) {
+                // новых задач не появляется, поэтому если все очереди пусты - работа закончена
+                for (int shift = 1; shift < nthreads && pair_id == -1; ++shift) {
+                    steal(*queues[(thread + shift) % nthreads], pair_id);
+                }
+                if (pair_id == -1) {
+                    break;
+                }
+            }
+
+            const Pair &pair = pairs[pair_id];
+
+            for (int direction = 0; direction < 2; ++direction) {
+                const int img_query = direction == 0 ? pair.img0 : pair.img1;
+                const int img_train = direction == 0 ? pair.img1 : pair.img0;
+
+                matches.clear();
+                match_pair(img_query, img_train, matches);
+
+                if (!matches.empty()) {
+                    graph.addMatches(img_query, img_train, matches);
+                }
+
+                size_t done = ++ndone;
+                if (verbose && !matches.empty()) {
+                    // одной операцией вывода, чтобы строки разных потоков не перемешивались
+                    std::ostringstream line;
+                    line << to_percent(done, total) << "% - Cameras " << img_query << "-" << img_train;
+                    if (!labels.empty()) {
+                        line << " (" << labels[img_query] << "-" << labels[img_train] << ")";
+                    }
+                    line << ": " << matches.size() << " matches" << std::endl;
+                    std::cout << line.str();
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <opencv2/core.hpp>
+
+#include "match_graph.h"
+
+namespace phg {
+
+    // параллельное сопоставление набора неупорядоченных пар картинок:
+    // каждая пара (i, j) - одна задача, внутри которой сопоставляются обе стороны i -> j и j -> i
+    // (перестановка queryIdx и trainIdx матчей i -> j не годится вместо j -> i: это уже не ближайшие соседи, одна точка j попадала бы во многие матчи),
+    // стоимость пар сильно разная, поэтому у каждого потока своя очередь, а освободившийся поток ворует работу из чужих очередей
+    class PairScheduler {
+    public:
+        // matches - результат сопоставления дескрипторов картинки img_query с дескрипторами картинки img_train
+        typedef std::function<void(int img_query, int img_train, std::vector<cv::DMatch> &matches)> MatchPairFunction;
+
+        PairScheduler(int nimages);
+
+        // cost - оценка относительной трудоемкости пары (например произведение числа ключевых точек), дорогие пары раздаются первыми
+        void addPair(int img0, int img1, double cost = 1.0);
+
+        // названия картинок для вывода прогресса (необязательно)
+        void setImageLabels(const std::vector<std::string> &labels);
+
+        size_t npairs() const { return pairs.size(); }
+
+        // сопоставляет все добавленные пары и добавляет матчи в обе стороны в graph (graph.finalize() остается за вызывающим)
+        void run(const MatchPairFunction &match_pair, MatchGraph &graph, bool verbose = true) const;
+
+    private:
+
+        struct Pair {
+            int img0;
+            int img1;
+            double cost;
+        };
+
+        int nimages;
+        std::vector<Pair> pairs;
+        std::vector<std::string> labels;
+    };
+
+}
@@ -0,0 +1,110 @@
+#include "pair_selection.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+
+namespace {
+
+    void sortUnique(std::vector<std::pair<int, int>> &pairs)
+    {
+        std::sort(pairs.begin(), pairs.end());
+        pairs.erase(std::unique(pairs.begin(), pairs.end()), pairs.end());
+    }
+
+}
+
+void phg::PairSelector::selectAdditionalPairs(int nimages, const PairMatchesCount &nmatches, std::vector<std::pair<int, int>> &pairs) const
+{
+    pairs.clear();
+}
+
+void phg::ExhaustivePairSelector::selectPairs(int nimages, std::vector<std::pair<int, int>> &pairs) const
+{
+    pairs.clear();
+    for (int i = 0; i < nimages; ++i) {
+        for (int j = i + 1; j < nimages; ++j) {
+            pairs.push_back(std::make_pair(i, j));
+        }
+    }
+}
+
+phg::SequentialPairSelector::SequentialPairSelector(int window)
+    : window(window)
+{
+    if (window < 1) {
+        throw std::runtime_error("SequentialPairSelector:: invalid window");
+    }
+}
+
+void phg::SequentialPairSelector::selectPairs(int nimages, std::vector<std::pair<int, int>> &pairs) const
+{
+    pairs.clear();
+    for (int i = 0; i < nimages; ++i) {
+        for (int j = i + 1; j <= i + window && j < nimages; ++j) {
+            pairs.push_back(std::make_pair(i, j));
+        }
+    }
+}
+
+phg::LoopClosurePairSelector::LoopClosurePairSelector(int window, int probe_step, size_t min_loop_matches, int loop_radius)
+    : SequentialPairSelector(window)
+    , probe_step(probe_step)
+    , min_loop_matches(min_loop_matches)
+    , loop_radius(loop_radius)
+{
+    if (probe_step < 1 || loop_radius < 0) {
+        throw std::runtime_error("LoopClosurePairSelector:: invalid parameters");
+    }
+}
+
+void phg::LoopClosurePairSelector::selectProbes(int nimages, std::vector<std::pair<int, int>> &probes) const
+{
+    probes.clear();
+    for (int i = 0; i < nimages; i += probe_step) {
+        for (int j = i + probe_step; j < nimages; j += probe_step) {
+            if (j - i > window) {
+                probes.push_back(std::make_pair(i, j));
+            }
+        }
+    }
+}
+
+void phg::LoopClosurePairSelector::selectPairs(int nimages, std::vector<std::pair<int, int>> &pairs) const
+{
+    SequentialPairSelector::selectPairs(nimages, pairs);
+
+    std::vector<std::pair<int, int>> probes;
+    selectProbes(nimages, probes);
+    pairs.insert(pairs.end(), probes.begin(), probes.end());
+    sortUnique(pairs);
+}
+
+void phg::LoopClosurePairSelector::selectAdditionalPairs(int nimages, const PairMatchesCount &nmatches, std::vector<std::pair<int, int>> &pairs) const
+{
+    pairs.clear();
+
+    std::vector<std::pair<int, int>> probes;
+    selectProbes(nimages, probes);
+    for (const auto &probe : probes) {
+        if (nmatches(probe.first, probe.second) < min_loop_matches) {
+            continue;
+        }
+
+        for (int di = -loop_radius; di <= loop_radius; ++di) {
+            for (int dj = -loop_radius; dj <= loop_radius; ++dj) {
+                const int i = probe.first + di;
+                const int j = probe.second + dj;
+                if (i < 0 || j >= nimages) {
+                    continue;
+                }
+                // пары окна и сами пробы уже сопоставлены в первой фазе
+                if (j - i <= window || (i % probe_step == 0 && j % probe_step == 0)) {
+                    continue;
+                }
+                pairs.push_back(std::make_pair(i, j));
+            }
+        }
+    }
+    sortUnique(pairs);
+}
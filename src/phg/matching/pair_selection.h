@@ -0,0 +1,65 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+#include <utility>
+#include <functional>
+
+namespace phg {
+
+    // политика выбора пар картинок для сопоставления, результат - неупорядоченные пары (img0 < img1) без повторов по возрастанию,
+    // которые затем раздаются в PairScheduler
+    // выбор в две фазы: selectPairs до сопоставления, selectAdditionalPairs - по результатам сопоставления пар первой фазы
+    class PairSelector {
+    public:
+        // число сопоставлений найденных в паре первой фазы
+        typedef std::function<size_t(int img0, int img1)> PairMatchesCount;
+
+        virtual ~PairSelector() {}
+
+        virtual void selectPairs(int nimages, std::vector<std::pair<int, int>> &pairs) const = 0;
+
+        // по умолчанию второй фазы нет
+        virtual void selectAdditionalPairs(int nimages, const PairMatchesCount &nmatches, std::vector<std::pair<int, int>> &pairs) const;
+    };
+
+    // все n(n-1)/2 пар
+    class ExhaustivePairSelector : public PairSelector {
+    public:
+        void selectPairs(int nimages, std::vector<std::pair<int, int>> &pairs) const override;
+    };
+
+    // упорядоченная съемка (см. ordered_filenames.txt): каждая картинка с window следующими, n * window пар вместо n^2 / 2
+    class SequentialPairSelector : public PairSelector {
+    public:
+        SequentialPairSelector(int window);
+
+        void selectPairs(int nimages, std::vector<std::pair<int, int>> &pairs) const override;
+
+    protected:
+        int window;
+    };
+
+    // окно + замыкания петель (например проход по коридору туда и обратно):
+    // в первой фазе кроме окна сопоставляются редкие дальние пробы - пары картинок с номерами кратными probe_step,
+    // проба считается подтвержденным замыканием петли если в ней нашлось не меньше min_loop_matches сопоставлений,
+    // тогда во второй фазе сопоставляются и соседние с ней пары (сдвиги на loop_radius картинок в обе стороны)
+    // всего пар n * window + (n / probe_step)^2 / 2 + (2 * loop_radius + 1)^2 на каждое замыкание
+    class LoopClosurePairSelector : public SequentialPairSelector {
+    public:
+        LoopClosurePairSelector(int window, int probe_step, size_t min_loop_matches = 100, int loop_radius = 2);
+
+        void selectPairs(int nimages, std::vector<std::pair<int, int>> &pairs) const override;
+
+        void selectAdditionalPairs(int nimages, const PairMatchesCount &nmatches, std::vector<std::pair<int, int>> &pairs) const override;
+
+    private:
+        // дальние пробы (за пределами окна)
+        void selectProbes(int nimages, std::vector<std::pair<int, int>> &probes) const;
+
+        int probe_step;
+        size_t min_loop_matches;
+        int loop_radius;
+    };
+
+}
@@ -0,0 +1,209 @@
+#include "streaming_matcher.h"
+#include "distances.h"
+
+#include <cmath>
+#include <limits>
+#include <fstream>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+#include <phg/utils/mapped_file.h>
+
+
+namespace {
+
+    const char descriptors_magic[8] = {'P', 'H', 'G', 'D', 'E', 'S', 'C', '1'};
+
+    // заголовок 16 байт - дескрипторы в отображенной памяти выровнены на float
+    struct FileHeader {
+        char magic[8];
+        int32_t rows;
+        int32_t cols;
+    };
+
+    // блоки query x train внутри куска: блок train дескрипторов остается в кеше пока с ним сравниваются все query блока
+    const int BLOCK_SIZE = 64;
+
+}
+
+phg::StreamingMatcher::StreamingMatcher(size_t chunk_size)
+    : chunk_size(chunk_size)
+    , data_offset(0)
+    , n_train_desc(0)
+    , ndim(0)
+{
+    if (chunk_size == 0) {
+        throw std::runtime_error("StreamingMatcher:: invalid chunk size");
+    }
+}
+
+phg::StreamingMatcher::~StreamingMatcher()
+{}
+
+void phg::StreamingMatcher::saveDescriptors(const cv::Mat &descriptors, const std::string &path)
+{
+    if (descriptors.type() != CV_32FC1) {
+        throw std::runtime_error("StreamingMatcher:: saveDescriptors : CV_32FC1 descriptors expected");
+    }
+
+    std::ofstream out(path, std::ios::binary);
+    if (!out) {
+        throw std::runtime_error("StreamingMatcher:: saveDescriptors : can't open file " + path);
+    }
+
+    FileHeader header;
+    std::memcpy(header.magic, descriptors_magic, sizeof(header.magic));
+    header.rows = descriptors.rows;
+    header.cols = descriptors.cols;
+    out.write((const char *) &header, sizeof(header));
+    for (int i = 0; i < descriptors.rows; ++i) {
+        out.write((const char *) descriptors.ptr<float>(i), descriptors.cols * sizeof(float));
+    }
+
+    if (!out) {
+        throw std::runtime_error("StreamingMatcher:: saveDescriptors : failed to write " + path);
+    }
+}
+
+void phg::StreamingMatcher::train(const cv::Mat &train_desc)
+{
+    if (train_desc.rows < 2) {
+        throw std::runtime_error("StreamingMatcher:: train : needed at least 2 train descriptors");
+    }
+    if (train_desc.type() != CV_32FC1 || !train_desc.isContinuous()) {
+        throw std::runtime_error("StreamingMatcher:: train : continuous CV_32FC1 descriptors expected");
+    }
+
+    mapped.reset();
+    data_offset = 0;
+    train_data = train_desc.ptr<float>();
+    n_train_desc = train_desc.rows;
+    ndim = train_desc.cols;
+}
+
+void phg::StreamingMatcher::train(const std::string &descriptors_path)
+{
+    std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>(descriptors_path);
+
+    if (file->size() < sizeof(FileHeader)) {
+        throw std::runtime_error("StreamingMatcher:: train : not a descriptors file " + descriptors_path);
+    }
+    FileHeader header;
+    std::memcpy(&header, file->data(), sizeof(header));
+    if (std::memcmp(header.magic, descriptors_magic, sizeof(descriptors_magic)) != 0) {
+        throw std::runtime_error("StreamingMatcher:: train : not a descriptors file " + descriptors_path);
+    }
+    if (header.rows < 2 || header.cols <= 0) {
+        throw std::runtime_error("StreamingMatcher:: train : needed at least 2 train descriptors in " + descriptors_path);
+    }
+    if (sizeof(FileHeader) + (size_t) header.rows * header.cols * sizeof(float) > file->size()) {
+        throw std::runtime_error("StreamingMatcher:: train : unexpected end of file " + descriptors_path);
+    }
+
+    mapped = file;
+    data_offset = sizeof(FileHeader);
+    train_data = (const float *) (file->data() + data_offset);
+    n_train_desc = header.rows;
+    ndim = header.cols;
+}
+
+void phg::StreamingMatcher::knnMatch(const cv::Mat &query_desc, std::vector<std::vector<cv::DMatch>> &matches, int k) const
+{
+    KnnMatches flat;
+    knnMatchFlat(query_desc, flat, k);
+
+    const int nquery = query_desc.rows;
+    matches.assign(nquery, std::vector<cv::DMatch>(k));
+
+    #pragma omp parallel for
+    for (int qi = 0; qi < nquery; ++qi) {
+        for (int ki = 0; ki < k; ++ki) {
+            matches[qi][ki] = flat.match(qi, ki);
+        }
+    }
+}
+
+void phg::StreamingMatcher::knnMatchFlat(const cv::Mat &query_desc, KnnMatches &matches, int k) const
+{
+    if (!train_data) {
+        throw std::runtime_error("StreamingMatcher:: knnMatchFlat : matcher is not trained");
+    }
+    if (query_desc.type() != CV_32FC1 || query_desc.cols != ndim) {
+        throw std::runtime_error("StreamingMatcher:: knnMatchFlat : query descriptors type mismatch");
+    }
+    if (k < 1 || k > n_train_desc) {
+        throw std::runtime_error("StreamingMatcher:: knnMatchFlat : invalid k");
+    }
+
+    const int nquery = query_desc.rows;
+    const size_t row_size = ndim * sizeof(float);
+    const int chunk_rows = (int) std::max((size_t) 1, std::min(chunk_size / row_size, (size_t) n_train_desc));
+    const int nchunks = (n_train_desc + chunk_rows - 1) / chunk_rows;
+
+    // до конца перебора в distance лежат квадраты расстояний, k лучших каждого query отсортированы по возрастанию
+    matches.resize(nquery, k);
+    std::fill(matches.train_idx.begin(), matches.train_idx.end(), -1);
+    std::fill(matches.distance.begin(), matches.distance.end(), std::numeric_limits<float>::max());
+
+    if (mapped) {
+        mapped->prefetch(data_offset, (size_t) chunk_rows * row_size);
+    }
+
+    for (int chunk = 0; chunk < nchunks; ++chunk) {
+        const int t0 = chunk * chunk_rows;
+        const int t1 = std::min(t0 + chunk_rows, n_train_desc);
+
+        // следующий кусок читается с диска пока считается текущий
+        if (mapped && chunk + 1 < nchunks) {
+            mapped->prefetch(data_offset + (size_t) t1 * row_size, (size_t) chunk_rows * row_size);
+        }
+
+        #pragma omp parallel for schedule(dynamic, 1)
+        for (int q0 = 0; q0 < nquery; q0 += BLOCK_SIZE) {
+            const int q1 = std::min(q0 + BLOCK_SIZE, nquery);
+            for (int tb0 = t0; tb0 < t1; tb0 += BLOCK_SIZE) {
+                const int tb1 = std::min(tb0 + BLOCK_SIZE, t1);
+                for (int qi = q0; qi < q1; ++qi) {
+                    const float *q = query_desc.ptr<float>(qi);
+                    float *best_dist2 = matches.distance.data() + (size_t) qi * k;
+                    int *best_idx = matches.train_idx.data() + (size_t) qi * k;
+                    for (int ti = tb0; ti < tb1; ++ti) {
+                        const float dist2 = l2sqr(q, train_data + (size_t) ti * ndim, ndim);
+                        if (dist2 >= best_dist2[k - 1]) {
+                            continue;
+                        }
+                        // вставка с сохранением порядка, при равных расстояниях раньше идет меньший trainIdx
+                        int j = k - 1;
+                        while (j > 0 && best_dist2[j - 1] > dist2) {
+                            best_dist2[j] = best_dist2[j - 1];
+                            best_idx[j] = best_idx[j - 1];
+                            --j;
+                        }
+                        best_dist2[j] = dist2;
+                        best_idx[j] = ti;
+                    }
+                }
+            }
+        }
+
+        if (mapped) {
+            mapped->evict(data_offset + (size_t) t0 * row_size, (size_t) (t1 - t0) * row_size);
+        }
+    }
+
+    #pragma omp parallel for
+    for (int i = 0; i < (int) matches.distance.size(); ++i) {
+        matches.distance[i] = std::sqrt(matches.distance[i]);
+    }
+}
+
+void phg::StreamingMatcher::matchRatio(const cv::Mat &query_desc, float ratio, std::vector<cv::DMatch> &matches) const
+{
+    if (!(ratio > 0.f && ratio <= 1.f)) {
+        throw std::runtime_error("StreamingMatcher:: matchRatio : invalid ratio");
+    }
+
+    KnnMatches knn_matches;
+    knnMatchFlat(query_desc, knn_matches, 2);
+    filterMatchesRatioTest(knn_matches, ratio, matches);
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <memory>
+#include <string>
+
+#include "descriptor_matcher.h"
+
+namespace phg {
+
+    class MappedFile;
+
+    // точный перебор по train дескрипторам, которые не помещаются в память (например архив дескрипторов со всех съемок):
+    // train дескрипторы лежат в файле (см. saveDescriptors) отображенном в память и перебираются кусками по chunk_size байт,
+    // для каждого query между кусками хранятся только текущие k лучших,
+    // следующий кусок подгружается с диска (madvise WILLNEED) пока считается текущий, а пройденный выбрасывается из памяти
+    // train(cv::Mat) - то же самое по дескрипторам в памяти (без подгрузки)
+    struct StreamingMatcher : DescriptorMatcher {
+
+        StreamingMatcher(size_t chunk_size = 64 * 1024 * 1024);
+        ~StreamingMatcher();
+
+        // файл: magic, int32 rows, int32 cols, затем rows x cols float32 построчно
+        static void saveDescriptors(const cv::Mat &descriptors, const std::string &path);
+
+        void train(const cv::Mat &train_desc) override;
+        void train(const std::string &descriptors_path);
+
+        void knnMatch(const cv::Mat &query_desc, std::vector<std::vector<cv::DMatch>> &matches, int k) const override;
+
+        void knnMatchFlat(const cv::Mat &query_desc, KnnMatches &matches, int k) const override;
+
+        void matchRatio(const cv::Mat &query_desc, float ratio, std::vector<cv::DMatch> &matches) const override;
+
+    private:
+
+        size_t chunk_size;
+
+        std::shared_ptr<MappedFile> mapped;  // nullptr если train дескрипторы в памяти
+        size_t data_offset;                  // где в файле начинаются дескрипторы
+        const float *train_data = nullptr;
+        int n_train_desc;
+        int ndim;
+    };
+
+}
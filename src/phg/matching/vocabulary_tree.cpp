@@ -0,0 +1,359 @@
+#include "vocabulary_tree.h"
+#include "kmeans.h"
+#include "distances.h"
+
+#include <fstream>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <libutils/rasserts.h>
+
+
+namespace {
+
+    const char vocabulary_magic[8] = {'P', 'H', 'G', 'V', 'O', 'C', 'T', '1'};
+
+    template <typename T>
+    void writeValue(std::ofstream &out, const T &value)
+    {
+        out.write((const char *) &value, sizeof(T));
+    }
+
+    template <typename T>
+    void readValue(std::ifstream &in, T &value)
+    {
+        in.read((char *) &value, sizeof(T));
+    }
+
+}
+
+phg::VocabularyTree::VocabularyTree(int branching, int depth)
+    : branching(branching)
+    , depth(depth)
+    , nwords_(0)
+{
+    if (branching < 2 || depth < 1) {
+        throw std::runtime_error("VocabularyTree:: invalid parameters");
+    }
+}
+
+void phg::VocabularyTree::train(const cv::Mat &descriptors)
+{
+    if (descriptors.type() != CV_32FC1 || descriptors.rows < branching) {
+        throw std::runtime_error("VocabularyTree:: train : needed at least branching CV_32FC1 descriptors");
+    }
+
+    nodes.clear();
+    nwords_ = 0;
+    centers = cv::Mat::zeros(1, descriptors.cols, CV_32FC1);
+
+    Node root;
+    root.first_child = 0;
+    root.nchildren = 0;
+    root.word = -1;
+    nodes.push_back(root);
+
+    std::vector<int> ids(descriptors.rows);
+    for (int i = 0; i < descriptors.rows; ++i) {
+        ids[i] = i;
+    }
+    trainNode(0, descriptors, ids, 0);
+}
+
+void phg::VocabularyTree::trainNode(int node, const cv::Mat &descriptors, const std::vector<int> &ids, int level)
+{
+    if (level == depth || (int) ids.size() <= branching) {
+        nodes[node].word = nwords_++;
+        return;
+    }
+
+    cv::Mat data((int) ids.size(), descriptors.cols, CV_32FC1);
+    for (int i = 0; i < (int) ids.size(); ++i) {
+        descriptors.row(ids[i]).copyTo(data.row(i));
+    }
+
+    cv::Mat labels;
+    cv::Mat node_centers = trainKMeans(data, branching, 16, &labels);
+
+    // NB: nodes может реаллоцироваться при добавлении детей, поэтому дальше обращаемся только по индексу
+    const int first_child = (int) nodes.size();
+    nodes[node].first_child = first_child;
+    nodes[node].nchildren = branching;
+    for (int c = 0; c < branching; ++c) {
+        Node child;
+        child.first_child = 0;
+        child.nchildren = 0;
+        child.word = -1;
+        nodes.push_back(child);
+    }
+    centers.push_back(node_centers);
+
+    std::vector<std::vector<int>> children_ids(branching);
+    for (int i = 0; i < (int) ids.size(); ++i) {
+        children_ids[labels.at<int>(i)].push_back(ids[i]);
+    }
+    for (int c = 0; c < branching; ++c) {
+        trainNode(first_child + c, descriptors, children_ids[c], level + 1);
+    }
+}
+
+void phg::VocabularyTree::save(const std::string &path) const
+{
+    if (empty()) {
+        throw std::runtime_error("VocabularyTree:: save : vocabulary is not trained");
+    }
+
+    std::ofstream out(path, std::ios::binary);
+    if (!out) {
+        throw std::runtime_error("VocabularyTree:: save : can't open file " + path);
+    }
+
+    out.write(vocabulary_magic, sizeof(vocabulary_magic));
+    writeValue(out, (int32_t) branching);
+    writeValue(out, (int32_t) depth);
+    writeValue(out, (int32_t) centers.cols);
+    writeValue(out, (int32_t) nodes.size());
+    writeValue(out, (int32_t) nwords_);
+    for (const Node &node : nodes) {
+        writeValue(out, (int32_t) node.first_child);
+        writeValue(out, (int32_t) node.nchildren);
+        writeValue(out, (int32_t) node.word);
+    }
+    rassert(centers.isContinuous() && centers.rows == (int) nodes.size(), 2385912395012);
+    out.write((const char *) centers.ptr<float>(), centers.total() * sizeof(float));
+
+    if (!out) {
+        throw std::runtime_error("VocabularyTree:: save : failed to write " + path);
+    }
+}
+
+void phg::VocabularyTree::load(const std::string &path)
+{
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        throw std::runtime_error("VocabularyTree:: load : can't open file " + path);
+    }
+
+    char magic[sizeof(vocabulary_magic)];
+    in.read(magic, sizeof(magic));
+    if (!in || std::memcmp(magic, vocabulary_magic, sizeof(magic)) != 0) {
+        throw std::runtime_error("VocabularyTree:: load : not a vocabulary file " + path);
+    }
+
+    int32_t branching_value, depth_value, ndim, nnodes, nwords_value;
+    readValue(in, branching_value);
+    readValue(in, depth_value);
+    readValue(in, ndim);
+    readValue(in, nnodes);
+    readValue(in, nwords_value);
+    if (!in || branching_value < 2 || depth_value < 1 || ndim <= 0 || nnodes <= 0 || nwords_value <= 0) {
+        throw std::runtime_error("VocabularyTree:: load : corrupted header in " + path);
+    }
+
+    // файл мог быть испорчен - проверяем что это дерево той же формы что строит train:
+    // у каждого узла кроме корня ровно один родитель, дети лежат после родителя (поэтому спуск в quantize конечен),
+    // у внутренних узлов branching детей и глубина не больше depth, у листьев - корректный номер слова
+    std::vector<Node> loaded_nodes(nnodes);
+    std::vector<int> levels(nnodes, -1);
+    levels[0] = 0;
+    for (int i = 0; i < nnodes; ++i) {
+        int32_t first_child, nchildren, word;
+        readValue(in, first_child);
+        readValue(in, nchildren);
+        readValue(in, word);
+        if (!in || levels[i] < 0) {
+            throw std::runtime_error("VocabularyTree:: load : corrupted tree in " + path);
+        }
+        if (nchildren == 0) {
+            if (word < 0 || word >= nwords_value) {
+                throw std::runtime_error("VocabularyTree:: load : corrupted tree in " + path);
+            }
+        } else {
+            if (nchildren != branching_value || word != -1 || levels[i] >= depth_value
+                || first_child <= i || (int64_t) first_child + nchildren > nnodes) {
+                throw std::runtime_error("VocabularyTree:: load : corrupted tree in " + path);
+            }
+            for (int c = first_child; c < first_child + nchildren; ++c) {
+                if (levels[c] >= 0) {
+                    throw std::runtime_error("VocabularyTree:: load : corrupted tree in " + path);
+                }
+                levels[c] = levels[i] + 1;
+            }
+        }
+        loaded_nodes[i].first_child = first_child;
+        loaded_nodes[i].nchildren = nchildren;
+        loaded_nodes[i].word = word;
+    }
+
+    cv::Mat loaded_centers(nnodes, ndim, CV_32FC1);
+    in.read((char *) loaded_centers.ptr<float>(), loaded_centers.total() * sizeof(float));
+    if (!in) {
+        throw std::runtime_error("VocabularyTree:: load : unexpected end of file " + path);
+    }
+
+    branching = branching_value;
+    depth = depth_value;
+    nwords_ = nwords_value;
+    nodes.swap(loaded_nodes);
+    centers = loaded_centers;
+}
+
+bool phg::VocabularyTree::empty() const
+{
+    return nwords_ == 0;
+}
+
+int phg::VocabularyTree::nwords() const
+{
+    return nwords_;
+}
+
+void phg::VocabularyTree::quantize(const cv::Mat &descriptors, std::vector<int> &words) const
+{
+    if (empty()) {
+        throw std::runtime_error("VocabularyTree:: quantize : vocabulary is not trained");
+    }
+    if (descriptors.type() != CV_32FC1 || descriptors.cols != centers.cols) {
+        throw std::runtime_error("VocabularyTree:: quantize : descriptors type mismatch");
+    }
+
+    const int ndesc = descriptors.rows;
+    words.resize(ndesc);
+
+    #pragma omp parallel for
+    for (int i = 0; i < ndesc; ++i) {
+        const float *x = descriptors.ptr<float>(i);
+
+        int node = 0;
+        while (nodes[node].nchildren > 0) {
+            int best = nodes[node].first_child;
+            float best_dist = std::numeric_limits<float>::max();
+            for (int c = nodes[node].first_child; c < nodes[node].first_child + nodes[node].nchildren; ++c) {
+                float dist = l2sqr(x, centers.ptr<float>(c), centers.cols);
+                if (dist < best_dist) {
+                    best_dist = dist;
+                    best = c;
+                }
+            }
+            node = best;
+        }
+        words[i] = nodes[node].word;
+    }
+}
+
+phg::ImageRetrieval::ImageRetrieval(const VocabularyTree &vocabulary)
+    : vocabulary(vocabulary)
+    , built(false)
+{
+    if (vocabulary.empty()) {
+        throw std::runtime_error("ImageRetrieval:: vocabulary is not trained");
+    }
+}
+
+int phg::ImageRetrieval::addImage(const cv::Mat &descriptors)
+{
+    std::vector<int> words;
+    vocabulary.quantize(descriptors, words);
+    std::sort(words.begin(), words.end());
+
+    SparseVector tf;
+    for (size_t i = 0; i < words.size();) {
+        size_t j = i;
+        while (j < words.size() && words[j] == words[i]) {
+            ++j;
+        }
+        tf.push_back(std::make_pair(words[i], (float) (j - i) / words.size()));
+        i = j;
+    }
+
+    images_tf.push_back(tf);
+    built = false;
+    return (int) images_tf.size() - 1;
+}
+
+void phg::ImageRetrieval::build()
+{
+    const int n = nimages();
+    const int nwords = vocabulary.nwords();
+
+    // слово встречающееся на всех картинках ничего не говорит о похожести: idf = log(N / N_i)
+    std::vector<int> document_frequency(nwords, 0);
+    for (const SparseVector &tf : images_tf) {
+        for (const auto &entry : tf) {
+            ++document_frequency[entry.first];
+        }
+    }
+
+    images_weights.assign(n, SparseVector());
+    inverted_index.assign(nwords, std::vector<std::pair<int, float>>());
+    for (int i = 0; i < n; ++i) {
+        SparseVector &weights = images_weights[i];
+        double sum = 0;
+        for (const auto &entry : images_tf[i]) {
+            float w = entry.second * (float) std::log((double) n / document_frequency[entry.first]);
+            if (w > 0) {
+                weights.push_back(std::make_pair(entry.first, w));
+                sum += w;
+            }
+        }
+        for (auto &entry : weights) {
+            entry.second /= sum;
+            inverted_index[entry.first].push_back(std::make_pair(i, entry.second));
+        }
+    }
+
+    built = true;
+}
+
+void phg::ImageRetrieval::query(int image, int top_k, std::vector<std::pair<int, float>> &results) const
+{
+    if (!built) {
+        throw std::runtime_error("ImageRetrieval:: query : build() should be called after adding images");
+    }
+    if (image < 0 || image >= nimages()) {
+        throw std::runtime_error("ImageRetrieval:: query : invalid image");
+    }
+
+    // для L1-нормированных векторов |q - d|_1 = 2 - 2 * sum_i min(q_i, d_i), ненулевой вклад только у общих слов
+    std::vector<float> scores(nimages(), 0.f);
+    for (const auto &entry : images_weights[image]) {
+        for (const auto &posting : inverted_index[entry.first]) {
+            scores[posting.first] += std::min(entry.second, posting.second);
+        }
+    }
+
+    results.clear();
+    for (int i = 0; i < nimages(); ++i) {
+        if (i != image && scores[i] > 0) {
+            results.push_back(std::make_pair(i, scores[i]));
+        }
+    }
+
+    std::sort(results.begin(), results.end(), [](const std::pair<int, float> &a, const std::pair<int, float> &b) {
+        return a.second > b.second || (a.second == b.second && a.first < b.first);
+    });
+    if ((int) results.size() > top_k) {
+        results.resize(top_k);
+    }
+}
+
+void phg::ImageRetrieval::selectPairs(int top_k, std::vector<std::pair<int, int>> &pairs) const
+{
+    pairs.clear();
+
+    std::vector<std::pair<int, float>> results;
+    for (int i = 0; i < nimages(); ++i) {
+        query(i, top_k, results);
+        for (const auto &result : results) {
+            pairs.push_back(std::make_pair(std::min(i, result.first), std::max(i, result.first)));
+        }
+    }
+
+    std::sort(pairs.begin(), pairs.end());
+    pairs.erase(std::unique(pairs.begin(), pairs.end()), pairs.end());
+}
+
+int phg::ImageRetrieval::nimages() const
+{
+    return (int) images_tf.size();
+}
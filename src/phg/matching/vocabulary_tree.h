@@ -0,0 +1,76 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <opencv2/core.hpp>
+
+namespace phg {
+
+    // Nister, Stewenius: "Scalable Recognition with a Vocabulary Tree" (2006)
+    // иерархический k-means: branching^depth визуальных слов (листьев), квантование дескриптора - спуск от корня за branching*depth сравнений
+    class VocabularyTree {
+    public:
+        VocabularyTree(int branching = 10, int depth = 4);
+
+        // обучение на выборке дескрипторов (обычно - со многих картинок), делается один раз оффлайн
+        void train(const cv::Mat &descriptors);
+
+        void save(const std::string &path) const;
+        void load(const std::string &path);
+
+        bool empty() const;
+        int nwords() const;
+
+        // номер визуального слова для каждого дескриптора
+        void quantize(const cv::Mat &descriptors, std::vector<int> &words) const;
+
+    private:
+
+        struct Node {
+            int first_child; // дети узла лежат подряд: [first_child, first_child + nchildren)
+            int nchildren;   // 0 у листа
+            int word;        // номер слова у листа, -1 у внутренних узлов
+        };
+
+        void trainNode(int node, const cv::Mat &descriptors, const std::vector<int> &ids, int level);
+
+        int branching;
+        int depth;
+
+        std::vector<Node> nodes;  // nodes[0] - корень
+        cv::Mat centers;          // центр каждого узла (у корня не используется)
+        int nwords_;
+    };
+
+    // поиск похожих картинок по TF-IDF взвешенным гистограммам визуальных слов (L1 нормировка, инвертированный индекс по словам)
+    class ImageRetrieval {
+    public:
+        ImageRetrieval(const VocabularyTree &vocabulary);
+
+        // возвращает номер картинки в базе
+        int addImage(const cv::Mat &descriptors);
+
+        // пересчитывает IDF веса и инвертированный индекс, нужно вызвать после добавления всех картинок
+        void build();
+
+        // top_k самых похожих картинок (кроме нее самой) в порядке убывания похожести, похожесть в диапазоне [0, 1]
+        void query(int image, int top_k, std::vector<std::pair<int, float>> &results) const;
+
+        // неупорядоченные пары (i < j) таких что j среди top_k похожих на i или наоборот
+        void selectPairs(int top_k, std::vector<std::pair<int, int>> &pairs) const;
+
+        int nimages() const;
+
+    private:
+
+        typedef std::vector<std::pair<int, float>> SparseVector; // (слово, вес) по возрастанию слова
+
+        const VocabularyTree &vocabulary;
+
+        std::vector<SparseVector> images_tf;                            // частоты слов в каждой картинке
+        std::vector<SparseVector> images_weights;                       // L1-нормированные TF-IDF веса (считаются в build())
+        std::vector<std::vector<std::pair<int, float>>> inverted_index; // слово -> (картинка, вес)
+        bool built;
+    };
+
+}
@@ -1,7 +1,9 @@
 #include "fmatrix.h"
 #include "sfm_utils.h"
 #include "defines.h"
+#include "ransac.h"
 
+#include <limits>
 #include <iostream>
 #include <Eigen/SVD>
 #include <opencv2/calib3d.hpp>
@@ -120,89 +122,109 @@ namespace {
         return cv::Vec2d(tmp[0] / tmp[2], tmp[1] / tmp[2]);
     }
 
-    cv::Matx33d estimateFMatrixRANSAC(const std::vector<cv::Vec2d> &m0, const std::vector<cv::Vec2d> &m1, double threshold_px, bool verbose=true)
-    {
-        if (m0.size() != m1.size()) {
-            throw std::runtime_error("estimateFMatrixRANSAC: m0.size() != m1.size()");
-        }
+    // минимальная выборка - 8 пар точек, решение ищется в нормализованных координатах и денормализуется,
+    // невязка - наибольшее из расстояний до эпиполярных линий на обеих картинках
+    class FMatrixEstimator {
+    public:
+        typedef cv::Matx33d Model;
+        static const int sample_size = 8;
 
-        const int n_matches = m0.size();
+        FMatrixEstimator(const std::vector<cv::Vec2d> &m0, const std::vector<cv::Vec2d> &m1, bool verbose)
+            : m0(m0)
+            , m1(m1)
+        {
+            const int n_matches = m0.size();
 
-        cv::Matx33d TN0 = getNormalizeTransform(m0, verbose);
-        cv::Matx33d TN1 = getNormalizeTransform(m1, verbose);
+            TN0 = getNormalizeTransform(m0, verbose);
+            TN1 = getNormalizeTransform(m1, verbose);
 
-        std::vector<cv::Vec2d> m0_t(n_matches);
-        std::vector<cv::Vec2d> m1_t(n_matches);
-        for (int i = 0; i < n_matches; ++i) {
-            m0_t[i] = transformPoint(m0[i], TN0);
-            m1_t[i] = transformPoint(m1[i], TN1);
+            m0_t.resize(n_matches);
+            m1_t.resize(n_matches);
+            for (int i = 0; i < n_matches; ++i) {
+                m0_t[i] = transformPoint(m0[i], TN0);
+                m1_t[i] = transformPoint(m1[i], TN1);
+            }
+
+            {
+//                 check log: centroid should become close to zero, scale close to 1
+                getNormalizeTransform(m0_t, verbose);
+                getNormalizeTransform(m1_t, verbose);
+            }
         }
 
+        int size() const
         {
-//             check log: centroid should become close to zero, scale close to 1
-            getNormalizeTransform(m0_t, verbose);
-            getNormalizeTransform(m1_t, verbose);
+            return (int) m0.size();
         }
 
-        // https://en.wikipedia.org/wiki/Random_sample_consensus#Parameters
-        // будет отличаться от случая с гомографией
-        const int n_trials = 10000;
-
-        const int n_samples = 8;
-        uint64_t seed = 1;
-
-        int best_support = 0;
-        cv::Matx33d best_F;
-
-        std::vector<int> sample;
-        for (int i_trial = 0; i_trial < n_trials; ++i_trial) {
-            phg::randomSample(sample, n_matches, n_samples, &seed);
-
-            cv::Vec2d ms0[n_samples];
-            cv::Vec2d ms1[n_samples];
-            for (int i = 0; i < n_samples; ++i) {
+        bool estimate(const std::vector<int> &sample, Model &F) const
+        {
+            cv::Vec2d ms0[sample_size];
+            cv::Vec2d ms1[sample_size];
+            for (int i = 0; i < sample_size; ++i) {
                 ms0[i] = m0_t[sample[i]];
                 ms1[i] = m1_t[sample[i]];
             }
 
-            cv::Matx33d F = estimateFMatrixDLT(ms0, ms1, n_samples);
+            F = estimateFMatrixDLT(ms0, ms1, sample_size);
 
             // denormalize
             F = TN1.t() * F * TN0;
+            return true;
+        }
 
-            int support = 0;
-            for (int i = 0; i < n_matches; ++i) {
-                //                    todo todo todo                                                         todo todo todo
-                if (phg::epipolarTest(m0[i], m1[i], F, threshold_px) && phg::epipolarTest(m1[i], m0[i], F.t(), threshold_px))
-                {
-                    ++support;
-                }
-            }
+        double residual2(const Model &F, int i) const
+        {
+            // то же что phg::epipolarTest в обе стороны, но в виде квадрата расстояния
+            return std::max(epipolarDist2(m0[i], m1[i], F), epipolarDist2(m1[i], m0[i], F.t()));
+        }
 
-            if (support > best_support) {
-                best_support = support;
-                best_F = F;
+    private:
+        static double epipolarDist2(const cv::Vec2d &pt0, const cv::Vec2d &pt1, const cv::Matx33d &F)
+        {
+            cv::Vec3d l1 = F * cv::Vec3d(pt0[0], pt0[1], 1.0);
+            double s1 = l1[0] * l1[0] + l1[1] * l1[1];
+            double d1 = l1[0] * pt1[0] + l1[1] * pt1[1] + l1[2];
+            if (s1 == 0) {
+                return std::numeric_limits<double>::max();
+            }
+            return d1 * d1 / s1;
+        }
 
-                if (verbose) {
-                    std::cout << "estimateFMatrixRANSAC : support: " << best_support << "/" << n_matches << std::endl;
-                    infoF(F);
-                }
+        const std::vector<cv::Vec2d> &m0;
+        const std::vector<cv::Vec2d> &m1;
+        std::vector<cv::Vec2d> m0_t;
+        std::vector<cv::Vec2d> m1_t;
+        cv::Matx33d TN0;
+        cv::Matx33d TN1;
+    };
 
-                if (best_support == n_matches) {
-                    break;
-                }
-            }
+    cv::Matx33d estimateFMatrixRANSAC(const std::vector<cv::Vec2d> &m0, const std::vector<cv::Vec2d> &m1, double threshold_px, bool verbose=true)
+    {
+        if (m0.size() != m1.size()) {
+            throw std::runtime_error("estimateFMatrixRANSAC: m0.size() != m1.size()");
         }
 
+        const int n_matches = m0.size();
+
+        FMatrixEstimator estimator(m0, m1, verbose);
+        phg::RansacParams params(threshold_px);
+        phg::Ransac<FMatrixEstimator> ransac(params);
+        phg::Ransac<FMatrixEstimator>::Result result;
+        bool found = ransac.run(estimator, result);
+
         if (verbose) {
-            std::cout << "estimateFMatrixRANSAC : best support: " << best_support << "/" << n_matches << std::endl;
+            std::cout << "estimateFMatrixRANSAC : best support: " << result.support << "/" << n_matches << ", trials: " << result.trials << std::endl;
+            if (found) {
+                infoF(result.model);
+            }
         }
 
-        if (best_support == 0) {
+        if (!found) {
             throw std::runtime_error("estimateFMatrixRANSAC : failed to estimate fundamental matrix");
         }
 
-        return best_F;
+        return result.model;
     }
 
 }
@@ -1,7 +1,9 @@
 #include "homography.h"
+#include "ransac.h"
 
 #include <opencv2/calib3d/calib3d.hpp>
 #include <iostream>
+#include <limits>
 
 namespace {
 
@@ -121,39 +123,58 @@ namespace {
         return H_mat;
     }
 
-    // pseudorandom number generator
-    inline uint64_t xorshift64(uint64_t *state)
-    {
-        if (*state == 0) {
-            *state = 1;
-        }
+    // минимальная выборка - 4 пары точек, невязка - ошибка репроекции левой точки в правую картинку
+    class HomographyEstimator {
+    public:
+        typedef cv::Matx33d Model;
+        static const int sample_size = 4;
 
-        uint64_t x = *state;
-        x ^= x << 13;
-        x ^= x >> 7;
-        x ^= x << 17;
-        return *state = x;
-    }
+        HomographyEstimator(const std::vector<cv::Point2f> &points_lhs, const std::vector<cv::Point2f> &points_rhs)
+            : points_lhs(points_lhs)
+            , points_rhs(points_rhs)
+        {}
 
-    void randomSample(std::vector<int> &dst, int max_id, int sample_size, uint64_t *state)
-    {
-        dst.clear();
+        int size() const
+        {
+            return (int) points_lhs.size();
+        }
 
-        const int max_attempts = 1000;
+        bool estimate(const std::vector<int> &sample, Model &H) const
+        {
+            cv::Mat H_mat;
+            try {
+                H_mat = estimateHomography4Points(points_lhs[sample[0]], points_lhs[sample[1]], points_lhs[sample[2]], points_lhs[sample[3]],
+                                                  points_rhs[sample[0]], points_rhs[sample[1]], points_rhs[sample[2]], points_rhs[sample[3]]);
+            } catch (const std::exception &) {
+                // вырожденная выборка (например три точки на одной прямой)
+                return false;
+            }
 
-        for (int i = 0; i < sample_size; ++i) {
-            for (int k = 0; k < max_attempts; ++k) {
-                int v = xorshift64(state) % max_id;
-                if (dst.empty() || std::find(dst.begin(), dst.end(), v) == dst.end()) {
-                    dst.push_back(v);
-                    break;
+            for (int r = 0; r < 3; ++r) {
+                for (int c = 0; c < 3; ++c) {
+                    H(r, c) = H_mat.at<double>(r, c);
                 }
             }
-            if (dst.size() < i + 1) {
-                throw std::runtime_error("Failed to sample ids");
+            return true;
+        }
+
+        double residual2(const Model &H, int i) const
+        {
+            const cv::Point2f &l = points_lhs[i];
+            const cv::Point2f &r = points_rhs[i];
+            cv::Vec3d proj = H * cv::Vec3d(l.x, l.y, 1.0);
+            if (proj[2] == 0) {
+                return std::numeric_limits<double>::max();
             }
+            double dx = proj[0] / proj[2] - r.x;
+            double dy = proj[1] / proj[2] - r.y;
+            return dx * dx + dy * dy;
         }
-    }
+
+    private:
+        const std::vector<cv::Point2f> &points_lhs;
+        const std::vector<cv::Point2f> &points_rhs;
+    };
 
     cv::Mat estimateHomographyRANSAC(const std::vector<cv::Point2f> &points_lhs, const std::vector<cv::Point2f> &points_rhs)
     {
@@ -169,56 +190,20 @@ namespace {
 
         const int n_matches = points_lhs.size();
 
-        // https://en.wikipedia.org/wiki/Random_sample_consensus#Parameters
-        const int n_samples = 4;
-        const double prob_success = 0.9;
-        const double inliers_ratio = 0.5;
-        const int n_trials = (int) (log(1 - prob_success) / log(1 - pow(inliers_ratio, n_samples)));
-        std::cout << "n_trials = " << n_trials << "\n";
-        uint64_t seed = 1;
         const double reprojection_error_threshold_px = 2;
 
-        int best_support = 0;
-        cv::Mat best_H;
-
-        std::vector<int> sample;
-        for (int i_trial = 0; i_trial < n_trials; ++i_trial) {
-            randomSample(sample, n_matches, n_samples, &seed);
-
-            cv::Mat H = estimateHomography4Points(points_lhs[sample[0]], points_lhs[sample[1]], points_lhs[sample[2]], points_lhs[sample[3]],
-                                                  points_rhs[sample[0]], points_rhs[sample[1]], points_rhs[sample[2]], points_rhs[sample[3]]);
-
-            int support = 0;
-            for (int i_point = 0; i_point < n_matches; ++i_point) {
-                try {
-                    cv::Point2d proj = phg::transformPoint(points_lhs[i_point], H);
-                    if (cv::norm(proj - cv::Point2d(points_rhs[i_point])) < reprojection_error_threshold_px) {
-                        ++support;
-                    }
-                } catch (const std::exception &e)
-                {
-                    std::cerr << e.what() << std::endl;
-                }
-            }
-
-            if (support > best_support) {
-                best_support = support;
-                best_H = H;
-
-                std::cout << "estimateHomographyRANSAC : support: " << best_support << "/" << n_matches << std::endl;
-
-                if (best_support == n_matches) {
-                    break;
-                }
-            }
-        }
+        HomographyEstimator estimator(points_lhs, points_rhs);
+        phg::RansacParams params(reprojection_error_threshold_px);
+        phg::Ransac<HomographyEstimator> ransac(params);
+        phg::Ransac<HomographyEstimator>::Result result;
+        bool found = ransac.run(estimator, result);
 
-        std::cout << "estimateHomographyRANSAC : best support: " << best_support << "/" << n_matches << std::endl;
+        std::cout << "estimateHomographyRANSAC : best support: " << result.support << "/" << n_matches << ", trials: " << result.trials << std::endl;
 
-        if (best_support == 0) {
+        if (!found) {
             throw std::runtime_error("estimateHomographyRANSAC : failed to estimate homography");
         }
-        return best_H;
+        return cv::Mat(result.model);
     }
 }
 
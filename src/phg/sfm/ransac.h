@@ -0,0 +1,171 @@
+#pragma once
+
+#include <cmath>
+#include <limits>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <stdexcept>
+
+#include "sfm_utils.h"
+
+namespace phg {
+
+    // общий RANSAC для оценки моделей по соответствиям (F, H, P, ...)
+    // Estimator описывает задачу:
+    //     typedef ... Model;
+    //     static const int sample_size;                                         // размер минимальной выборки
+    //     int size() const;                                                     // число соответствий
+    //     bool estimate(const std::vector<int> &sample, Model &model) const;    // минимальный решатель, false - вырожденная выборка
+    //     double residual2(const Model &model, int i) const;                    // квадрат невязки i-го соответствия
+    // остальные части подставляются шаблонными параметрами: Scorer, Sampler, Termination (см. ниже)
+
+    struct RansacParams {
+        RansacParams(double threshold, int max_trials = 10000, double confidence = 0.999, uint64_t seed = 1)
+            : threshold(threshold)
+            , max_trials(max_trials)
+            , confidence(confidence)
+            , seed(seed)
+        {}
+
+        double threshold;   // порог невязки в единицах Estimator::residual2 (без квадрата)
+        int max_trials;
+        double confidence;  // требуемая вероятность хотя бы раз выбрать выборку без выбросов
+        uint64_t seed;
+    };
+
+    // стоимость соответствия по квадрату невязки, лучше модель с меньшей суммарной стоимостью
+    // классический RANSAC: число выбросов (т.е. максимизация числа инлаеров)
+    struct RansacScorer {
+        double cost(double residual2, double threshold2) const
+        {
+            return residual2 < threshold2 ? 0.0 : 1.0;
+        }
+    };
+
+    // MSAC: инлаеры штрафуются по невязке, выбросы - порогом, при равном числе инлаеров выигрывает более точная модель
+    struct MsacScorer {
+        double cost(double residual2, double threshold2) const
+        {
+            return std::min(residual2, threshold2);
+        }
+    };
+
+    // равномерные выборки без повторов, детерминированы seed
+    class UniformSampler {
+    public:
+        void reset(uint64_t seed)
+        {
+            state = seed;
+        }
+
+        void sample(std::vector<int> &dst, int n, int sample_size)
+        {
+            randomSample(dst, n, sample_size, &state);
+        }
+
+    private:
+        uint64_t state = 1;
+    };
+
+    // адаптивное число итераций: сколько выборок нужно чтобы при текущей доле инлаеров
+    // с вероятностью confidence хотя бы одна оказалась без выбросов
+    // https://en.wikipedia.org/wiki/Random_sample_consensus#Parameters
+    struct ConfidenceTermination {
+        int maxTrials(int n_inliers, int n_points, int sample_size, const RansacParams &params) const
+        {
+            if (n_inliers >= n_points) {
+                return 0;
+            }
+            const double inliers_ratio = (double) n_inliers / n_points;
+            const double p_good_sample = std::pow(inliers_ratio, sample_size);
+            if (p_good_sample <= 0.0) {
+                return params.max_trials;
+            }
+            const double trials = std::log(1.0 - params.confidence) / std::log(1.0 - p_good_sample);
+            if (!(trials < params.max_trials)) {
+                return params.max_trials;
+            }
+            return (int) std::ceil(trials);
+        }
+    };
+
+    template <typename Estimator, typename Scorer = MsacScorer, typename Sampler = UniformSampler, typename Termination = ConfidenceTermination>
+    class Ransac {
+    public:
+        typedef typename Estimator::Model Model;
+
+        struct Result {
+            Model model;
+            int support = 0;  // число инлаеров лучшей модели
+            double cost = std::numeric_limits<double>::max();
+            int trials = 0;   // сколько выборок было перебрано
+        };
+
+        Ransac(const RansacParams &params, const Scorer &scorer = Scorer(), const Sampler &sampler = Sampler(), const Termination &termination = Termination())
+            : params(params)
+            , scorer(scorer)
+            , sampler(sampler)
+            , termination(termination)
+        {
+            if (params.threshold <= 0 || params.max_trials <= 0 || params.confidence <= 0 || params.confidence >= 1) {
+                throw std::runtime_error("Ransac:: invalid parameters");
+            }
+        }
+
+        // false если ни одна выборка не дала модели хотя бы с одним инлаером
+        bool run(const Estimator &estimator, Result &result)
+        {
+            const int n_points = estimator.size();
+            const int sample_size = Estimator::sample_size;
+            const double threshold2 = params.threshold * params.threshold;
+
+            result = Result();
+            if (n_points < sample_size) {
+                return false;
+            }
+
+            sampler.reset(params.seed);
+
+            int max_trials = params.max_trials;
+            std::vector<int> sample;
+            Model model;
+            for (int i_trial = 0; i_trial < max_trials; ++i_trial) {
+                ++result.trials;
+
+                sampler.sample(sample, n_points, sample_size);
+                if (!estimator.estimate(sample, model)) {
+                    continue;
+                }
+
+                // стоимость только растет - как только превысили лучшую, модель можно не досчитывать
+                double cost = 0.0;
+                int support = 0;
+                for (int i = 0; i < n_points && cost < result.cost; ++i) {
+                    const double residual2 = estimator.residual2(model, i);
+                    cost += scorer.cost(residual2, threshold2);
+                    if (residual2 < threshold2) {
+                        ++support;
+                    }
+                }
+
+                if (cost < result.cost && support > 0) {
+                    result.model = model;
+                    result.support = support;
+                    result.cost = cost;
+
+                    max_trials = std::min(max_trials, termination.maxTrials(support, n_points, sample_size, params));
+                }
+            }
+
+            return result.support > 0;
+        }
+
+    private:
+        RansacParams params;
+        Scorer scorer;
+        Sampler sampler;
+        Termination termination;
+    };
+
+}
@@ -1,9 +1,11 @@
 #include "resection.h"
 
+#include <limits>
 #include <Eigen/SVD>
 #include <iostream>
 #include "sfm_utils.h"
 #include "defines.h"
+#include "ransac.h"
 
 namespace {
 
@@ -80,70 +82,76 @@ namespace {
     }
 
 
-    cv::Matx34d estimateCameraMatrixRANSAC(const phg::Calibration &calib, const std::vector<cv::Vec3d> &X, const std::vector<cv::Vec2d> &x, bool verbose)
-    {
-        if (X.size() != x.size()) {
-            throw std::runtime_error("estimateCameraMatrixRANSAC: X.size() != x.size()");
-        }
-
-        const int n_points = X.size();
+    // минимальная выборка - 6 пар 3D-2D, невязка - ошибка репроекции в пикселях
+    class CameraMatrixEstimator {
+    public:
+        typedef cv::Matx34d Model;
+        static const int sample_size = 6;
 
-        // https://en.wikipedia.org/wiki/Random_sample_consensus#Parameters
-        // будет отличаться от случая с гомографией
-        const int n_trials = 10000;
+        CameraMatrixEstimator(const phg::Calibration &calib, const std::vector<cv::Vec3d> &X, const std::vector<cv::Vec2d> &x)
+            : calib(calib)
+            , X(X)
+            , x(x)
+        {}
 
-        const double threshold_px = 3;
-
-        const int n_samples = 6;
-        uint64_t seed = 1;
-
-        int best_support = 0;
-        cv::Matx34d best_P;
-
-        std::vector<int> sample;
-        for (int i_trial = 0; i_trial < n_trials; ++i_trial) {
-            phg::randomSample(sample, n_points, n_samples, &seed);
+        int size() const
+        {
+            return (int) X.size();
+        }
 
-            cv::Vec3d ms0[n_samples];
-            cv::Vec3d ms1[n_samples];
-            for (int i = 0; i < n_samples; ++i) {
+        bool estimate(const std::vector<int> &sample, Model &P) const
+        {
+            cv::Vec3d ms0[sample_size];
+            cv::Vec3d ms1[sample_size];
+            for (int i = 0; i < sample_size; ++i) {
                 ms0[i] = X[sample[i]];
                 ms1[i] = calib.unproject(x[sample[i]]);
             }
 
-            cv::Matx34d P = estimateCameraMatrixDLT(ms0, ms1, n_samples);
-
-            int support = 0;
-            for (int i = 0; i < n_points; ++i) {
-                cv::Vec3d pt = calib.project(P * cv::Vec4d(X[i][0], X[i][1], X[i][2], 1.0));
-                if (pt[2] == 0) {
-                    continue;
-                }
-                cv::Vec2d px = {pt[0] / pt[2], pt[1] / pt[2]};
-                if (cv::norm(px - x[i]) < threshold_px) {
-                    ++support;
-                }
-            }
+            P = estimateCameraMatrixDLT(ms0, ms1, sample_size);
+            return true;
+        }
 
-            if (support > best_support) {
-                best_support = support;
-                best_P = P;
+        double residual2(const Model &P, int i) const
+        {
+            cv::Vec3d pt = calib.project(P * cv::Vec4d(X[i][0], X[i][1], X[i][2], 1.0));
+            if (pt[2] == 0) {
+                return std::numeric_limits<double>::max();
+            }
+            cv::Vec2d px = {pt[0] / pt[2], pt[1] / pt[2]};
+            cv::Vec2d d = px - x[i];
+            return d[0] * d[0] + d[1] * d[1];
+        }
 
-                if (verbose) std::cout << "estimateCameraMatrixRANSAC : support: " << best_support << "/" << n_points << std::endl;
+    private:
+        const phg::Calibration &calib;
+        const std::vector<cv::Vec3d> &X;
+        const std::vector<cv::Vec2d> &x;
+    };
 
-                if (best_support == n_points) {
-                    break;
-                }
-            }
+    cv::Matx34d estimateCameraMatrixRANSAC(const phg::Calibration &calib, const std::vector<cv::Vec3d> &X, const std::vector<cv::Vec2d> &x, bool verbose)
+    {
+        if (X.size() != x.size()) {
+            throw std::runtime_error("estimateCameraMatrixRANSAC: X.size() != x.size()");
         }
 
-        if (verbose) std::cout << "estimateCameraMatrixRANSAC : best support: " << best_support << "/" << n_points << std::endl;
+        const int n_points = X.size();
+
+        const double threshold_px = 3;
+
+        CameraMatrixEstimator estimator(calib, X, x);
+        phg::RansacParams params(threshold_px);
+        phg::Ransac<CameraMatrixEstimator> ransac(params);
+        phg::Ransac<CameraMatrixEstimator>::Result result;
+        bool found = ransac.run(estimator, result);
+
+        if (verbose) std::cout << "estimateCameraMatrixRANSAC : best support: " << result.support << "/" << n_points << ", trials: " << result.trials << std::endl;
 
-        if (best_support == 0) {
+        if (!found) {
             throw std::runtime_error("estimateCameraMatrixRANSAC : failed to estimate camera matrix");
         }
 
-        return best_P;
+        return result.model;
     }
 
 
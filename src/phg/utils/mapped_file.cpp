@@ -0,0 +1,154 @@
+#include "mapped_file.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#if defined _WIN32 || defined _WIN64
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+
+#if defined _WIN32 || defined _WIN64
+
+phg::MappedFile::MappedFile(const std::string &path)
+    : path_(path)
+    , data_(nullptr)
+    , size_(0)
+    , file_handle(INVALID_HANDLE_VALUE)
+    , mapping_handle(nullptr)
+{
+    file_handle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file_handle == INVALID_HANDLE_VALUE) {
+        throw std::runtime_error("MappedFile:: can't open file " + path);
+    }
+
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file_handle, &file_size)) {
+        CloseHandle(file_handle);
+        throw std::runtime_error("MappedFile:: can't get size of file " + path);
+    }
+    size_ = (size_t) file_size.QuadPart;
+    if (size_ == 0) {
+        return;
+    }
+
+    mapping_handle = CreateFileMappingA(file_handle, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping_handle == nullptr) {
+        CloseHandle(file_handle);
+        throw std::runtime_error("MappedFile:: can't map file " + path);
+    }
+
+    data_ = (const char *) MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0);
+    if (data_ == nullptr) {
+        CloseHandle(mapping_handle);
+        CloseHandle(file_handle);
+        throw std::runtime_error("MappedFile:: can't map file " + path);
+    }
+}
+
+phg::MappedFile::~MappedFile()
+{
+    if (data_) {
+        UnmapViewOfFile(data_);
+    }
+    if (mapping_handle) {
+        CloseHandle(mapping_handle);
+    }
+    CloseHandle(file_handle);
+}
+
+void phg::MappedFile::prefetch(size_t offset, size_t size) const
+{}
+
+void phg::MappedFile::evict(size_t offset, size_t size) const
+{}
+
+#else
+
+namespace {
+
+    // madvise принимает только адрес выровненный на страницу
+    bool pageRange(const char *data, size_t file_size, size_t offset, size_t size, char *&begin, size_t &length)
+    {
+        if (!data || offset >= file_size) {
+            return false;
+        }
+        size = std::min(size, file_size - offset);
+
+        const size_t page = (size_t) sysconf(_SC_PAGESIZE);
+        const size_t aligned_offset = offset / page * page;
+        begin = (char *) data + aligned_offset;
+        length = offset + size - aligned_offset;
+        return length > 0;
+    }
+
+}
+
+phg::MappedFile::MappedFile(const std::string &path)
+    : path_(path)
+    , data_(nullptr)
+    , size_(0)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        throw std::runtime_error("MappedFile:: can't open file " + path);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        throw std::runtime_error("MappedFile:: can't get size of file " + path);
+    }
+    size_ = (size_t) st.st_size;
+    if (size_ == 0) {
+        close(fd);
+        return;
+    }
+
+    void *ptr = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    // отображение держит файл само по себе, дескриптор больше не нужен
+    close(fd);
+    if (ptr == MAP_FAILED) {
+        throw std::runtime_error("MappedFile:: can't map file " + path);
+    }
+    data_ = (const char *) ptr;
+}
+
+phg::MappedFile::~MappedFile()
+{
+    if (data_) {
+        munmap((void *) data_, size_);
+    }
+}
+
+void phg::MappedFile::prefetch(size_t offset, size_t size) const
+{
+    char *begin;
+    size_t length;
+    if (pageRange(data_, size_, offset, size, begin, length)) {
+        madvise(begin, length, MADV_WILLNEED);
+    }
+}
+
+void phg::MappedFile::evict(size_t offset, size_t size) const
+{
+    // отображение только для чтения и ничего не меняло, так что страницы просто отбрасываются
+    char *begin;
+    size_t length;
+    if (pageRange(data_, size_, offset, size, begin, length)) {
+        madvise(begin, length, MADV_DONTNEED);
+    }
+}
+
+#endif
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <string>
+#include <cstddef>
+
+namespace phg {
+
+    // файл отображенный в память только для чтения: данные подгружаются с диска лениво по мере обращения, ничего не копируется в кучу
+    class MappedFile {
+    public:
+        MappedFile(const std::string &path);
+        ~MappedFile();
+
+        const char *data() const { return data_; }
+        size_t size() const { return size_; }
+
+        const std::string &path() const { return path_; }
+
+        // подсказки ОС (madvise) для чтения файла потоком: prefetch - начать асинхронно подгружать диапазон байт,
+        // evict - диапазон больше не нужен и его страницы можно выбросить из памяти, при следующем обращении они перечитаются с диска
+        // на Windows ничего не делают
+        void prefetch(size_t offset, size_t size) const;
+        void evict(size_t offset, size_t size) const;
+
+    private:
+
+        MappedFile(const MappedFile &) = delete;
+        MappedFile &operator=(const MappedFile &) = delete;
+
+        std::string path_;
+        const char *data_;
+        size_t size_;
+
+#if defined _WIN32 || defined _WIN64
+        void *file_handle;
+        void *mapping_handle;
+#endif
+    };
+
+}
@@ -7,16 +7,39 @@
 
 #include <phg/matching/bruteforce_matcher.h>
 #include <phg/matching/bruteforce_matcher_gpu.h>
+#include <phg/matching/bruteforce_matcher_hamming.h>
+#include <phg/matching/bruteforce_matcher_int8.h>
+#include <phg/matching/cascade_hashing_matcher.h>
+#include <phg/matching/descriptor_pca.h>
 #include <phg/sfm/homography.h>
 #include <phg/matching/flann_matcher.h>
+#include <phg/matching/feature_index_cache.h>
 #include <phg/sift/sift.h>
 #include <libutils/timer.h>
 #include <phg/sfm/panorama_stitcher.h>
 #include <phg/matching/gms_matcher.h>
+#include <phg/matching/guided_matcher.h>
+#include <phg/matching/ivf_pq_matcher.h>
+#include <phg/matching/match_graph.h>
+#include <phg/matching/multi_image_matcher.h>
+#include <phg/matching/pair_match_cache.h>
+#include <phg/matching/pair_scheduler.h>
+#include <phg/matching/pair_selection.h>
+#include <phg/matching/streaming_matcher.h>
+#include <phg/matching/vocabulary_tree.h>
 
 
 #include "utils/test_utils.h"
 
+#include <set>
+#include <atomic>
+#include <limits>
+#include <memory>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <tuple>
+
 
 // TODO enable both toggles for testing custom detector & matcher
 #define ENABLE_MY_DESCRIPTOR 0
@@ -92,6 +115,49 @@ namespace {
         return H;
     }
 
+    // от грубого к точному: гомография по сопоставлениям уменьшенных в coarse_downscale раз картинок,
+    // затем точки исходных картинок сравниваются только с train точками в радиусе radius_px вокруг предсказанного ей положения
+    cv::Mat getHomographyCoarseToFine(const cv::Mat &img1, const cv::Mat &img2, int coarse_downscale = 4, double radius_px = 32.0)
+    {
+        cv::Mat small1, small2;
+        cv::resize(img1, small1, cv::Size(img1.cols / coarse_downscale, img1.rows / coarse_downscale), 0, 0, cv::INTER_AREA);
+        cv::resize(img2, small2, cv::Size(img2.cols / coarse_downscale, img2.rows / coarse_downscale), 0, 0, cv::INTER_AREA);
+        cv::Mat H_coarse = getHomography(small1, small2);
+
+        // в координаты исходных картинок: H = S2^-1 * H_coarse * S1, где S - масштаб из исходной картинки в уменьшенную
+        const double sx1 = (double) small1.cols / img1.cols, sy1 = (double) small1.rows / img1.rows;
+        const double sx2 = (double) small2.cols / img2.cols, sy2 = (double) small2.rows / img2.rows;
+        cv::Matx33d H;
+        for (int r = 0; r < 3; ++r) {
+            for (int c = 0; c < 3; ++c) {
+                H(r, c) = H_coarse.at<double>(r, c) * (c == 0 ? sx1 : c == 1 ? sy1 : 1.0) / (r == 0 ? sx2 : r == 1 ? sy2 : 1.0);
+            }
+        }
+
+        cv::Ptr<cv::FeatureDetector> detector = cv::SIFT::create();
+        std::vector<cv::KeyPoint> keypoints1, keypoints2;
+        cv::Mat descriptors1, descriptors2;
+        detector->detectAndCompute(img1, cv::noArray(), keypoints1, descriptors1);
+        detector->detectAndCompute(img2, cv::noArray(), keypoints2, descriptors2);
+
+        phg::HomographyGuidedMatcher matcher;
+        matcher.train(descriptors2, keypoints2);
+        std::vector<std::vector<cv::DMatch>> knn_matches;
+        size_t ncompared = matcher.knnMatch(descriptors1, keypoints1, H, radius_px, knn_matches, 2);
+        std::cout << "guided matching: " << ncompared << " descriptor pairs compared instead of " << (size_t) descriptors1.rows * descriptors2.rows << std::endl;
+
+        std::vector<cv::DMatch> good_matches;
+        phg::DescriptorMatcher::filterMatchesRatioTest(knn_matches, good_matches);
+
+        std::vector<cv::Point2f> points1, points2;
+        for (const cv::DMatch &match : good_matches) {
+            points1.push_back(keypoints1[match.queryIdx].pt);
+            points2.push_back(keypoints2[match.trainIdx].pt);
+        }
+
+        return phg::findHomography(points1, points2);
+    }
+
     void evaluateStitching(const cv::Mat &img1, const cv::Mat &img2, double &keypoints_rmse, double &color_rmse,
                            const std::vector<cv::KeyPoint> &keypoints1, const std::vector<cv::KeyPoint> &keypoints2,
                            const cv::Mat &descriptors1, const cv::Mat &descriptors2)
@@ -191,6 +257,129 @@ namespace {
         }
     }
 
+    void detectSIFT(const cv::Mat &img, std::vector<cv::KeyPoint> &keypoints, cv::Mat &descriptors)
+    {
+        cv::Ptr<cv::FeatureDetector> detector = cv::SIFT::create();
+        detector->detectAndCompute(img, cv::noArray(), keypoints, descriptors);
+    }
+
+    // доля запросов, для которых найденный ближайший сосед совпал с найденным полным перебором
+    double nnRecall(const std::vector<std::vector<cv::DMatch>> &matches, const std::vector<std::vector<cv::DMatch>> &matches_gt)
+    {
+        if (matches.size() != matches_gt.size()) {
+            throw std::runtime_error("nnRecall: matches.size() != matches_gt.size()");
+        }
+
+        double score = 0;
+        for (int i = 0; i < (int) matches.size(); ++i) {
+            if (matches[i][0].queryIdx != i) {
+                throw std::runtime_error("invalid DMatch queryIdx");
+            }
+            if (matches[i][0].trainIdx == matches_gt[i][0].trainIdx) {
+                ++score;
+            }
+        }
+        return matches.empty() ? 0 : score / matches.size();
+    }
+
+    size_t countCommonMatches(const std::vector<cv::DMatch> &matches0, const std::vector<cv::DMatch> &matches1)
+    {
+        std::set<std::tuple<int, int, int>> matches1_set;
+        for (const cv::DMatch &match : matches1) {
+            matches1_set.insert(std::make_tuple(match.queryIdx, match.trainIdx, match.imgIdx));
+        }
+
+        size_t n_common = 0;
+        for (const cv::DMatch &match : matches0) {
+            n_common += matches1_set.count(std::make_tuple(match.queryIdx, match.trainIdx, match.imgIdx));
+        }
+        return n_common;
+    }
+
+    // пара картинок, на которой проверяются матчеры, и их SIFT признаки
+    void detectHikingSIFT(cv::Mat &img1, cv::Mat &img2,
+                          std::vector<cv::KeyPoint> &keypoints1, std::vector<cv::KeyPoint> &keypoints2,
+                          cv::Mat &descriptors1, cv::Mat &descriptors2)
+    {
+        img1 = cv::imread("data/src/test_matching/hiking_left.JPG");
+        img2 = cv::imread("data/src/test_matching/hiking_right.JPG");
+        detectSIFT(img1, keypoints1, descriptors1);
+        detectSIFT(img2, keypoints2, descriptors2);
+    }
+
+    // эталон для остальных матчеров - точный полный перебор
+    void bruteforceKnnMatch(const cv::Mat &query_desc, const cv::Mat &train_desc, std::vector<std::vector<cv::DMatch>> &matches, int k)
+    {
+        phg::BruteforceMatcher matcher;
+        matcher.train(train_desc);
+        matcher.knnMatch(query_desc, matches, k);
+    }
+
+    void bruteforceKnnMatch(const cv::Mat &query_desc, const cv::Mat &train_desc, phg::KnnMatches &matches, int k)
+    {
+        phg::BruteforceMatcher matcher;
+        matcher.train(train_desc);
+        matcher.knnMatchFlat(query_desc, matches, k);
+    }
+
+    // число запросов, у которых все k соседей совпали с эталонными
+    size_t countSameKnn(const phg::KnnMatches &matches, const phg::KnnMatches &matches_gt)
+    {
+        if (matches.nquery != matches_gt.nquery || matches.k != matches_gt.k) {
+            throw std::runtime_error("countSameKnn: matches and matches_gt sizes differ");
+        }
+
+        size_t n_same = 0;
+        for (int qi = 0; qi < matches.nquery; ++qi) {
+            bool same = true;
+            for (int ki = 0; ki < matches.k; ++ki) {
+                same = same && matches.match(qi, ki).trainIdx == matches_gt.match(qi, ki).trainIdx;
+            }
+            n_same += same;
+        }
+        return n_same;
+    }
+
+    size_t countSameKnn(const phg::KnnMatches &matches, const std::vector<std::vector<cv::DMatch>> &matches_gt)
+    {
+        if (matches.nquery != (int) matches_gt.size()) {
+            throw std::runtime_error("countSameKnn: matches and matches_gt sizes differ");
+        }
+
+        size_t n_same = 0;
+        for (int qi = 0; qi < matches.nquery; ++qi) {
+            if (matches_gt[qi].size() != (size_t) matches.k) {
+                throw std::runtime_error("countSameKnn: matches and matches_gt sizes differ");
+            }
+            bool same = true;
+            for (int ki = 0; ki < matches.k; ++ki) {
+                same = same && matches.match(qi, ki).trainIdx == matches_gt[qi][ki].trainIdx;
+            }
+            n_same += same;
+        }
+        return n_same;
+    }
+
+    size_t countSameKnn(const std::vector<std::vector<cv::DMatch>> &matches, const std::vector<std::vector<cv::DMatch>> &matches_gt)
+    {
+        if (matches.size() != matches_gt.size()) {
+            throw std::runtime_error("countSameKnn: matches and matches_gt sizes differ");
+        }
+
+        size_t n_same = 0;
+        for (size_t qi = 0; qi < matches.size(); ++qi) {
+            if (matches[qi].size() != matches_gt[qi].size()) {
+                throw std::runtime_error("countSameKnn: matches and matches_gt sizes differ");
+            }
+            bool same = true;
+            for (size_t ki = 0; ki < matches[qi].size(); ++ki) {
+                same = same && matches[qi][ki].trainIdx == matches_gt[qi][ki].trainIdx;
+            }
+            n_same += same;
+        }
+        return n_same;
+    }
+
 }
 
 namespace {
@@ -736,6 +925,1145 @@ TEST (MATCHING, Rotate30Scale75) {
     testMatchingTransformWrapper(angleDegreesClockwise, scale);
 }
 
+TEST (MATCHING, IVFPQ) {
+    cv::Mat img1, img2;
+    std::vector<cv::KeyPoint> keypoints1, keypoints2;
+    cv::Mat descriptors1, descriptors2;
+    detectHikingSIFT(img1, img2, keypoints1, keypoints2, descriptors1, descriptors2);
+
+    std::vector<std::vector<cv::DMatch>> knn_matches_bruteforce, knn_matches_ivfpq;
+    bruteforceKnnMatch(descriptors1, descriptors2, knn_matches_bruteforce, 2);
+
+    timer tm;
+    phg::IVFPQMatcher matcher;
+    matcher.train(descriptors2);
+    double time_train = tm.elapsed();
+    tm.restart();
+    matcher.knnMatch(descriptors1, knn_matches_ivfpq, 2);
+    double time_match = tm.elapsed();
+
+    double nn_score = nnRecall(knn_matches_ivfpq, knn_matches_bruteforce);
+    size_t raw_size = descriptors2.total() * sizeof(float);
+    std::cout << "IVF-PQ: train " << time_train << " s, match " << time_match << " s, nn_score: " << nn_score
+              << ", index size: " << matcher.memoryUsage() << " bytes (raw descriptors: " << raw_size << " bytes)" << std::endl;
+
+    EXPECT_GT(nn_score, 0.8);
+    // перепроверка держит исходные дескрипторы
+    EXPECT_GE(matcher.memoryUsage(), raw_size);
+
+    // только сжатый индекс: расстояния приближенные, зато памяти в разы меньше
+    std::vector<std::vector<cv::DMatch>> knn_matches_compressed;
+    phg::IVFPQMatcher matcher_compressed(1024, 16, 16, 0);
+    matcher_compressed.train(descriptors2);
+    matcher_compressed.knnMatch(descriptors1, knn_matches_compressed, 2);
+    double nn_score_compressed = nnRecall(knn_matches_compressed, knn_matches_bruteforce);
+    std::cout << "IVF-PQ without re-ranking: nn_score: " << nn_score_compressed << ", index size: " << matcher_compressed.memoryUsage() << " bytes" << std::endl;
+
+    EXPECT_GT(nn_score_compressed, 0.3);
+    EXPECT_LT(matcher_compressed.memoryUsage(), raw_size / 4);
+}
+
+TEST (MATCHING, CascadeHashingBenchmark) {
+    cv::Mat img1 = cv::imread("data/src/test_matching/hiking_left.JPG");
+    cv::Mat img2 = cv::imread("data/src/test_matching/hiking_right.JPG");
+
+    std::vector<cv::KeyPoint> keypoints1;
+    cv::Mat descriptors1;
+    detectSIFT(img1, keypoints1, descriptors1);
+
+    // те же преобразования что и в тестах Rotate* / Scale* выше
+    const std::vector<std::pair<double, double>> transforms = {
+            {10, 1.0}, {20, 1.0}, {30, 1.0}, {40, 1.0}, {45, 1.0}, {90, 1.0},
+            {0, 0.5}, {0, 0.7}, {0, 0.9}, {0, 1.1}, {0, 1.3}, {0, 1.5}, {0, 1.75}, {0, 2.0},
+            {10, 0.9}, {30, 0.75}};
+
+    double total_time_flann = 0, total_time_cascade = 0;
+    for (const auto &transform : transforms) {
+        cv::Mat img2_transformed = transformImg(img2, transform.first, transform.second);
+        addNoise(img2_transformed);
+
+        std::vector<cv::KeyPoint> keypoints2;
+        cv::Mat descriptors2;
+        detectSIFT(img2_transformed, keypoints2, descriptors2);
+
+        std::vector<std::vector<cv::DMatch>> knn_matches_bruteforce, knn_matches_flann, knn_matches_cascade;
+        bruteforceKnnMatch(descriptors1, descriptors2, knn_matches_bruteforce, 2);
+
+        // время - вместе с построением индекса, т.к. каждая пара картинок сопоставляется один раз
+        timer tm;
+        {
+            phg::FlannMatcher matcher;
+            matcher.train(descriptors2);
+            matcher.knnMatch(descriptors1, knn_matches_flann, 2);
+        }
+        double time_flann = tm.elapsed();
+
+        tm.restart();
+        {
+            phg::CascadeHashingMatcher matcher;
+            matcher.train(descriptors2);
+            matcher.knnMatch(descriptors1, knn_matches_cascade, 2);
+        }
+        double time_cascade = tm.elapsed();
+
+        total_time_flann += time_flann;
+        total_time_cascade += time_cascade;
+
+        std::vector<cv::DMatch> good_matches_bruteforce, good_matches_flann, good_matches_cascade;
+        phg::DescriptorMatcher::filterMatchesRatioTest(knn_matches_bruteforce, good_matches_bruteforce);
+        phg::DescriptorMatcher::filterMatchesRatioTest(knn_matches_flann, good_matches_flann);
+        phg::DescriptorMatcher::filterMatchesRatioTest(knn_matches_cascade, good_matches_cascade);
+
+        double nn_score_flann = nnRecall(knn_matches_flann, knn_matches_bruteforce);
+        double nn_score_cascade = nnRecall(knn_matches_cascade, knn_matches_bruteforce);
+        double good_recall_flann = (double) countCommonMatches(good_matches_flann, good_matches_bruteforce) / good_matches_bruteforce.size();
+        double good_recall_cascade = (double) countCommonMatches(good_matches_cascade, good_matches_bruteforce) / good_matches_bruteforce.size();
+
+        std::cout << "rotate " << transform.first << ", scale " << transform.second << ":" << std::endl;
+        std::cout << "    flann:   " << time_flann << " s, nn_score: " << nn_score_flann << ", ratio test matches recall: " << good_recall_flann << std::endl;
+        std::cout << "    cascade: " << time_cascade << " s, nn_score: " << nn_score_cascade << ", ratio test matches recall: " << good_recall_cascade << std::endl;
+
+        // для однозначных (прошедших ratio test) сопоставлений хеширование почти не теряет соседей
+        EXPECT_GT(good_recall_cascade, 0.9);
+        EXPECT_GT(good_recall_cascade, 0.95 * good_recall_flann);
+    }
+
+    std::cout << "total: flann " << total_time_flann << " s, cascade hashing " << total_time_cascade << " s" << std::endl;
+}
+
+TEST (MATCHING, PCAMatcher) {
+    cv::Mat img1, img2;
+    std::vector<cv::KeyPoint> keypoints1, keypoints2;
+    cv::Mat descriptors1, descriptors2;
+    detectHikingSIFT(img1, img2, keypoints1, keypoints2, descriptors1, descriptors2);
+
+    std::vector<std::vector<cv::DMatch>> knn_matches_bruteforce;
+    timer tm;
+    bruteforceKnnMatch(descriptors1, descriptors2, knn_matches_bruteforce, 2);
+    double time_bruteforce = tm.elapsed();
+
+    // PCA учится на выборке дескрипторов обеих картинок
+    cv::Mat sample;
+    for (int i = 0; i < descriptors1.rows; i += 2) {
+        sample.push_back(descriptors1.row(i));
+    }
+    for (int i = 0; i < descriptors2.rows; i += 2) {
+        sample.push_back(descriptors2.row(i));
+    }
+    phg::DescriptorPCA pca(32);
+    pca.train(sample);
+    ASSERT_EQ(pca.inputDim(), 128);
+    ASSERT_EQ(pca.outputDim(), 32);
+
+    // после сохранения и загрузки проекции те же
+    {
+        std::string pca_path = "data/debug/test_matching/" + getTestSuiteName() + "_" + getTestName() + "_pca.bin";
+        pca.save(pca_path);
+        phg::DescriptorPCA pca_loaded;
+        pca_loaded.load(pca_path);
+
+        cv::Mat reduced, reduced_loaded;
+        pca.project(descriptors1, reduced);
+        pca_loaded.project(descriptors1, reduced_loaded);
+        EXPECT_EQ(cv::norm(reduced, reduced_loaded, cv::NORM_INF), 0);
+    }
+
+    std::vector<std::vector<cv::DMatch>> knn_matches_pca_bruteforce, knn_matches_pca_flann;
+    tm.restart();
+    {
+        phg::PCAMatcher matcher(pca, std::unique_ptr<phg::DescriptorMatcher>(new phg::BruteforceMatcher));
+        matcher.train(descriptors2);
+        matcher.knnMatch(descriptors1, knn_matches_pca_bruteforce, 2);
+    }
+    double time_pca_bruteforce = tm.elapsed();
+    {
+        phg::PCAMatcher matcher(pca, std::unique_ptr<phg::DescriptorMatcher>(new phg::FlannMatcher));
+        matcher.train(descriptors2);
+        matcher.knnMatch(descriptors1, knn_matches_pca_flann, 2);
+
+        // проекции и индекс по ним меньше чем индекс по полным дескрипторам
+        phg::FlannMatcher flann;
+        flann.train(descriptors2);
+        EXPECT_GT(matcher.memoryUsage(), descriptors2.rows * 32 * sizeof(float));
+        EXPECT_LT(matcher.memoryUsage(), flann.memoryUsage());
+    }
+
+    double nn_score_pca_bruteforce = nnRecall(knn_matches_pca_bruteforce, knn_matches_bruteforce);
+    double nn_score_pca_flann = nnRecall(knn_matches_pca_flann, knn_matches_bruteforce);
+
+    std::vector<cv::DMatch> good_matches_bruteforce, good_matches_pca;
+    phg::DescriptorMatcher::filterMatchesRatioTest(knn_matches_bruteforce, good_matches_bruteforce);
+    phg::DescriptorMatcher::filterMatchesRatioTest(knn_matches_pca_bruteforce, good_matches_pca);
+    double good_recall = (double) countCommonMatches(good_matches_pca, good_matches_bruteforce) / good_matches_bruteforce.size();
+
+    std::cout << "PCA 128 -> 32: bruteforce " << time_pca_bruteforce << " s (full bruteforce: " << time_bruteforce << " s), nn_score: " << nn_score_pca_bruteforce
+              << ", with flann nn_score: " << nn_score_pca_flann << ", ratio test matches recall: " << good_recall << std::endl;
+
+    // кандидаты перепроверяются по полным дескрипторам, поэтому однозначные сопоставления почти не теряются
+    EXPECT_GT(good_recall, 0.95);
+    EXPECT_GT(nn_score_pca_bruteforce, 0.85);
+    EXPECT_GT(nn_score_pca_flann, 0.75);
+}
+
+TEST (MATCHING, HammingBinarizedSIFT) {
+    cv::Mat img1, img2;
+    std::vector<cv::KeyPoint> keypoints1, keypoints2;
+    cv::Mat descriptors1, descriptors2;
+    detectHikingSIFT(img1, img2, keypoints1, keypoints2, descriptors1, descriptors2);
+
+    std::vector<std::vector<cv::DMatch>> knn_matches_bruteforce, knn_matches_hamming;
+    bruteforceKnnMatch(descriptors1, descriptors2, knn_matches_bruteforce, 2);
+
+    cv::Mat binary1, binary2;
+    phg::binarizeDescriptors(descriptors1, binary1);
+    phg::binarizeDescriptors(descriptors2, binary2);
+    ASSERT_EQ(binary1.cols, 32);
+
+    timer tm;
+    std::string hamming_kernel;
+    {
+        phg::BruteforceMatcherHamming matcher;
+        matcher.train(binary2);
+        matcher.knnMatch(binary1, knn_matches_hamming, 2);
+        hamming_kernel = matcher.kernel();
+    }
+    double time_hamming = tm.elapsed();
+
+    for (int qi = 0; qi < (int) knn_matches_hamming.size(); qi += 97) {
+        const cv::DMatch &match = knn_matches_hamming[qi][0];
+        EXPECT_EQ(match.distance, cv::norm(binary1.row(match.queryIdx), binary2.row(match.trainIdx), cv::NORM_HAMMING));
+    }
+
+    std::vector<cv::DMatch> good_matches_bruteforce, good_matches_hamming, good_matches_hamming_clusters;
+    phg::DescriptorMatcher::filterMatchesRatioTest(knn_matches_bruteforce, good_matches_bruteforce);
+    phg::DescriptorMatcher::filterMatchesRatioTest(knn_matches_hamming, good_matches_hamming);
+    phg::DescriptorMatcher::filterMatchesClusters(good_matches_hamming, keypoints1, keypoints2, good_matches_hamming_clusters);
+
+    // совпадения после фильтрации должны быть теми же, что и у точного L2 сопоставления исходных дескрипторов
+    size_t n_agree = 0;
+    for (const cv::DMatch &match : good_matches_hamming_clusters) {
+        n_agree += knn_matches_bruteforce[match.queryIdx][0].trainIdx == match.trainIdx;
+    }
+    double precision = good_matches_hamming_clusters.empty() ? 0 : (double) n_agree / good_matches_hamming_clusters.size();
+
+    std::cout << "Hamming: match " << time_hamming << " s (kernel: " << hamming_kernel << "), " << good_matches_hamming_clusters.size() << " matches after ratio test and clusters filtering (L2: "
+              << good_matches_bruteforce.size() << " after ratio test), agree with L2 NN: " << precision << std::endl;
+
+    EXPECT_GT(precision, 0.9);
+    EXPECT_GT(good_matches_hamming_clusters.size(), 0.3 * good_matches_bruteforce.size());
+}
+
+TEST (MATCHING, Int8Bruteforce) {
+    cv::Mat img1, img2;
+    std::vector<cv::KeyPoint> keypoints1, keypoints2;
+    cv::Mat descriptors1, descriptors2;
+    detectHikingSIFT(img1, img2, keypoints1, keypoints2, descriptors1, descriptors2);
+
+    timer tm;
+    std::vector<std::vector<cv::DMatch>> knn_matches_bruteforce, knn_matches_int8;
+    bruteforceKnnMatch(descriptors1, descriptors2, knn_matches_bruteforce, 2);
+    double time_bruteforce = tm.elapsed();
+
+    tm.restart();
+    std::string int8_kernel;
+    {
+        phg::BruteforceMatcherInt8 matcher;
+        matcher.train(descriptors2);
+        matcher.knnMatch(descriptors1, knn_matches_int8, 2);
+        int8_kernel = matcher.kernel();
+    }
+    double time_int8 = tm.elapsed();
+
+    ASSERT_EQ(knn_matches_int8.size(), knn_matches_bruteforce.size());
+    double nn_score = nnRecall(knn_matches_int8, knn_matches_bruteforce);
+
+    std::vector<cv::DMatch> good_matches_bruteforce, good_matches_int8;
+    phg::DescriptorMatcher::filterMatchesRatioTest(knn_matches_bruteforce, good_matches_bruteforce);
+    phg::DescriptorMatcher::filterMatchesRatioTest(knn_matches_int8, good_matches_int8);
+    size_t n_common = countCommonMatches(good_matches_bruteforce, good_matches_int8);
+
+    std::cout << "int8: match " << time_int8 << " s (kernel: " << int8_kernel << ", float bruteforce: " << time_bruteforce << " s), nn_score: " << nn_score
+              << ", " << good_matches_int8.size() << " matches after ratio test (float: " << good_matches_bruteforce.size() << ")" << std::endl;
+
+    // кандидаты перепроверяются точным L2, расхождения только если истинный сосед не попал в shortlist из-за квантования
+    EXPECT_GT(nn_score, 0.98);
+    EXPECT_GT(n_common, 0.99 * good_matches_bruteforce.size());
+    EXPECT_GT(n_common, 0.99 * good_matches_int8.size());
+}
+
+TEST (MATCHING, MultiImage) {
+    cv::Mat img0 = cv::imread("data/src/test_matching/hiking_left.JPG");
+    cv::Mat img1 = cv::imread("data/src/test_matching/hiking_right.JPG");
+
+    // запрос - левая картинка, база - правая и две ее трансформированные копии
+    std::vector<cv::Mat> imgs = {img1, transformImg(img1, 30, 1.0), transformImg(img1, 0, 0.7)};
+
+    std::vector<cv::KeyPoint> keypoints0;
+    cv::Mat descriptors0;
+    detectSIFT(img0, keypoints0, descriptors0);
+
+    std::vector<std::vector<cv::KeyPoint>> keypoints(imgs.size());
+    std::vector<cv::Mat> descriptors(imgs.size());
+    for (size_t i = 0; i < imgs.size(); ++i) {
+        detectSIFT(imgs[i], keypoints[i], descriptors[i]);
+    }
+
+    timer tm;
+    std::vector<std::vector<std::vector<cv::DMatch>>> knn_matches_pairwise(imgs.size());
+    for (size_t i = 0; i < imgs.size(); ++i) {
+        bruteforceKnnMatch(descriptors0, descriptors[i], knn_matches_pairwise[i], 2);
+    }
+    double time_pairwise = tm.elapsed();
+
+    tm.restart();
+    std::vector<std::vector<std::vector<cv::DMatch>>> knn_matches_multi;
+    {
+        phg::MultiImageMatcher matcher;
+        matcher.train(descriptors);
+        matcher.knnMatch(descriptors0, knn_matches_multi, 2);
+    }
+    double time_multi = tm.elapsed();
+
+    std::cout << "pairwise matching: " << time_pairwise << " s, multi-image matching: " << time_multi << " s" << std::endl;
+
+    ASSERT_EQ(knn_matches_multi.size(), imgs.size());
+    for (size_t i = 0; i < imgs.size(); ++i) {
+        ASSERT_EQ(knn_matches_multi[i].size(), knn_matches_pairwise[i].size());
+
+        for (size_t qi = 0; qi < knn_matches_multi[i].size(); ++qi) {
+            ASSERT_EQ(knn_matches_multi[i][qi].size(), (size_t) 2);
+            EXPECT_EQ(knn_matches_multi[i][qi][0].imgIdx, (int) i);
+            EXPECT_EQ(knn_matches_multi[i][qi][0].queryIdx, (int) qi);
+        }
+        // knnMatch считает расстояния в double через cv::norm, поэтому на почти равных расстояниях результаты могут изредка расходиться
+        EXPECT_GT(nnRecall(knn_matches_multi[i], knn_matches_pairwise[i]), 0.99);
+    }
+
+    // картинка без ключевых точек на первом месте не должна мешать остальным
+    {
+        phg::MultiImageMatcher matcher;
+        matcher.train({cv::Mat(), descriptors[0]});
+        std::vector<std::vector<std::vector<cv::DMatch>>> knn_matches;
+        matcher.knnMatch(descriptors0, knn_matches, 2);
+        ASSERT_EQ(knn_matches.size(), (size_t) 2);
+        for (size_t qi = 0; qi < knn_matches[0].size(); ++qi) {
+            EXPECT_TRUE(knn_matches[0][qi].empty());
+            ASSERT_EQ(knn_matches[1][qi].size(), (size_t) 2);
+            EXPECT_EQ(knn_matches[1][qi][0].trainIdx, knn_matches_multi[0][qi][0].trainIdx);
+        }
+    }
+
+    phg::MultiImageMatcher matcher;
+    EXPECT_THROW(matcher.train({cv::Mat(), descriptors[0], descriptors[1].colRange(0, 64).clone()}), std::runtime_error);
+    EXPECT_THROW(matcher.train({cv::Mat(), cv::Mat()}), std::runtime_error);
+}
+
+TEST (MATCHING, FeatureIndexCache) {
+    cv::Mat img0 = cv::imread("data/src/test_matching/hiking_left.JPG");
+    cv::Mat img1 = cv::imread("data/src/test_matching/hiking_right.JPG");
+
+    std::vector<cv::Mat> imgs = {img0, img1, transformImg(img1, 30, 1.0), transformImg(img1, 0, 0.7)};
+    const int n = (int) imgs.size();
+    std::vector<cv::Mat> descriptors(n);
+    for (int i = 0; i < n; ++i) {
+        std::vector<cv::KeyPoint> keypoints;
+        detectSIFT(imgs[i], keypoints, descriptors[i]);
+    }
+
+    phg::FeatureIndexCache::MatcherFactory create_flann = []() {
+        return std::unique_ptr<phg::DescriptorMatcher>(new phg::FlannMatcher);
+    };
+
+    // все пары параллельно: каждый индекс строится ровно один раз и дает тот же результат что и отдельно построенный
+    {
+        phg::FeatureIndexCache cache(descriptors, create_flann);
+
+        std::vector<std::pair<int, int>> pairs;
+        for (int i = 0; i < n; ++i) {
+            for (int j = 0; j < n; ++j) {
+                if (i != j) {
+                    pairs.push_back(std::make_pair(i, j));
+                }
+            }
+        }
+
+        std::vector<std::vector<std::vector<cv::DMatch>>> pairs_matches(pairs.size());
+        #pragma omp parallel for schedule(dynamic, 1)
+        for (int p = 0; p < (int) pairs.size(); ++p) {
+            cache.get(pairs[p].second)->knnMatch(descriptors[pairs[p].first], pairs_matches[p], 2);
+        }
+        EXPECT_EQ(cache.nbuilds(), n);
+
+        for (int p = 0; p < (int) pairs.size(); ++p) {
+            phg::FlannMatcher matcher;
+            matcher.train(descriptors[pairs[p].second]);
+            std::vector<std::vector<cv::DMatch>> knn_matches;
+            matcher.knnMatch(descriptors[pairs[p].first], knn_matches, 2);
+
+            ASSERT_EQ(knn_matches.size(), pairs_matches[p].size());
+            for (size_t qi = 0; qi < knn_matches.size(); ++qi) {
+                EXPECT_EQ(knn_matches[qi][0].trainIdx, pairs_matches[p][qi][0].trainIdx);
+            }
+        }
+    }
+
+    // лимит памяти на два самых больших индекса: при обходе 0, 1, 2, 0 индекс 0 будет выброшен и построен заново
+    {
+        // учитывается память самих индексов (у FLANN - копия дескрипторов и kd-деревья), а не дескрипторов, которыми кеш не владеет
+        std::vector<size_t> index_sizes(n);
+        for (int i = 0; i < n; ++i) {
+            std::unique_ptr<phg::DescriptorMatcher> matcher = create_flann();
+            matcher->train(descriptors[i]);
+            index_sizes[i] = matcher->memoryUsage();
+            EXPECT_GT(index_sizes[i], descriptors[i].total() * descriptors[i].elemSize());
+        }
+        std::vector<size_t> sizes = index_sizes;
+        std::sort(sizes.begin(), sizes.end());
+        const size_t max_memory = sizes[n - 1] + sizes[n - 2];
+
+        phg::FeatureIndexCache cache(descriptors, create_flann, max_memory);
+        std::shared_ptr<const phg::DescriptorMatcher> index0 = cache.get(0);
+        cache.get(1);
+        cache.get(2);
+        EXPECT_EQ(cache.memoryUsage(), index_sizes[1] + index_sizes[2]);
+
+        // выброшенный из кеша индекс продолжает работать пока на него есть ссылка
+        std::vector<std::vector<cv::DMatch>> knn_matches;
+        index0->knnMatch(descriptors[1], knn_matches, 2);
+        EXPECT_EQ(knn_matches.size(), descriptors[1].rows);
+
+        cache.get(0);
+        EXPECT_EQ(cache.nbuilds(), 4);
+        EXPECT_EQ(cache.memoryUsage(), index_sizes[2] + index_sizes[0]);
+        EXPECT_LE(cache.memoryUsage(), max_memory);
+    }
+}
+
+TEST (MATCHING, GMSImageGrid) {
+    cv::Mat img1, img2;
+    std::vector<cv::KeyPoint> keypoints1, keypoints2;
+    cv::Mat descriptors1, descriptors2;
+    detectHikingSIFT(img1, img2, keypoints1, keypoints2, descriptors1, descriptors2);
+
+    std::vector<std::vector<cv::DMatch>> knn_matches;
+    phg::FlannMatcher matcher;
+    matcher.train(descriptors2);
+    matcher.knnMatch(descriptors1, knn_matches, 2);
+    std::vector<cv::DMatch> matches(knn_matches.size());
+    for (size_t i = 0; i < knn_matches.size(); ++i) {
+        matches[i] = knn_matches[i][0];
+    }
+
+    std::vector<cv::DMatch> matches_gms, matches_gms_grids;
+    int n_inliers = phg::filterMatchesGMS(matches, keypoints1, keypoints2, img1.size(), img2.size(), matches_gms, false);
+
+    // предпосчитанные сетки дают в точности тот же результат
+    phg::GMSImageGrid grid1(keypoints1, img1.size());
+    phg::GMSImageGrid grid2(keypoints2, img2.size());
+    int n_inliers_grids = phg::filterMatchesGMS(matches, grid1, grid2, matches_gms_grids, false);
+
+    EXPECT_EQ(n_inliers, n_inliers_grids);
+    ASSERT_EQ(matches_gms.size(), matches_gms_grids.size());
+    EXPECT_EQ(countCommonMatches(matches_gms, matches_gms_grids), matches_gms.size());
+    EXPECT_GT(n_inliers, 0);
+}
+
+TEST (MATCHING, MutualBruteforce) {
+    cv::Mat img1, img2;
+    std::vector<cv::KeyPoint> keypoints1, keypoints2;
+    cv::Mat descriptors1, descriptors2;
+    detectHikingSIFT(img1, img2, keypoints1, keypoints2, descriptors1, descriptors2);
+
+    timer tm;
+    std::vector<std::vector<cv::DMatch>> knn_matches12, knn_matches21;
+    bruteforceKnnMatch(descriptors1, descriptors2, knn_matches12, 2);
+    bruteforceKnnMatch(descriptors2, descriptors1, knn_matches21, 2);
+    double time_two_pass = tm.elapsed();
+
+    std::vector<cv::DMatch> mutual_matches_two_pass;
+    for (const auto &knn : knn_matches12) {
+        if (knn_matches21[knn[0].trainIdx][0].trainIdx == knn[0].queryIdx) {
+            mutual_matches_two_pass.push_back(knn[0]);
+        }
+    }
+
+    tm.restart();
+    std::vector<cv::DMatch> mutual_matches;
+    phg::BruteforceMatcher matcher;
+    matcher.train(descriptors2);
+    matcher.matchMutual(descriptors1, mutual_matches);
+    double time_mutual = tm.elapsed();
+
+    std::cout << "mutual matches: " << mutual_matches.size() << ", two-pass time: " << time_two_pass << " s, single pass time: " << time_mutual << " s" << std::endl;
+
+    // knnMatch считает расстояния в double через cv::norm, поэтому на почти равных расстояниях результаты могут изредка расходиться
+    size_t n_common = countCommonMatches(mutual_matches, mutual_matches_two_pass);
+    EXPECT_GT(n_common, 0.99 * mutual_matches_two_pass.size());
+    EXPECT_GT(n_common, 0.99 * mutual_matches.size());
+
+#if ENABLE_GPU_BRUTEFORCE_MATCHER
+    std::vector<cv::DMatch> mutual_matches_gpu;
+    phg::BruteforceMatcherGPU matcher_gpu;
+    matcher_gpu.train(descriptors2);
+    matcher_gpu.matchMutual(descriptors1, mutual_matches_gpu);
+
+    EXPECT_GT(countCommonMatches(mutual_matches_gpu, mutual_matches), 0.99 * mutual_matches.size());
+    EXPECT_GT(countCommonMatches(mutual_matches_gpu, mutual_matches), 0.99 * mutual_matches_gpu.size());
+#endif
+}
+
+TEST (MATCHING, FusedRatioTest) {
+    cv::Mat img1, img2;
+    std::vector<cv::KeyPoint> keypoints1, keypoints2;
+    cv::Mat descriptors1, descriptors2;
+    detectHikingSIFT(img1, img2, keypoints1, keypoints2, descriptors1, descriptors2);
+
+    const float ratio = 0.7f;
+
+    {
+        phg::BruteforceMatcher matcher;
+        matcher.train(descriptors2);
+
+        timer tm;
+        std::vector<std::vector<cv::DMatch>> knn_matches;
+        std::vector<cv::DMatch> matches;
+        matcher.knnMatch(descriptors1, knn_matches, 2);
+        phg::DescriptorMatcher::filterMatchesRatioTest(knn_matches, ratio, matches);
+        double time_knn = tm.elapsed();
+
+        tm.restart();
+        std::vector<cv::DMatch> matches_fused;
+        matcher.matchRatio(descriptors1, ratio, matches_fused);
+        double time_fused = tm.elapsed();
+
+        std::cout << "bruteforce ratio test: " << matches_fused.size() << " matches, knn + filter time: " << time_knn << " s, fused time: " << time_fused << " s" << std::endl;
+
+        size_t n_common = countCommonMatches(matches, matches_fused);
+        EXPECT_GT(n_common, 0.99 * matches.size());
+        EXPECT_GT(n_common, 0.99 * matches_fused.size());
+    }
+
+    {
+        phg::FlannMatcher matcher;
+        matcher.train(descriptors2);
+
+        std::vector<std::vector<cv::DMatch>> knn_matches;
+        std::vector<cv::DMatch> matches;
+        matcher.knnMatch(descriptors1, knn_matches, 2);
+        phg::DescriptorMatcher::filterMatchesRatioTest(knn_matches, ratio, matches);
+
+        std::vector<cv::DMatch> matches_fused;
+        matcher.matchRatio(descriptors1, ratio, matches_fused);
+
+        // тот же поиск, отличие только в сравнении квадратов расстояний вместо самих расстояний
+        size_t n_common = countCommonMatches(matches, matches_fused);
+        EXPECT_GT(n_common, 0.999 * matches.size());
+        EXPECT_GT(n_common, 0.999 * matches_fused.size());
+    }
+
+#if ENABLE_GPU_BRUTEFORCE_MATCHER
+    {
+        std::vector<cv::DMatch> matches;
+        phg::BruteforceMatcher matcher;
+        matcher.train(descriptors2);
+        matcher.matchRatio(descriptors1, ratio, matches);
+
+        std::vector<cv::DMatch> matches_gpu;
+        phg::BruteforceMatcherGPU matcher_gpu;
+        matcher_gpu.train(descriptors2);
+        matcher_gpu.matchRatio(descriptors1, ratio, matches_gpu);
+
+        EXPECT_GT(countCommonMatches(matches_gpu, matches), 0.99 * matches.size());
+        EXPECT_GT(countCommonMatches(matches_gpu, matches), 0.99 * matches_gpu.size());
+    }
+#endif
+
+    // все реализации одинаково отвергают ratio вне (0, 1]
+    {
+        phg::BruteforceMatcher bruteforce;
+        bruteforce.train(descriptors2);
+        phg::FlannMatcher flann;
+        flann.train(descriptors2);
+        std::vector<cv::DMatch> matches;
+        for (float bad_ratio : {0.f, -0.5f, 1.5f}) {
+            EXPECT_THROW(bruteforce.matchRatio(descriptors1, bad_ratio, matches), std::runtime_error);
+            EXPECT_THROW(flann.matchRatio(descriptors1, bad_ratio, matches), std::runtime_error);
+        }
+    }
+}
+
+TEST (MATCHING, FlannBatchedQueries) {
+    cv::Mat img1, img2;
+    std::vector<cv::KeyPoint> keypoints1, keypoints2;
+    cv::Mat descriptors1, descriptors2;
+    detectHikingSIFT(img1, img2, keypoints1, keypoints2, descriptors1, descriptors2);
+
+    // матчер не должен менять глобальный генератор
+    cv::setRNGSeed(239);
+    const uint64_t rng_state = cv::theRNG().state;
+
+    phg::FlannMatcher matcher;
+    matcher.train(descriptors2);
+
+    // результат перезаписывается, а не дописывается
+    std::vector<std::vector<cv::DMatch>> knn_matches(10);
+    matcher.knnMatch(descriptors1, knn_matches, 2);
+    ASSERT_EQ(knn_matches.size(), descriptors1.rows);
+
+    EXPECT_EQ(cv::theRNG().state, rng_state);
+
+    // блоки считаются параллельно, но порядок и результат от запуска к запуску одинаковые
+    for (int run = 0; run < 3; ++run) {
+        std::vector<std::vector<cv::DMatch>> knn_matches_again;
+        matcher.knnMatch(descriptors1, knn_matches_again, 2);
+        ASSERT_EQ(knn_matches_again.size(), knn_matches.size());
+        for (size_t qi = 0; qi < knn_matches.size(); ++qi) {
+            ASSERT_EQ(knn_matches_again[qi].size(), 2);
+            for (int ki = 0; ki < 2; ++ki) {
+                EXPECT_EQ(knn_matches_again[qi][ki].queryIdx, (int) qi);
+                EXPECT_EQ(knn_matches_again[qi][ki].trainIdx, knn_matches[qi][ki].trainIdx);
+                EXPECT_EQ(knn_matches_again[qi][ki].distance, knn_matches[qi][ki].distance);
+            }
+        }
+    }
+
+    std::vector<cv::DMatch> ratio_matches;
+    matcher.matchRatio(descriptors1, 0.7f, ratio_matches);
+    EXPECT_GT(ratio_matches.size(), 0);
+    EXPECT_EQ(cv::theRNG().state, rng_state);
+}
+
+TEST (MATCHING, PartialDistanceBruteforce) {
+    cv::Mat img1, img2;
+    std::vector<cv::KeyPoint> keypoints1, keypoints2;
+    cv::Mat descriptors1, descriptors2;
+    detectHikingSIFT(img1, img2, keypoints1, keypoints2, descriptors1, descriptors2);
+
+    phg::BruteforceMatcher matcher;
+    phg::BruteforceMatcher matcher_partial(true);
+    matcher.train(descriptors2);
+    matcher_partial.train(descriptors2);
+
+    timer tm;
+    phg::KnnMatches knn_matches;
+    matcher.knnMatchFlat(descriptors1, knn_matches, 2);
+    double time_full = tm.elapsed();
+
+    tm.restart();
+    phg::KnnMatches knn_matches_partial;
+    matcher_partial.knnMatchFlat(descriptors1, knn_matches_partial, 2);
+    double time_partial = tm.elapsed();
+
+    std::cout << "full distance: " << time_full << " s, partial distance: " << time_partial << " s" << std::endl;
+
+    // результат тот же с точностью до порядка суммирования измерений
+    ASSERT_EQ(knn_matches_partial.nquery, knn_matches.nquery);
+    for (int qi = 0; qi < knn_matches.nquery; ++qi) {
+        EXPECT_NEAR(knn_matches_partial.distance[2 * qi], knn_matches.distance[2 * qi], 1e-2f);
+    }
+    EXPECT_GT(countSameKnn(knn_matches_partial, knn_matches), 0.999 * knn_matches.nquery);
+
+    std::vector<cv::DMatch> ratio_matches, ratio_matches_partial;
+    matcher.matchRatio(descriptors1, 0.7f, ratio_matches);
+    matcher_partial.matchRatio(descriptors1, 0.7f, ratio_matches_partial);
+    EXPECT_GT(countCommonMatches(ratio_matches, ratio_matches_partial), 0.999 * ratio_matches.size());
+
+    // произвольное k - отсечение по k-му лучшему
+    const int k = 4;
+    std::vector<std::vector<cv::DMatch>> knn4, knn4_partial;
+    matcher.knnMatch(descriptors1, knn4, k);
+    matcher_partial.knnMatch(descriptors1, knn4_partial, k);
+    ASSERT_EQ(knn4_partial.size(), knn4.size());
+    for (size_t qi = 0; qi < knn4.size(); ++qi) {
+        ASSERT_EQ(knn4_partial[qi].size(), k);
+    }
+    EXPECT_GT(countSameKnn(knn4_partial, knn4), 0.99 * knn4.size());
+}
+
+TEST (MATCHING, StreamingMatcher) {
+    cv::Mat img1, img2;
+    std::vector<cv::KeyPoint> keypoints1, keypoints2;
+    cv::Mat descriptors1, descriptors2;
+    detectHikingSIFT(img1, img2, keypoints1, keypoints2, descriptors1, descriptors2);
+
+    phg::KnnMatches knn_matches;
+    bruteforceKnnMatch(descriptors1, descriptors2, knn_matches, 2);
+
+    std::string path = "data/debug/test_matching/" + getTestSuiteName() + "_" + getTestName() + "_" + "descriptors.bin";
+    phg::StreamingMatcher::saveDescriptors(descriptors2, path);
+
+    // маленькие куски - чтобы train дескрипторы заведомо читались в несколько заходов
+    const size_t chunk_size = 100 * 1024;
+    ASSERT_GT(descriptors2.total() * sizeof(float), 10 * chunk_size);
+
+    phg::StreamingMatcher matcher_memory(chunk_size);
+    phg::StreamingMatcher matcher_file(chunk_size);
+    matcher_memory.train(descriptors2);
+    matcher_file.train(path);
+
+    for (int from_file = 0; from_file < 2; ++from_file) {
+        const phg::StreamingMatcher &matcher = from_file ? matcher_file : matcher_memory;
+
+        timer tm;
+        phg::KnnMatches knn_matches_streaming;
+        matcher.knnMatchFlat(descriptors1, knn_matches_streaming, 2);
+        std::cout << (from_file ? "file" : "memory") << " streaming knn: " << tm.elapsed() << " s" << std::endl;
+
+        // тот же точный перебор, только по кускам
+        ASSERT_EQ(knn_matches_streaming.nquery, knn_matches.nquery);
+        ASSERT_EQ(knn_matches_streaming.k, 2);
+        for (int qi = 0; qi < knn_matches.nquery; ++qi) {
+            EXPECT_LE(knn_matches_streaming.distance[2 * qi], knn_matches_streaming.distance[2 * qi + 1]);
+        }
+        EXPECT_GT(countSameKnn(knn_matches_streaming, knn_matches), 0.999 * knn_matches.nquery);
+
+        const int k = 5;
+        std::vector<std::vector<cv::DMatch>> knn5;
+        matcher.knnMatch(descriptors1, knn5, k);
+        ASSERT_EQ(knn5.size(), descriptors1.rows);
+        for (const auto &dst : knn5) {
+            ASSERT_EQ(dst.size(), k);
+            EXPECT_TRUE(std::is_sorted(dst.begin(), dst.end()));
+        }
+    }
+}
+
+TEST (MATCHING, TiledGPUBruteforce) {
+#if ENABLE_GPU_BRUTEFORCE_MATCHER
+    // считаем на CPU OpenCL устройстве (например POCL), чтобы тест проверял кернелы и на машинах без видеокарты,
+    // если его нет - на устройстве по умолчанию, если нет никакого OpenCL устройства - тест пропускается
+    const bool cpu_device = phg::BruteforceMatcherGPU::hasDevice(true);
+    if (!cpu_device && !phg::BruteforceMatcherGPU::hasDevice(false)) {
+        GTEST_SKIP() << "no OpenCL device found";
+    }
+
+    cv::Mat img1, img2;
+    std::vector<cv::KeyPoint> keypoints1, keypoints2;
+    cv::Mat descriptors1, descriptors2;
+    detectHikingSIFT(img1, img2, keypoints1, keypoints2, descriptors1, descriptors2);
+
+    phg::BruteforceMatcher matcher_cpu;
+    matcher_cpu.train(descriptors2);
+    phg::KnnMatches knn_matches_cpu;
+    matcher_cpu.knnMatchFlat(descriptors1, knn_matches_cpu, 2);
+
+    phg::BruteforceMatcherGPU matcher_reduction(false, cpu_device);
+    phg::BruteforceMatcherGPU matcher_tiled(true, cpu_device);
+    matcher_reduction.train(descriptors2);
+    matcher_tiled.train(descriptors2);
+
+    timer tm;
+    phg::KnnMatches knn_matches_reduction;
+    matcher_reduction.knnMatchFlat(descriptors1, knn_matches_reduction, 2);
+    double time_reduction = tm.elapsed();
+
+    tm.restart();
+    phg::KnnMatches knn_matches_tiled;
+    matcher_tiled.knnMatchFlat(descriptors1, knn_matches_tiled, 2);
+    double time_tiled = tm.elapsed();
+
+    std::cout << (cpu_device ? "CPU" : "default") << " OpenCL device, reduction kernel: " << time_reduction << " s, tiled kernel: " << time_tiled << " s" << std::endl;
+
+    ASSERT_EQ(knn_matches_tiled.nquery, knn_matches_cpu.nquery);
+    for (int qi = 0; qi < knn_matches_cpu.nquery; ++qi) {
+        EXPECT_NEAR(knn_matches_tiled.distance[2 * qi], knn_matches_cpu.distance[2 * qi], 1e-2f);
+        EXPECT_LE(knn_matches_tiled.distance[2 * qi], knn_matches_tiled.distance[2 * qi + 1]);
+    }
+    EXPECT_GT(countSameKnn(knn_matches_tiled, knn_matches_cpu), 0.999 * knn_matches_cpu.nquery);
+
+    const float ratio = 0.7f;
+    std::vector<cv::DMatch> ratio_matches_cpu, ratio_matches_tiled;
+    matcher_cpu.matchRatio(descriptors1, ratio, ratio_matches_cpu);
+    matcher_tiled.matchRatio(descriptors1, ratio, ratio_matches_tiled);
+    EXPECT_GT(countCommonMatches(ratio_matches_tiled, ratio_matches_cpu), 0.999 * ratio_matches_cpu.size());
+    EXPECT_GT(countCommonMatches(ratio_matches_tiled, ratio_matches_cpu), 0.999 * ratio_matches_tiled.size());
+
+    std::vector<cv::DMatch> mutual_matches_cpu, mutual_matches_tiled;
+    matcher_cpu.matchMutual(descriptors1, mutual_matches_cpu);
+    matcher_tiled.matchMutual(descriptors1, mutual_matches_tiled);
+    EXPECT_GT(countCommonMatches(mutual_matches_tiled, mutual_matches_cpu), 0.99 * mutual_matches_cpu.size());
+    EXPECT_GT(countCommonMatches(mutual_matches_tiled, mutual_matches_cpu), 0.99 * mutual_matches_tiled.size());
+#endif
+}
+
+TEST (MATCHING, FlatKnnMatches) {
+    cv::Mat img1, img2;
+    std::vector<cv::KeyPoint> keypoints1, keypoints2;
+    cv::Mat descriptors1, descriptors2;
+    detectHikingSIFT(img1, img2, keypoints1, keypoints2, descriptors1, descriptors2);
+
+    std::vector<std::unique_ptr<phg::DescriptorMatcher>> matchers;
+    matchers.emplace_back(new phg::BruteforceMatcher);
+    matchers.emplace_back(new phg::FlannMatcher);
+#if ENABLE_GPU_BRUTEFORCE_MATCHER
+    matchers.emplace_back(new phg::BruteforceMatcherGPU);
+#endif
+
+    for (const auto &matcher : matchers) {
+        matcher->train(descriptors2);
+
+        timer tm;
+        std::vector<std::vector<cv::DMatch>> knn_matches;
+        matcher->knnMatch(descriptors1, knn_matches, 2);
+        double time_nested = tm.elapsed();
+
+        tm.restart();
+        phg::KnnMatches knn_matches_flat;
+        matcher->knnMatchFlat(descriptors1, knn_matches_flat, 2);
+        double time_flat = tm.elapsed();
+
+        std::cout << "nested knn: " << time_nested << " s, flat knn: " << time_flat << " s" << std::endl;
+
+        ASSERT_EQ(knn_matches_flat.nquery, descriptors1.rows);
+        ASSERT_EQ(knn_matches_flat.k, 2);
+        ASSERT_EQ(knn_matches_flat.train_idx.size(), 2 * (size_t) descriptors1.rows);
+
+        for (int qi = 0; qi < knn_matches_flat.nquery; ++qi) {
+            EXPECT_LE(knn_matches_flat.distance[2 * qi], knn_matches_flat.distance[2 * qi + 1]);
+        }
+        EXPECT_GT(countSameKnn(knn_matches_flat, knn_matches), 0.99 * descriptors1.rows);
+
+        std::vector<cv::DMatch> good_matches, good_matches_flat;
+        phg::DescriptorMatcher::filterMatchesRatioTest(knn_matches, good_matches);
+        phg::DescriptorMatcher::filterMatchesRatioTest(knn_matches_flat, good_matches_flat);
+        size_t n_common = countCommonMatches(good_matches, good_matches_flat);
+        EXPECT_GT(n_common, 0.99 * good_matches.size());
+        EXPECT_GT(n_common, 0.99 * good_matches_flat.size());
+    }
+}
+
+TEST (MATCHING, MatchGraph) {
+
+    const int nimages = 10;
+
+    // случайные матчи для части пар, добавляются параллельно и в произвольном порядке
+    std::vector<std::vector<std::vector<cv::DMatch>>> matches(nimages, std::vector<std::vector<cv::DMatch>>(nimages));
+    for (int i = 0; i < nimages; ++i) {
+        for (int j = 0; j < nimages; ++j) {
+            if (i == j || (i + j) % 3 == 0) {
+                continue;
+            }
+            cv::RNG r(i * nimages + j);
+            int n = r.uniform(0, 2000);
+            for (int k = 0; k < n; ++k) {
+                matches[i][j].emplace_back(r.uniform(0, 100000), r.uniform(0, 100000), j, r.uniform(0.f, 512.f));
+            }
+        }
+    }
+
+    phg::MatchGraph graph(nimages);
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int ij = nimages * nimages - 1; ij >= 0; --ij) {
+        int i = ij / nimages, j = ij % nimages;
+        if (!matches[i][j].empty()) {
+            graph.addMatches(i, j, matches[i][j]);
+        }
+    }
+    graph.finalize();
+
+    std::string path = "data/debug/test_matching/" + getTestSuiteName() + "_" + getTestName() + "_" + "match_graph.bin";
+    graph.save(path);
+
+    phg::MatchGraph loaded;
+    loaded.load(path);
+
+    ASSERT_EQ(loaded.nimages(), nimages);
+    ASSERT_EQ(loaded.npairs(), graph.npairs());
+    ASSERT_EQ(loaded.nmatches(), graph.nmatches());
+
+    for (const phg::MatchGraph *g : {&graph, &loaded}) {
+        for (int i = 0; i < nimages; ++i) {
+            for (int j = 0; j < nimages; ++j) {
+                std::vector<cv::DMatch> result;
+                g->getMatches(i, j, result);
+                ASSERT_EQ(result.size(), matches[i][j].size());
+                ASSERT_EQ(g->nmatches(i, j), matches[i][j].size());
+                for (size_t k = 0; k < result.size(); ++k) {
+                    EXPECT_EQ(result[k].queryIdx, matches[i][j][k].queryIdx);
+                    EXPECT_EQ(result[k].trainIdx, matches[i][j][k].trainIdx);
+                    EXPECT_EQ(result[k].imgIdx, j);
+                    // half-float: 11 бит мантиссы
+                    EXPECT_NEAR(result[k].distance, matches[i][j][k].distance, matches[i][j][k].distance / 1024);
+                }
+            }
+        }
+    }
+
+    // испорченные файлы должны отвергаться при загрузке, а не приводить к чтению за пределами массивов
+    std::vector<char> bytes;
+    {
+        std::ifstream in(path, std::ios::binary);
+        bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+    auto loadCorrupted = [&](const std::vector<char> &corrupted) {
+        std::string corrupted_path = path + ".corrupted";
+        {
+            std::ofstream out(corrupted_path, std::ios::binary);
+            out.write(corrupted.data(), corrupted.size());
+        }
+        phg::MatchGraph g;
+        g.load(corrupted_path);
+    };
+
+    // обрезанный файл
+    EXPECT_THROW(loadCorrupted(std::vector<char>(bytes.begin(), bytes.begin() + bytes.size() / 2)), std::runtime_error);
+
+    // заголовок 32 байта, затем nimages + 1 смещений по 8 байт, затем записи пар: uint32 img_train, uint32 nmatches, uint64 offset
+    const size_t pairs_section = 32 + (nimages + 1) * 8;
+    std::vector<char> corrupted = bytes;
+    uint32_t bad_image = nimages;
+    std::memcpy(corrupted.data() + pairs_section, &bad_image, sizeof(bad_image));
+    EXPECT_THROW(loadCorrupted(corrupted), std::runtime_error);
+
+    corrupted = bytes;
+    uint64_t bad_offset = std::numeric_limits<uint64_t>::max() - 1;
+    std::memcpy(corrupted.data() + pairs_section + 8, &bad_offset, sizeof(bad_offset));
+    EXPECT_THROW(loadCorrupted(corrupted), std::runtime_error);
+}
+
+TEST (MATCHING, PairScheduler) {
+
+    const int nimages = 12;
+
+    // матчи "сопоставления" q -> t детерминированно зависят от упорядоченной пары, разные в двух направлениях
+    auto expectedMatches = [](int img_query, int img_train) {
+        std::vector<cv::DMatch> matches;
+        cv::RNG r(img_query * nimages + img_train);
+        int n = r.uniform(1, 500);
+        for (int k = 0; k < n; ++k) {
+            matches.emplace_back(r.uniform(0, 10000), r.uniform(0, 10000), img_train, r.uniform(0.f, 512.f));
+        }
+        return matches;
+    };
+
+    // сопоставляются все пары кроме тех, где сумма номеров кратна 4, стоимость пар сильно разная
+    phg::PairScheduler scheduler(nimages);
+    for (int i = 0; i < nimages; ++i) {
+        for (int j = i + 1; j < nimages; ++j) {
+            if ((i + j) % 4 != 0) {
+                scheduler.addPair(j, i, (i + 1) * (j + 1) * (j + 1));
+            }
+        }
+    }
+
+    std::vector<std::atomic<int>> ncalls(nimages * nimages);
+    for (auto &n : ncalls) {
+        n = 0;
+    }
+
+    phg::MatchGraph graph(nimages);
+    scheduler.run([&](int img_query, int img_train, std::vector<cv::DMatch> &matches) {
+        ++ncalls[img_query * nimages + img_train];
+        matches = expectedMatches(img_query, img_train);
+    }, graph, false);
+    graph.finalize();
+
+    for (int i = 0; i < nimages; ++i) {
+        for (int j = 0; j < nimages; ++j) {
+            const bool scheduled = i != j && (i + j) % 4 != 0;
+            // каждая пара сопоставлена ровно один раз в каждую сторону
+            EXPECT_EQ(ncalls[i * nimages + j].load(), scheduled ? 1 : 0);
+
+            std::vector<cv::DMatch> result;
+            graph.getMatches(i, j, result);
+            std::vector<cv::DMatch> expected;
+            if (scheduled) {
+                expected = expectedMatches(i, j);
+            }
+            // в графе в каждой стороне - собственное сопоставление этого направления, а не перестановка другого
+            ASSERT_EQ(result.size(), expected.size());
+            for (size_t k = 0; k < result.size(); ++k) {
+                EXPECT_EQ(result[k].queryIdx, expected[k].queryIdx);
+                EXPECT_EQ(result[k].trainIdx, expected[k].trainIdx);
+                EXPECT_EQ(result[k].imgIdx, j);
+            }
+        }
+    }
+}
+
+TEST (MATCHING, VocabularyTree) {
+    // база: пара перекрывающихся снимков hiking, три снимка ortho (тоже перекрываются друг с другом) и копия hiking_left
+    std::vector<std::string> paths = {
+            "data/src/test_matching/hiking_left.JPG",
+            "data/src/test_matching/hiking_right.JPG",
+            "data/src/test_matching/ortho/IMG_160729_071349_0000_RGB.JPG",
+            "data/src/test_matching/ortho/IMG_160729_071351_0001_RGB.JPG",
+            "data/src/test_matching/ortho/IMG_160729_071353_0002_RGB.JPG",
+    };
+    std::vector<cv::Mat> descriptors(paths.size());
+    cv::Mat all_descriptors;
+    for (size_t i = 0; i < paths.size(); ++i) {
+        cv::Mat img = cv::imread(paths[i]);
+        if (i >= 2) {
+            cv::pyrDown(img, img);
+        }
+        std::vector<cv::KeyPoint> keypoints;
+        detectSIFT(img, keypoints, descriptors[i]);
+        all_descriptors.push_back(descriptors[i]);
+    }
+
+    phg::VocabularyTree vocabulary(8, 3);
+    vocabulary.train(all_descriptors);
+    EXPECT_GT(vocabulary.nwords(), 8);
+    EXPECT_LE(vocabulary.nwords(), 8 * 8 * 8);
+
+    std::vector<int> words, words_again;
+    vocabulary.quantize(descriptors[0], words);
+    vocabulary.quantize(descriptors[0], words_again);
+    EXPECT_EQ(words, words_again);
+
+    std::string path = "data/debug/test_matching/" + getTestSuiteName() + "_" + getTestName() + "_" + "vocabulary_tree.bin";
+    vocabulary.save(path);
+    phg::VocabularyTree loaded;
+    loaded.load(path);
+    EXPECT_EQ(loaded.nwords(), vocabulary.nwords());
+    for (const cv::Mat &desc : descriptors) {
+        vocabulary.quantize(desc, words);
+        loaded.quantize(desc, words_again);
+        EXPECT_EQ(words, words_again);
+    }
+
+    // испорченное дерево должно отвергаться при загрузке, а не приводить к зацикливанию или выходу за массивы в quantize/build
+    std::vector<char> bytes;
+    {
+        std::ifstream in(path, std::ios::binary);
+        bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+    auto loadCorrupted = [&](size_t offset, int32_t value) {
+        std::vector<char> corrupted = bytes;
+        std::memcpy(corrupted.data() + offset, &value, sizeof(value));
+        std::string corrupted_path = path + ".corrupted";
+        {
+            std::ofstream out(corrupted_path, std::ios::binary);
+            out.write(corrupted.data(), corrupted.size());
+        }
+        phg::VocabularyTree v;
+        v.load(corrupted_path);
+    };
+
+    // заголовок: magic (8 байт), int32 branching, depth, ndim, nnodes, nwords, затем узлы: int32 first_child, nchildren, word
+    const size_t nodes_section = 8 + 5 * 4;
+    int32_t nnodes;
+    std::memcpy(&nnodes, bytes.data() + 8 + 3 * 4, sizeof(nnodes));
+    const size_t last_node = nodes_section + (nnodes - 1) * 12; // последний узел - всегда лист
+
+    EXPECT_THROW(loadCorrupted(nodes_section, 0), std::runtime_error);                                   // корень ссылается сам на себя
+    EXPECT_THROW(loadCorrupted(nodes_section, std::numeric_limits<int32_t>::max()), std::runtime_error); // переполнение first_child + nchildren
+    EXPECT_THROW(loadCorrupted(last_node + 8, -1), std::runtime_error);                                  // лист без слова
+    EXPECT_THROW(loadCorrupted(8, 9), std::runtime_error);                                               // branching не совпадает с деревом
+    EXPECT_THROW(loadCorrupted(8 + 4, 1), std::runtime_error);                                           // дерево глубже чем depth
+
+    phg::ImageRetrieval retrieval(loaded);
+    for (const cv::Mat &desc : descriptors) {
+        retrieval.addImage(desc);
+    }
+    const int copy_of_first = retrieval.addImage(descriptors[0]);
+    retrieval.build();
+
+    // сама картинка (ее копия) находится первой и с максимальной похожестью, за ней - перекрывающийся с ней снимок
+    std::vector<std::pair<int, float>> results;
+    retrieval.query(0, 3, results);
+    ASSERT_EQ(results.size(), 3);
+    EXPECT_EQ(results[0].first, copy_of_first);
+    EXPECT_NEAR(results[0].second, 1.0, 1e-4);
+    EXPECT_EQ(results[1].first, 1);
+
+    retrieval.query(1, 3, results);
+    ASSERT_FALSE(results.empty());
+    EXPECT_TRUE(results[0].first == 0 || results[0].first == copy_of_first);
+
+    // соседние снимки ortho находят друг друга раньше чем hiking
+    retrieval.query(3, 2, results);
+    ASSERT_EQ(results.size(), 2);
+    for (const auto &result : results) {
+        EXPECT_TRUE(result.first == 2 || result.first == 4);
+    }
+}
+
+TEST (MATCHING, PairSelection) {
+    const int n = 100;
+    std::vector<std::pair<int, int>> pairs;
+
+    phg::ExhaustivePairSelector exhaustive;
+    exhaustive.selectPairs(n, pairs);
+    EXPECT_EQ(pairs.size(), n * (n - 1) / 2);
+
+    const int window = 5;
+    phg::SequentialPairSelector sequential(window);
+    sequential.selectPairs(n, pairs);
+    EXPECT_EQ(pairs.size(), (n - window) * window + window * (window - 1) / 2);
+    for (const auto &pair : pairs) {
+        EXPECT_LT(pair.first, pair.second);
+        EXPECT_LE(pair.second - pair.first, window);
+    }
+
+    // пробы через каждые 10 картинок, петля замыкается только между картинками 10 и 90
+    const int probe_step = 10;
+    const int loop_radius = 2;
+    phg::LoopClosurePairSelector loop_closure(window, probe_step, 100, loop_radius);
+    loop_closure.selectPairs(n, pairs);
+    const size_t nprobes = (n / probe_step) * (n / probe_step - 1) / 2;
+    EXPECT_EQ(pairs.size(), (n - window) * window + window * (window - 1) / 2 + nprobes);
+    EXPECT_TRUE(std::is_sorted(pairs.begin(), pairs.end()));
+
+    loop_closure.selectAdditionalPairs(n, [](int i, int j) {
+        return (i == 10 && j == 90) ? (size_t) 500 : (size_t) 10;
+    }, pairs);
+    EXPECT_EQ(pairs.size(), (2 * loop_radius + 1) * (2 * loop_radius + 1) - 1);
+    for (const auto &pair : pairs) {
+        EXPECT_LE(std::abs(pair.first - 10), loop_radius);
+        EXPECT_LE(std::abs(pair.second - 90), loop_radius);
+    }
+}
+
+TEST (MATCHING, PairMatchCache) {
+    cv::Mat img1, img2;
+    std::vector<cv::KeyPoint> keypoints1, keypoints2;
+    cv::Mat descriptors1, descriptors2;
+    detectHikingSIFT(img1, img2, keypoints1, keypoints2, descriptors1, descriptors2);
+
+    phg::FlannMatcher matcher;
+    matcher.train(descriptors2);
+    std::vector<cv::DMatch> matches;
+    matcher.matchRatio(descriptors1, 0.7f, matches);
+    ASSERT_GT(matches.size(), 0);
+
+    const uint64_t hash1 = phg::PairMatchCache::hashFeatures(keypoints1, descriptors1);
+    const uint64_t hash2 = phg::PairMatchCache::hashFeatures(keypoints2, descriptors2);
+    EXPECT_NE(hash1, hash2);
+    EXPECT_EQ(hash1, phg::PairMatchCache::hashFeatures(keypoints1, descriptors1.clone()));
+    EXPECT_EQ(phg::PairMatchCache::hashValues({hash1, hash2}), phg::PairMatchCache::hashValues({hash1, hash2}));
+    EXPECT_NE(phg::PairMatchCache::hashValues({hash1, hash2}), phg::PairMatchCache::hashValues({hash2, hash1}));
+    EXPECT_NE(phg::PairMatchCache::hashValues({hash1, hash2}), phg::PairMatchCache::hashValues({hash1, hash2, 0}));
+
+    std::string path_prefix = "data/debug/test_matching/" + getTestSuiteName() + "_" + getTestName() + "_";
+    phg::PairMatchCache cache(path_prefix, "flann_ratio07");
+    cache.store(hash1, hash2, matches);
+
+    phg::PairMatchCache::Matches cached;
+    ASSERT_TRUE(cache.find(hash1, hash2, cached));
+    ASSERT_EQ(cached.size, matches.size());
+    for (size_t i = 0; i < matches.size(); ++i) {
+        EXPECT_EQ(cached.data[i].queryIdx, matches[i].queryIdx);
+        EXPECT_EQ(cached.data[i].trainIdx, matches[i].trainIdx);
+        EXPECT_EQ(cached.data[i].distance, matches[i].distance);
+    }
+
+    // пара упорядочена, а другие параметры или другие признаки - другой ключ
+    phg::PairMatchCache::Matches missing;
+    EXPECT_FALSE(cache.find(hash2, hash1, missing));
+    EXPECT_FALSE(phg::PairMatchCache(path_prefix, "flann_ratio08").find(hash1, hash2, missing));
+
+    std::vector<cv::KeyPoint> keypoints1_moved = keypoints1;
+    keypoints1_moved[0].pt.x += 1.0f;
+    EXPECT_FALSE(cache.find(phg::PairMatchCache::hashFeatures(keypoints1_moved, descriptors1), hash2, missing));
+
+    // пустой результат тоже кешируется
+    cache.store(hash2, hash1, std::vector<cv::DMatch>());
+    ASSERT_TRUE(cache.find(hash2, hash1, missing));
+    EXPECT_EQ(missing.size, 0);
+}
+
 TEST (STITCHING, SimplePanorama) {
 #if ENABLE_MY_MATCHING
     cv::Mat img1 = cv::imread("data/src/test_matching/hiking_left.JPG");
@@ -824,4 +2152,26 @@ TEST (STITCHING, Orthophoto) {
     std::cout << "n stable ortho kpts: : " << score << std::endl;
     EXPECT_GT(score, 7500);
 #endif
+}
+
+TEST (STITCHING, OrthophotoCoarseToFine) {
+#if ENABLE_MY_MATCHING
+    cv::Mat img1 = cv::imread("data/src/test_matching/ortho/IMG_160729_071349_0000_RGB.JPG");
+    cv::Mat img2 = cv::imread("data/src/test_matching/ortho/IMG_160729_071351_0001_RGB.JPG");
+    cv::Mat img3 = cv::imread("data/src/test_matching/ortho/IMG_160729_071353_0002_RGB.JPG");
+    cv::Mat img4 = cv::imread("data/src/test_matching/ortho/IMG_160729_071356_0003_RGB.JPG");
+    cv::Mat img5 = cv::imread("data/src/test_matching/ortho/IMG_160729_071358_0004_RGB.JPG");
+
+    timer tm;
+    std::function<cv::Mat(const cv::Mat&, const cv::Mat&)> homography_builder = [](const cv::Mat &lhs, const cv::Mat &rhs){ return getHomographyCoarseToFine(lhs, rhs); };
+    cv::Mat ortho = phg::stitchPanorama({img1, img2, img3, img4, img5}, {-1, 0, 1, 2, 3}, homography_builder);
+    std::cout << "coarse-to-fine stitching: " << tm.elapsed() << " s" << std::endl;
+    cv::imwrite("data/debug/test_matching/" + getTestSuiteName() + "_" + getTestName() + "_" + "ortho_root0.jpg", ortho);
+
+    // тот же порог что и для полного перебора
+    int threshold_px = 250;
+    int score = getOrthoScore(ortho, cv::imread("data/src/test_matching/ortho/ortho_root0.jpg"), threshold_px);
+    std::cout << "n stable ortho kpts: : " << score << std::endl;
+    EXPECT_GT(score, 7500);
+#endif
 }
\ No newline at end of file
@@ -6,6 +6,8 @@
 
 #include <libutils/timer.h>
 #include <phg/matching/gms_matcher.h>
+#include <phg/matching/guided_matcher.h>
+#include <phg/matching/descriptor_matcher.h>
 #include <phg/sfm/fmatrix.h>
 #include <phg/sfm/ematrix.h>
 #include <phg/sfm/sfm_utils.h>
@@ -13,6 +15,7 @@
 #include <Eigen/SVD>
 #include <phg/sfm/triangulation.h>
 #include <phg/sfm/resection.h>
+#include <phg/sfm/ransac.h>
 #include <phg/utils/point_cloud_export.h>
 
 #include "utils/test_utils.h"
@@ -104,6 +107,43 @@ namespace {
         return cos_vals;
     }
 
+    // прямая a*x + b*y + c = 0 (a^2 + b^2 = 1) по двум точкам - простейший Estimator для проверки phg::Ransac
+    class LineEstimator {
+    public:
+        typedef cv::Vec3d Model;
+        static const int sample_size = 2;
+
+        LineEstimator(const std::vector<cv::Vec2d> &pts) : pts(pts)
+        {}
+
+        int size() const
+        {
+            return (int) pts.size();
+        }
+
+        bool estimate(const std::vector<int> &sample, Model &line) const
+        {
+            cv::Vec2d d = pts[sample[1]] - pts[sample[0]];
+            double norm = cv::norm(d);
+            if (norm == 0) {
+                return false;
+            }
+            line[0] = -d[1] / norm;
+            line[1] = d[0] / norm;
+            line[2] = -(line[0] * pts[sample[0]][0] + line[1] * pts[sample[0]][1]);
+            return true;
+        }
+
+        double residual2(const Model &line, int i) const
+        {
+            double dist = line[0] * pts[i][0] + line[1] * pts[i][1] + line[2];
+            return dist * dist;
+        }
+
+    private:
+        const std::vector<cv::Vec2d> &pts;
+    };
+
 }
 
 #define TEST_EPIPOLAR_LINE(pt0, pt1, F, t, eps) \
@@ -211,6 +251,46 @@ TEST (SFM, FmatrixSimple) {
     EXPECT_TRUE(checkFmatrixSpectralProperty(Fcv));
 }
 
+TEST (SFM, RansacFramework) {
+
+    // 100 точек на прямой y = 2x + 1 с шумом меньше пикселя и 50 выбросов
+    std::vector<cv::Vec2d> pts;
+    cv::RNG rng(1);
+    for (int i = 0; i < 100; ++i) {
+        double x = rng.uniform(0.0, 100.0);
+        pts.push_back({x, 2 * x + 1 + rng.uniform(-0.5, 0.5)});
+    }
+    for (int i = 0; i < 50; ++i) {
+        pts.push_back({rng.uniform(0.0, 100.0), rng.uniform(0.0, 200.0)});
+    }
+
+    LineEstimator estimator(pts);
+    const double threshold_px = 1.0;
+    const int max_trials = 10000;
+
+    phg::Ransac<LineEstimator> msac(phg::RansacParams(threshold_px, max_trials));
+    phg::Ransac<LineEstimator>::Result result;
+    ASSERT_TRUE(msac.run(estimator, result));
+
+    std::cout << "MSAC: support: " << result.support << "/" << pts.size() << ", trials: " << result.trials << std::endl;
+    EXPECT_GE(result.support, 100);
+    EXPECT_LT(result.support, 110);
+    // доля инлаеров 2/3 - адаптивный критерий останова должен сработать задолго до max_trials
+    EXPECT_LT(result.trials, 100);
+    EXPECT_NEAR(std::abs(result.model[1] / result.model[0]), 0.5, 0.03);
+
+    phg::Ransac<LineEstimator, phg::RansacScorer> ransac(phg::RansacParams(threshold_px, max_trials));
+    phg::Ransac<LineEstimator, phg::RansacScorer>::Result result_ransac;
+    ASSERT_TRUE(ransac.run(estimator, result_ransac));
+    EXPECT_GE(result_ransac.support, 100);
+
+    // тот же seed - та же последовательность выборок
+    phg::Ransac<LineEstimator>::Result result_again;
+    ASSERT_TRUE(msac.run(estimator, result_again));
+    EXPECT_EQ(result_again.trials, result.trials);
+    EXPECT_EQ(result_again.support, result.support);
+}
+
 TEST (SFM, EmatrixSimple) {
 
     phg::Calibration calib(360, 240);
@@ -398,6 +478,70 @@ TEST (SFM, FmatrixMatchFiltering) {
     EXPECT_GT(good_matches_gms_plus_f.size(), 0.5 * good_matches_f.size());
 }
 
+TEST (SFM, EpipolarGuidedMatching) {
+
+    using namespace cv;
+
+    cv::Mat img1 = cv::imread("data/src/test_sfm/saharov/IMG_3023.JPG");
+    cv::Mat img2 = cv::imread("data/src/test_sfm/saharov/IMG_3024.JPG");
+
+    std::cout << "detecting points..." << std::endl;
+    cv::Ptr<cv::FeatureDetector> detector = cv::SIFT::create();
+    std::vector<cv::KeyPoint> keypoints1, keypoints2;
+    cv::Mat descriptors1, descriptors2;
+    detector->detectAndCompute( img1, cv::noArray(), keypoints1, descriptors1 );
+    detector->detectAndCompute( img2, cv::noArray(), keypoints2, descriptors2 );
+
+    std::cout << "matching points..." << std::endl;
+    std::vector<std::vector<DMatch>> knn_matches;
+    Ptr<DescriptorMatcher> matcher = DescriptorMatcher::create(DescriptorMatcher::FLANNBASED);
+    matcher->knnMatch( descriptors1, descriptors2, knn_matches, 2 );
+
+    std::vector<DMatch> good_matches;
+    phg::DescriptorMatcher::filterMatchesRatioTest(knn_matches, good_matches);
+
+    double threshold_px = 3;
+    std::vector<cv::Vec2d> points1, points2;
+    for (const cv::DMatch &match : good_matches) {
+        points1.push_back(cv::Vec2f(keypoints1[match.queryIdx].pt));
+        points2.push_back(cv::Vec2f(keypoints2[match.trainIdx].pt));
+    }
+    matrix3d F = phg::findFMatrix(points1, points2, threshold_px);
+
+    std::vector<DMatch> good_matches_f;
+    filterMatchesF(good_matches, keypoints1, keypoints2, F, good_matches_f, threshold_px);
+
+    std::cout << "guided matching..." << std::endl;
+    std::vector<std::vector<DMatch>> knn_matches_guided;
+    size_t ncompared;
+    timer t;
+    {
+        phg::EpipolarGuidedMatcher guided_matcher;
+        guided_matcher.train(descriptors2, keypoints2);
+        ncompared = guided_matcher.knnMatch(descriptors1, keypoints1, F, threshold_px, knn_matches_guided, 2);
+    }
+    double time_guided = t.elapsed();
+
+    std::vector<DMatch> good_matches_guided;
+    phg::DescriptorMatcher::filterMatchesRatioTest(knn_matches_guided, good_matches_guided);
+
+    double compared_fraction = (double) ncompared / ((double) descriptors1.rows * descriptors2.rows);
+
+    drawMatches(img1, img2, keypoints1, keypoints2, good_matches_guided, "data/debug/test_sfm/matches_guided.jpg");
+
+    std::cout << "n matches F: " << good_matches_f.size() << std::endl;
+    std::cout << "n matches guided: " << good_matches_guided.size() << std::endl;
+    std::cout << "guided matching: " << time_guided << " s, compared " << compared_fraction * 100 << "% of descriptor pairs" << std::endl;
+
+    // все guided матчи по построению удовлетворяют F
+    for (const DMatch &match : good_matches_guided) {
+        EXPECT_TRUE(phg::epipolarTest(cv::Vec2f(keypoints1[match.queryIdx].pt), cv::Vec2f(keypoints2[match.trainIdx].pt), F, threshold_px + 1e-3));
+    }
+
+    EXPECT_GT(good_matches_guided.size(), 1.2 * good_matches_f.size());
+    EXPECT_LT(compared_fraction, 0.1);
+}
+
 namespace {
 
     void transform(matrix3d &R, vector3d &O)
@@ -5,11 +5,20 @@
 #include <opencv2/highgui.hpp>
 #include <opencv2/features2d/features2d.hpp>
 
+#include <atomic>
 #include <fstream>
 #include <libutils/misc.h>
 #include <libutils/timer.h>
 #include <libutils/rasserts.h>
 #include <phg/matching/gms_matcher.h>
+#include <phg/matching/match_graph.h>
+#include <phg/matching/flann_matcher.h>
+#include <phg/matching/feature_index_cache.h>
+#include <phg/matching/descriptor_pca.h>
+#include <phg/matching/pair_match_cache.h>
+#include <phg/matching/pair_scheduler.h>
+#include <phg/matching/pair_selection.h>
+#include <phg/matching/vocabulary_tree.h>
 #include <phg/sfm/fmatrix.h>
 #include <phg/sfm/ematrix.h>
 #include <phg/sfm/sfm_utils.h>
@@ -33,6 +42,32 @@
 #define ENABLE_OUTLIERS_FILTRATION_COLINEAR   1
 #define ENABLE_OUTLIERS_FILTRATION_NEGATIVE_Z 1
 
+// вместо сопоставления всех пар картинок сопоставлять каждую картинку только с VOCABULARY_TREE_TOP_K самыми похожими (по словарю визуальных слов)
+#define ENABLE_VOCABULARY_TREE_PAIRS          1
+#define VOCABULARY_TREE_TOP_K                 20
+#define VOCABULARY_TREE_BRANCHING             10
+#define VOCABULARY_TREE_DEPTH                 4
+
+// для упорядоченной съемки (ordered_filenames.txt) сопоставлять каждую картинку только с SEQUENTIAL_PAIRS_WINDOW следующими
+// плюс дальние пробы через каждые LOOP_CLOSURE_PROBE_STEP картинок для поиска замыканий петель, 0 - сопоставлять все пары
+#define SEQUENTIAL_PAIRS_WINDOW               0
+#define LOOP_CLOSURE_PROBE_STEP               10
+
+// сохранять результат сопоставления на диск и при повторном запуске загружать его вместо сопоставления
+// (признаки, выбор пар и параметры сопоставления входят в имя файла, так что при их изменении граф собирается заново - с кешем пар ниже)
+#define ENABLE_MATCH_GRAPH_CACHE              1
+
+// кеш проверенных сопоставлений каждой пары картинок на диске с ключом (признаки обеих картинок, параметры сопоставления и фильтрации):
+// при повторном запуске сопоставляются только пары, для которых что-то из этого поменялось
+#define ENABLE_PAIR_MATCH_CACHE               1
+
+// сколько памяти (в мегабайтах, по оценке DescriptorMatcher::memoryUsage) могут занимать одновременно построенные FLANN индексы картинок, 0 - без ограничения
+#define FEATURE_INDEX_CACHE_MAX_MB            1024
+
+// FLANN индексы по PCA-проекциям дескрипторов (DESCRIPTOR_PCA_DIM вместо 128 измерений), кандидаты перепроверяются по полным дескрипторам
+#define ENABLE_DESCRIPTOR_PCA                 0
+#define DESCRIPTOR_PCA_DIM                    32
+
 //________________________________________________________________________________
 // Datasets:
 
@@ -182,40 +217,208 @@ TEST (SFM, ReconstructNViews) {
         track_ids[i].resize(keypoints[i].size(), -1);
     }
 
-    std::cout << "matching points..." << std::endl;
-    using Matches = std::vector<cv::DMatch>;
-    std::vector<std::vector<Matches>> matches(n_imgs);
-    size_t ndone = 0;
+    // какие пары картинок сопоставлять
+    std::vector<std::vector<char>> pairs_to_match(n_imgs, std::vector<char>(n_imgs, true));
+#if ENABLE_VOCABULARY_TREE_PAIRS
+    if (n_imgs > VOCABULARY_TREE_TOP_K + 1) {
+        std::cout << "selecting pairs via vocabulary tree..." << std::endl;
+
+        // словарь учится один раз и сохраняется на диск, при повторных запусках просто загружается
+        // все от чего зависит словарь входит в имя файла, так что при их изменении словарь учится заново
+        phg::VocabularyTree vocabulary(VOCABULARY_TREE_BRANCHING, VOCABULARY_TREE_DEPTH);
+        std::string vocabulary_path = std::string("data/debug/test_sfm_ba/") + DATASET_DIR + "/vocabulary_tree"
+                + "_sift_downscale" + to_string(DATASET_DOWNSCALE) + "_nimgs" + to_string(n_imgs)
+                + "_b" + to_string(VOCABULARY_TREE_BRANCHING) + "_d" + to_string(VOCABULARY_TREE_DEPTH) + ".bin";
+        if (std::ifstream(vocabulary_path)) {
+            vocabulary.load(vocabulary_path);
+        } else {
+            cv::Mat all_descriptors;
+            for (int i = 0; i < (int) n_imgs; ++i) {
+                all_descriptors.push_back(descriptors[i]);
+            }
+            vocabulary.train(all_descriptors);
+            vocabulary.save(vocabulary_path);
+        }
+
+        phg::ImageRetrieval retrieval(vocabulary);
+        for (int i = 0; i < (int) n_imgs; ++i) {
+            retrieval.addImage(descriptors[i]);
+        }
+        retrieval.build();
+
+        std::vector<std::pair<int, int>> pairs;
+        retrieval.selectPairs(VOCABULARY_TREE_TOP_K, pairs);
+        std::cout << pairs.size() << " pairs selected out of " << n_imgs * (n_imgs - 1) / 2 << std::endl;
+
+        pairs_to_match.assign(n_imgs, std::vector<char>(n_imgs, false));
+        for (const auto &pair : pairs) {
+            pairs_to_match[pair.first][pair.second] = true;
+            pairs_to_match[pair.second][pair.first] = true;
+        }
+    }
+#endif
+
+#if ENABLE_DESCRIPTOR_PCA
+    // PCA учится один раз на подвыборке дескрипторов всех картинок и сохраняется на диск рядом с остальными кешами
+    phg::DescriptorPCA pca(DESCRIPTOR_PCA_DIM);
+    std::string pca_path = std::string("data/debug/test_sfm_ba/") + DATASET_DIR + "/descriptor_pca_" + to_string(DESCRIPTOR_PCA_DIM) + ".bin";
+    if (std::ifstream(pca_path)) {
+        pca.load(pca_path);
+    } else {
+        cv::Mat sample;
+        for (int i = 0; i < n_imgs; ++i) {
+            for (int k = 0; k < descriptors[i].rows; k += 8) {
+                sample.push_back(descriptors[i].row(k));
+            }
+        }
+        pca.train(sample);
+        pca.save(pca_path);
+    }
+#endif
+
+    // все матчеры - копии этого (до обучения), из него же берутся параметры для ключей кешей
+    const phg::FlannMatcher flann_prototype;
+    const int knn_k = 2;
+#if ENABLE_DESCRIPTOR_PCA
+    const int pca_n_rerank = 8;
+#endif
+
+    // параметры сопоставления и фильтрации в ключах кешей собираются из тех же значений, с которыми работает сопоставление
+    std::string pair_match_params = flann_prototype.params() + "_knn" + to_string(knn_k) + "_" + phg::filterMatchesGMSParams();
+#if ENABLE_DESCRIPTOR_PCA
+    pair_match_params += "_pca" + to_string(pca.outputDim()) + "_r" + to_string(pca_n_rerank);
+#endif
+    std::vector<uint64_t> features_hashes(n_imgs);
     #pragma omp parallel for
     for (int i = 0; i < n_imgs; ++i) {
-        matches[i].resize(n_imgs);
+        features_hashes[i] = phg::PairMatchCache::hashFeatures(keypoints[i], descriptors[i]);
+    }
+
+    using Matches = std::vector<cv::DMatch>;
+    phg::MatchGraph match_graph(n_imgs);
+    // все от чего зависит граф сопоставлений входит в имя файла
+    std::string match_graph_path = std::string("data/debug/test_sfm_ba/") + DATASET_DIR + "/match_graph"
+            + "_sift_downscale" + to_string(DATASET_DOWNSCALE) + "_nimgs" + to_string(n_imgs);
+#if ENABLE_VOCABULARY_TREE_PAIRS
+    match_graph_path += "_vt" + to_string(VOCABULARY_TREE_TOP_K) + "_b" + to_string(VOCABULARY_TREE_BRANCHING) + "_d" + to_string(VOCABULARY_TREE_DEPTH);
+#endif
+#if SEQUENTIAL_PAIRS_WINDOW > 0
+    match_graph_path += "_seq" + to_string(SEQUENTIAL_PAIRS_WINDOW) + "_probe" + to_string(LOOP_CLOSURE_PROBE_STEP);
+#endif
+    // сами признаки и выбранные пары - хешем
+    std::vector<uint64_t> match_graph_inputs = features_hashes;
+    for (int i = 0; i < n_imgs; ++i) {
         for (int j = 0; j < n_imgs; ++j) {
-            if (i == j) {
-                continue;
+            match_graph_inputs.push_back(pairs_to_match[i][j]);
+        }
+    }
+    match_graph_path += "_" + pair_match_params + "_" + to_string(phg::PairMatchCache::hashValues(match_graph_inputs)) + ".bin";
+    bool match_graph_loaded = false;
+#if ENABLE_MATCH_GRAPH_CACHE
+    if (std::ifstream(match_graph_path)) {
+        // load только отображает файл, так что сначала проверяем его на отдельном графе, а пустой граф оставляем для сопоставления
+        phg::MatchGraph cached_graph;
+        cached_graph.load(match_graph_path);
+        if ((size_t) cached_graph.nimages() == n_imgs) {
+            match_graph.load(match_graph_path);
+            match_graph_loaded = true;
+            std::cout << "loaded " << match_graph.nmatches() << " matches of " << match_graph.npairs() << " pairs from " << match_graph_path << std::endl;
+        } else {
+            std::cout << match_graph_path << " was built for " << cached_graph.nimages() << " images instead of " << n_imgs << ", matching again" << std::endl;
+        }
+    }
+#endif
+    if (!match_graph_loaded) {
+        std::cout << "matching points..." << std::endl;
+
+        // FLANN индекс строится один раз на картинку (по первому запросу), а не на каждую пару
+        phg::FeatureIndexCache flann_indices(descriptors, [&]() {
+#if ENABLE_DESCRIPTOR_PCA
+            return std::unique_ptr<phg::DescriptorMatcher>(new phg::PCAMatcher(pca, std::unique_ptr<phg::DescriptorMatcher>(new phg::FlannMatcher(flann_prototype)), pca_n_rerank));
+#else
+            return std::unique_ptr<phg::DescriptorMatcher>(new phg::FlannMatcher(flann_prototype));
+#endif
+        }, (size_t) FEATURE_INDEX_CACHE_MAX_MB << 20);
+
+        // ячейки сеток GMS тоже зависят только от картинки
+        std::vector<phg::GMSImageGrid> gms_grids(n_imgs);
+        #pragma omp parallel for
+        for (int i = 0; i < n_imgs; ++i) {
+            gms_grids[i] = phg::GMSImageGrid(keypoints[i], imgs[i].size());
+        }
+
+#if SEQUENTIAL_PAIRS_WINDOW > 0
+        phg::LoopClosurePairSelector pair_selector(SEQUENTIAL_PAIRS_WINDOW, LOOP_CLOSURE_PROBE_STEP);
+#else
+        phg::ExhaustivePairSelector pair_selector;
+#endif
+
+        // сколько сопоставлений нашлось в паре - нужно для подтверждения замыканий петель
+        std::vector<std::vector<size_t>> pairs_nmatches(n_imgs, std::vector<size_t>(n_imgs, 0));
+
+#if ENABLE_PAIR_MATCH_CACHE
+        phg::PairMatchCache pair_match_cache(std::string("data/debug/test_sfm_ba/") + DATASET_DIR + "/pair_matches_", pair_match_params);
+        std::atomic<size_t> npairs_cached(0);
+#endif
+
+        auto match_pair = [&](int i, int j, std::vector<cv::DMatch> &good_matches_gms) {
+#if ENABLE_PAIR_MATCH_CACHE
+            phg::PairMatchCache::Matches cached_matches;
+            if (pair_match_cache.find(features_hashes[i], features_hashes[j], cached_matches)) {
+                good_matches_gms.assign(cached_matches.begin(), cached_matches.end());
+                pairs_nmatches[i][j] = good_matches_gms.size();
+                ++npairs_cached;
+                return;
             }
+#endif
 
             // Flann matching
             std::vector<std::vector<DMatch>> knn_matches;
-            Ptr<DescriptorMatcher> matcher = DescriptorMatcher::create(DescriptorMatcher::FLANNBASED);
-            matcher->knnMatch( descriptors[i], descriptors[j], knn_matches, 2 );
+            flann_indices.get(j)->knnMatch(descriptors[i], knn_matches, knn_k);
             std::vector<DMatch> good_matches(knn_matches.size());
             for (int k = 0; k < (int) knn_matches.size(); ++k) {
                 good_matches[k] = knn_matches[k][0];
             }
 
             // Filtering matches GMS
-            std::vector<DMatch> good_matches_gms;
-            int inliers = phg::filterMatchesGMS(good_matches, keypoints[i], keypoints[j], imgs[i].size(), imgs[j].size(), good_matches_gms, false);
-            #pragma omp critical
-            {
-                ++ndone;
-                if (inliers > 0) {
-                    std::cout << to_percent(ndone, n_imgs * (n_imgs - 1)) + "% - Cameras " << i << "-" << j << " (" << imgs_labels[i] << "-" << imgs_labels[j] << "): " << inliers << " matches" << std::endl;
+            phg::filterMatchesGMS(good_matches, gms_grids[i], gms_grids[j], good_matches_gms, false);
+            pairs_nmatches[i][j] = good_matches_gms.size();
+
+#if ENABLE_PAIR_MATCH_CACHE
+            pair_match_cache.store(features_hashes[i], features_hashes[j], good_matches_gms);
+#endif
+        };
+
+        auto match_pairs = [&](const std::vector<std::pair<int, int>> &pairs) {
+            phg::PairScheduler scheduler(n_imgs);
+            for (const auto &pair : pairs) {
+                if (pairs_to_match[pair.first][pair.second]) {
+                    scheduler.addPair(pair.first, pair.second, (double) keypoints[pair.first].size() * keypoints[pair.second].size());
                 }
             }
-
-            matches[i][j] = good_matches_gms;
+            scheduler.setImageLabels(std::vector<std::string>(imgs_labels.begin(), imgs_labels.begin() + n_imgs));
+            std::cout << "matching " << scheduler.npairs() << " pairs..." << std::endl;
+            scheduler.run(match_pair, match_graph);
+        };
+
+        std::vector<std::pair<int, int>> pairs;
+        pair_selector.selectPairs(n_imgs, pairs);
+        match_pairs(pairs);
+
+        pair_selector.selectAdditionalPairs(n_imgs, [&](int i, int j) { return pairs_nmatches[i][j]; }, pairs);
+        if (!pairs.empty()) {
+            match_pairs(pairs);
         }
+
+#if ENABLE_PAIR_MATCH_CACHE
+        std::cout << npairs_cached << " pairs loaded from pair match cache" << std::endl;
+#endif
+        std::cout << "FLANN indices built " << flann_indices.nbuilds() << " times for " << n_imgs << " images" << std::endl;
+
+        match_graph.finalize();
+#if ENABLE_MATCH_GRAPH_CACHE
+        match_graph.save(match_graph_path);
+#endif
     }
 
     std::vector<Track> tracks;
@@ -227,7 +430,8 @@ TEST (SFM, ReconstructNViews) {
     {
         std::cout << "Initial alignment from cameras #0 and #1 (" << imgs_labels[0] << ", " << imgs_labels[1] << ")" << std::endl;
         // matches from first to second image in specified sequence
-        const Matches &good_matches_gms = matches[0][1];
+        Matches good_matches_gms;
+        match_graph.getMatches(0, 1, good_matches_gms);
         const std::vector<cv::KeyPoint> &keypoints0 = keypoints[0];
         const std::vector<cv::KeyPoint> &keypoints1 = keypoints[1];
         const phg::Calibration &calib0 = calib;
@@ -295,7 +499,8 @@ TEST (SFM, ReconstructNViews) {
         std::vector<vector3d> Xs;
         std::vector<vector2d> xs;
         for (int i_camera_prev = 0; i_camera_prev < i_camera; ++i_camera_prev) {
-            const Matches &good_matches_gms = matches[i_camera][i_camera_prev];
+            Matches good_matches_gms;
+            match_graph.getMatches(i_camera, i_camera_prev, good_matches_gms);
             for (const cv::DMatch &match : good_matches_gms) {
                 int track_id = track_ids[i_camera_prev][match.trainIdx];
                 if (track_id != -1) {
@@ -318,7 +523,8 @@ TEST (SFM, ReconstructNViews) {
         for (int i_camera_prev = 0; i_camera_prev < i_camera; ++i_camera_prev) {
             const std::vector<cv::KeyPoint> &keypoints1 = keypoints[i_camera_prev];
             const phg::Calibration &calib1 = calib;
-            const Matches &good_matches_gms = matches[i_camera][i_camera_prev];
+            Matches good_matches_gms;
+            match_graph.getMatches(i_camera, i_camera_prev, good_matches_gms);
             for (const cv::DMatch &match : good_matches_gms) {
                 int track_id = track_ids[i_camera_prev][match.trainIdx];
                 if (track_id == -1) {